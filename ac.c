@@ -0,0 +1,229 @@
+/* ac.c - Streaming multi-pattern (Aho-Corasick) matcher.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* The patterns go into a trie, then a breadth-first pass gives each
+ * state its failure link (the longest proper suffix of its path that
+ * is also a trie path) and fills in every missing transition from the
+ * failure state's.  The result is a complete DFA, so feeding a byte is
+ * one table lookup with no backtracking.  A state can end several
+ * patterns at once (a pattern that's a suffix of another); 'dict'
+ * chains those together so reporting them costs nothing when there's
+ * no match.  Tables are dense (1 KB per state), which is fine for the
+ * dozens-of-prompts sets this is for.  While the automaton sits at the
+ * root, only a pattern's first byte can move it, so ac_feed() uses
+ * scan_find() to skip straight to the next one when there are few
+ * enough distinct first bytes.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ac.h"
+
+
+/*
+ * Append a state with no transitions yet.  Returns its index or -1.
+ */
+static int32_t new_state(ac_matcher *m) {
+  int32_t s;
+
+  if (m->n_states == m->alloc_states) {
+    int n = m->alloc_states ? m->alloc_states * 2 : 64;
+    int32_t (*next)[256] = (int32_t (*)[256])realloc(m->next,
+                                                     n * sizeof(*next));
+    int32_t *match, *dict;
+    if (next == NULL) { return -1; }  /* Handle error. */
+    m->next = next;
+    match = (int32_t *)realloc(m->match, n * sizeof(int32_t));
+    if (match == NULL) { return -1; }  /* Handle error. */
+    m->match = match;
+    dict = (int32_t *)realloc(m->dict, n * sizeof(int32_t));
+    if (dict == NULL) { return -1; }  /* Handle error. */
+    m->dict = dict;
+    m->alloc_states = n;
+  }
+
+  s = m->n_states++;
+  memset(m->next[s], 0xff, sizeof(m->next[s]));  /* all -1 */
+  m->match[s] = -1;
+  m->dict[s] = -1;
+  return s;
+}  /* new_state */
+
+
+int ac_init(ac_matcher *m) {
+  memset(m, 0, sizeof(*m));
+  return (new_state(m) < 0) ? -1 : 0;
+}  /* ac_init */
+
+
+void ac_free(ac_matcher *m) {
+  free(m->next);
+  free(m->match);
+  free(m->dict);
+  free(m->pat_len);
+  memset(m, 0, sizeof(*m));
+}  /* ac_free */
+
+
+/*
+ * Add a pattern (before ac_build()).  Returns its id (0, 1, ... in
+ * order of adding), or -1 if it's empty or memory ran out.  A pattern
+ * added twice is only ever reported under its first id.
+ */
+int ac_add(ac_matcher *m, const char *pat, size_t len) {
+  int32_t s = 0;
+  size_t i, *pl;
+
+  if (len == 0 || m->built) { errno = EINVAL; return -1; }
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)pat[i];
+    if (m->next[s][c] < 0) {
+      int32_t t = new_state(m);
+      if (t < 0) { return -1; }  /* Handle error. */
+      m->next[s][c] = t;
+    }
+    s = m->next[s][c];
+  }
+
+  pl = (size_t *)realloc(m->pat_len, (m->n_pats + 1) * sizeof(size_t));
+  if (pl == NULL) { return -1; }  /* Handle error. */
+  m->pat_len = pl;
+  m->pat_len[m->n_pats] = len;
+  if (m->match[s] < 0)
+    m->match[s] = m->n_pats;
+  return m->n_pats++;
+}  /* ac_add */
+
+
+/*
+ * The id a pattern is reported under (before ac_build()), or -1 if it
+ * hasn't been added.
+ */
+int ac_lookup(const ac_matcher *m, const char *pat, size_t len) {
+  int32_t s = 0;
+  size_t i;
+
+  if (m->built) { return -1; }
+  for (i = 0; i < len; i++) {
+    s = m->next[s][(unsigned char)pat[i]];
+    if (s < 0) { return -1; }
+  }
+  return m->match[s];
+}  /* ac_lookup */
+
+
+size_t ac_pat_len(const ac_matcher *m, int id) {
+  return m->pat_len[id];
+}  /* ac_pat_len */
+
+
+/*
+ * Turn the trie into the complete DFA.  After this, patterns can't be
+ * added and the matcher can be fed.
+ */
+int ac_build(ac_matcher *m) {
+  int32_t *fail = (int32_t *)calloc(m->n_states, sizeof(int32_t));
+  int32_t *queue = (int32_t *)malloc(m->n_states * sizeof(int32_t));
+  int head = 0, tail = 0, c;
+
+  if (fail == NULL || queue == NULL) {
+    free(fail);
+    free(queue);
+    return -1;
+  }
+
+  /* Depth 1 fails to the root; the root's missing edges loop to it. */
+  scan_set_init(&m->lead);
+  for (c = 0; c < 256; c++) {
+    int32_t t = m->next[0][c];
+    if (t < 0) {
+      m->next[0][c] = 0;
+    } else {
+      fail[t] = 0;
+      queue[tail++] = t;
+      scan_set_add(&m->lead, (unsigned char)c);
+    }
+  }
+
+  /* Breadth-first, so a state's failure state is always done first.
+   * When a state is dequeued, its row still holds only trie edges. */
+  while (head < tail) {
+    int32_t s = queue[head++];
+    int32_t f = fail[s];
+
+    /* Nearest state on the failure chain that ends a pattern. */
+    m->dict[s] = (m->match[f] >= 0) ? f : m->dict[f];
+
+    for (c = 0; c < 256; c++) {
+      int32_t t = m->next[s][c];
+      if (t < 0) {
+        m->next[s][c] = m->next[f][c];
+      } else {
+        fail[t] = m->next[f][c];
+        queue[tail++] = t;
+      }
+    }
+  }
+
+  free(fail);
+  free(queue);
+  m->built = 1;
+  return 0;
+}  /* ac_build */
+
+
+void ac_stream_init(ac_stream *st) {
+  st->state = 0;
+  st->offset = 0;
+}  /* ac_stream_init */
+
+
+/*
+ * Run buf through the automaton, calling cb for every match (several
+ * may end on one byte; all are reported, longest first).  Returns the
+ * number of bytes consumed: all of them, unless cb asked to stop.
+ */
+size_t ac_feed(const ac_matcher *m, ac_stream *st, const char *buf,
+               size_t len, ac_match_fn cb, void *arg) {
+  const unsigned char *p = (const unsigned char *)buf;
+  int32_t s = st->state;
+  int skip = (m->lead.n <= SCAN_MAX_BYTES);
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    int32_t t;
+    int stop = 0;
+
+    if (s == 0 && skip) {
+      i += scan_find(&m->lead, buf + i, len - i);
+      if (i == len) break;
+    }
+    s = m->next[s][p[i]];
+    t = (m->match[s] >= 0) ? s : m->dict[s];
+    if (t < 0) continue;
+
+    for (; t >= 0; t = m->dict[t])
+      stop |= cb(arg, m->match[t], st->offset + i + 1);
+    if (stop) {
+      i++;
+      break;
+    }
+  }
+
+  st->state = s;
+  st->offset += i;
+  return i;
+}  /* ac_feed */
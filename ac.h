@@ -0,0 +1,64 @@
+/* ac.h - Streaming multi-pattern (Aho-Corasick) matcher.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Finds every occurrence of any of a set of byte strings in one pass,
+ * at a constant cost per input byte however many patterns there are.
+ * The automaton is built once and is read-only afterward, so any
+ * number of streams (sessions) can share it; each stream only carries
+ * its current state and byte offset, which is how a match that spans
+ * two reads is still found.
+ */
+
+#ifndef AC_H
+#define AC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vtscan.h"
+
+typedef struct {
+  int32_t (*next)[256];   /* full DFA: state x byte -> state */
+  int32_t *match;         /* state -> pattern ending here, or -1 */
+  int32_t *dict;          /* state -> next state on the fail chain with
+                           * a match, or -1 */
+  int n_states, alloc_states;
+  size_t *pat_len;        /* pattern id -> length */
+  int n_pats;
+  int built;
+  scan_set lead;          /* first bytes of the patterns */
+} ac_matcher;
+
+/* Per-stream position in the automaton. */
+typedef struct {
+  int32_t state;
+  unsigned long long offset;  /* bytes fed so far */
+} ac_stream;
+
+/* Called for each match: pattern id and the stream offset just past
+ * its last byte (it starts at end - length).  Return non-zero to stop
+ * the feed right after this match. */
+typedef int (*ac_match_fn)(void *arg, int id, unsigned long long end);
+
+int ac_init(ac_matcher *m);
+int ac_add(ac_matcher *m, const char *pat, size_t len);
+int ac_lookup(const ac_matcher *m, const char *pat, size_t len);
+int ac_build(ac_matcher *m);
+void ac_free(ac_matcher *m);
+size_t ac_pat_len(const ac_matcher *m, int id);
+
+void ac_stream_init(ac_stream *st);
+size_t ac_feed(const ac_matcher *m, ac_stream *st, const char *buf,
+               size_t len, ac_match_fn cb, void *arg);
+
+#endif  /* AC_H */
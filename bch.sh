@@ -0,0 +1,51 @@
+#!/bin/sh
+# bch.sh - relay throughput benchmark.  Runs cat of a large build-log-like
+# file inside minpty and reports minpty's own CPU per GB relayed, then
+# replays it (recorded) at full speed, then the raw speed of each
+# byte-scan kernel (vtscan.c).
+
+./bld.sh; if [ $? -ne 0 ]; then exit 1; fi
+
+MB=${1:-256}
+rm -f bch.dat
+
+# Fill bch.dat with roughly $MB megabytes of compiler-style output.
+awk -v mb=$MB 'BEGIN {
+  line = "gcc -Wall -O2 -c src/module/file_%06d.c -o obj/module/file_%06d.o\n";
+  n = int(mb * 1024 * 1024 / 70);
+  for (i = 0; i < n; i++) printf(line, i, i);
+}' >bch.dat
+
+echo "== stdout to file, splice"
+./minpty --stats cat bch.dat >bch.out
+echo "== stdout to file, copy"
+./minpty --stats --no-splice cat bch.dat >bch.out
+echo "== stdout to pipe, splice"
+./minpty --stats cat bch.dat | cat >/dev/null
+echo "== stdout to pipe, copy"
+./minpty --stats --no-splice cat bch.dat | cat >/dev/null
+echo "== stdout to file, copy, fixed 4 KB reads"
+./minpty --stats --no-splice --max-read=4096 cat bch.dat >bch.out
+echo "== stdout to file, answering queries (copy)"
+./minpty --stats --answer cat bch.dat >bch.out
+echo "== stdout to file, io_uring"
+./minpty --stats --engine=uring cat bch.dat >bch.out
+
+# Replay at full speed: the capture's own output, without the child or
+# the pty, through stdout and through the screen model.
+echo "== record (binary)"
+./minpty --stats --record=bch.rec --record-format=binary cat bch.dat >bch.out
+echo "== replay to file"
+./minpty --stats --replay=bch.rec --speed=max >bch.out
+echo "== replay into the screen model"
+./minpty --stats --replay=bch.rec --speed=max --screen
+
+echo "== stdout to file, with a compressed capture"
+./minpty --stats --capture=bch.cap cat bch.dat >bch.out
+
+rm -f bch.dat bch.out bch.rec bch.cap
+
+echo "== byte scan kernels"
+gcc -Wall -O2 -o vtscan_bch vtscan_bch.c vtscan.c; if [ $? -ne 0 ]; then exit 1; fi
+./vtscan_bch
+rm -f vtscan_bch
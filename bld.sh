@@ -13,4 +13,9 @@ done
 
 rm -f test_re test_char
 
-gcc -Wall -g -o minpty -pthread minpty.c ;  if [ $? -ne 0 ]; then exit 1; fi
+# --capture uses zstd and lz4 when their headers are there (lz.c otherwise).
+LIBS=""
+if echo '#include <zstd.h>' | gcc -E - >/dev/null 2>&1; then LIBS="$LIBS -DHAVE_ZSTD -lzstd"; fi
+if echo '#include <lz4frame.h>' | gcc -E - >/dev/null 2>&1; then LIBS="$LIBS -DHAVE_LZ4 -llz4"; fi
+
+gcc -Wall -g -o minpty -pthread minpty.c ac.c cz.c lz.c re.c rec.c tw.c uring.c vtparse.c vtquery.c vtscan.c vtscreen.c vttext.c $LIBS ;  if [ $? -ne 0 ]; then exit 1; fi
@@ -0,0 +1,482 @@
+/* cz.c - Compressed capture file, written by a background thread.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* The thread gathers input from the ring into a CZ_BLOCK buffer and
+ * compresses it when it's full, so the compressor always sees big
+ * pieces no matter how the output was read.  zstd and lz4 keep their
+ * own history across blocks; lz blocks stand alone.  A flush (the
+ * session went quiet) compresses a short block and, for zstd and lz4,
+ * ends their current block in the file, so everything taken so far can
+ * be read back.  The end of the stream finishes the zstd or lz4 frame.
+ *
+ * zstd runs at level 1: on terminal output it's already several times
+ * smaller, and the faster the thread goes the less the ring drops.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "cz.h"
+#include "lz.h"
+
+#define CZ_RING_SIZE (32 * 1024 * 1024)   /* power of 2 */
+#define CZ_FILE_BUF  (64 * 1024)
+
+#define CZ_LZ_MAGIC  "MPTYLZB\1"
+#define CZ_LZ_HDR    8   /* raw size, stored size */
+#define ZSTD_MAGIC   0xFD2FB528u
+#define LZ4_MAGIC    0x184D2204u
+
+/* How much of the stream a compress() call finishes. */
+#define CZ_CONTINUE 0
+#define CZ_FLUSH    1
+#define CZ_END      2
+
+
+/*
+ * The codec called name, or -1 if there's none (or not in this build).
+ */
+int cz_codec(const char *name) {
+  if (strcmp(name, "none") == 0) { return CZ_NONE; }
+  if (strcmp(name, "lz") == 0) { return CZ_LZ; }
+#ifdef HAVE_ZSTD
+  if (strcmp(name, "zstd") == 0) { return CZ_ZSTD; }
+#endif
+#ifdef HAVE_LZ4
+  if (strcmp(name, "lz4") == 0) { return CZ_LZ4; }
+#endif
+  return -1;
+}  /* cz_codec */
+
+
+/* ---- Writing --------------------------------------------------------------- */
+
+static void emit(cz_writer *w, const void *p, size_t n) {
+  if (w->failed || n == 0) { return; }
+  if (fwrite(p, 1, n, w->fp) != n) w->failed = 1;
+  w->out_bytes += n;
+}  /* emit */
+
+
+static void put_le32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}  /* put_le32 */
+
+
+static void compress_lz(cz_writer *w) {
+  unsigned char *hdr = (unsigned char *)w->zbuf;
+  size_t n = lz_compress(w->block, w->block_len, w->zbuf + CZ_LZ_HDR,
+                         w->table);
+
+  put_le32(hdr, (uint32_t)w->block_len);
+  if (n >= w->block_len) {
+    /* Didn't shrink: store it. */
+    put_le32(hdr + 4, (uint32_t)w->block_len);
+    emit(w, hdr, CZ_LZ_HDR);
+    emit(w, w->block, w->block_len);
+  } else {
+    put_le32(hdr + 4, (uint32_t)n);
+    emit(w, hdr, CZ_LZ_HDR + n);
+  }
+}  /* compress_lz */
+
+
+#ifdef HAVE_ZSTD
+static void compress_zstd(cz_writer *w, int how) {
+  static const ZSTD_EndDirective mode[] = {
+    ZSTD_e_continue, ZSTD_e_flush, ZSTD_e_end
+  };
+  ZSTD_inBuffer in = { w->block, w->block_len, 0 };
+  size_t left;
+
+  do {
+    ZSTD_outBuffer out = { w->zbuf, w->zbuf_size, 0 };
+    left = ZSTD_compressStream2((ZSTD_CCtx *)w->cctx, &out, &in, mode[how]);
+    if (ZSTD_isError(left)) {
+      w->failed = 1;
+      return;
+    }
+    emit(w, w->zbuf, out.pos);
+  } while (in.pos < in.size || (how != CZ_CONTINUE && left != 0));
+}  /* compress_zstd */
+#endif
+
+
+#ifdef HAVE_LZ4
+static void compress_lz4(cz_writer *w, int how) {
+  LZ4F_cctx *c = (LZ4F_cctx *)w->cctx;
+  size_t n;
+
+  if (w->block_len > 0) {
+    n = LZ4F_compressUpdate(c, w->zbuf, w->zbuf_size, w->block,
+                            w->block_len, NULL);
+    if (LZ4F_isError(n)) {
+      w->failed = 1;
+      return;
+    }
+    emit(w, w->zbuf, n);
+  }
+  if (how == CZ_CONTINUE) { return; }
+  if (how == CZ_FLUSH)
+    n = LZ4F_flush(c, w->zbuf, w->zbuf_size, NULL);
+  else
+    n = LZ4F_compressEnd(c, w->zbuf, w->zbuf_size, NULL);
+  if (LZ4F_isError(n)) {
+    w->failed = 1;
+    return;
+  }
+  emit(w, w->zbuf, n);
+}  /* compress_lz4 */
+#endif
+
+
+/*
+ * Compress what's in the block; how says whether to also get it all
+ * into the file (CZ_FLUSH) or end the stream (CZ_END).
+ */
+static void compress(cz_writer *w, int how) {
+  switch (w->codec) {
+  case CZ_LZ:
+    if (w->block_len > 0) compress_lz(w);
+    break;
+#ifdef HAVE_ZSTD
+  case CZ_ZSTD: compress_zstd(w, how); break;
+#endif
+#ifdef HAVE_LZ4
+  case CZ_LZ4: compress_lz4(w, how); break;
+#endif
+  }
+  w->block_len = 0;
+  if (how != CZ_CONTINUE && !w->failed && fflush(w->fp) != 0)
+    w->failed = 1;
+}  /* compress */
+
+
+static void *cz_thread(void *arg) {
+  cz_writer *w = (cz_writer *)arg;
+  int pending = 0;         /* taken since the last flush */
+
+  for (;;) {
+    size_t len;
+    const char *p = spsc_peek(&w->ring, &len);
+    if (len > 0) {
+      if (w->codec == CZ_NONE) {
+        emit(w, p, len);
+      } else {
+        if (len > CZ_BLOCK - w->block_len) len = CZ_BLOCK - w->block_len;
+        memcpy(w->block + w->block_len, p, len);
+        w->block_len += len;
+      }
+      spsc_consume(&w->ring, len);
+      if (w->block_len == CZ_BLOCK)
+        compress(w, CZ_CONTINUE);
+      pending = 1;
+      continue;
+    }
+    if (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+      if (spsc_used(&w->ring) == 0) break;
+      continue;
+    }
+    if (pending) {
+      /* Caught up: if nothing more comes for a while, write it out. */
+      if (spsc_wait_data(&w->ring, -1, CZ_FLUSH_MS) == 0 &&
+          spsc_used(&w->ring) == 0) {
+        compress(w, CZ_FLUSH);
+        pending = 0;
+      }
+      continue;
+    }
+    spsc_wait_data(&w->ring, -1, -1);
+  }
+  compress(w, CZ_END);
+  return NULL;
+}  /* cz_thread */
+
+
+/*
+ * Buffers and stream state for w's codec, and the file header.
+ */
+static int codec_init(cz_writer *w) {
+  switch (w->codec) {
+  case CZ_NONE:
+    return 0;
+  case CZ_LZ:
+    w->zbuf_size = CZ_LZ_HDR + LZ_BOUND(CZ_BLOCK);
+    w->table = malloc(LZ_TABLE_SIZE);
+    if (w->table == NULL) { return -1; }  /* Handle error. */
+    emit(w, CZ_LZ_MAGIC, 8);
+    break;
+#ifdef HAVE_ZSTD
+  case CZ_ZSTD:
+    w->zbuf_size = ZSTD_CStreamOutSize();
+    w->cctx = ZSTD_createCCtx();
+    if (w->cctx == NULL) { errno = ENOMEM; return -1; }  /* Handle error. */
+    ZSTD_CCtx_setParameter((ZSTD_CCtx *)w->cctx, ZSTD_c_compressionLevel, 1);
+    break;
+#endif
+#ifdef HAVE_LZ4
+  case CZ_LZ4: {
+    LZ4F_cctx *c;
+    size_t n;
+    if (LZ4F_isError(LZ4F_createCompressionContext(&c, LZ4F_VERSION))) {
+      errno = ENOMEM;
+      return -1;
+    }  /* Handle error. */
+    w->cctx = c;
+    w->zbuf_size = LZ4F_compressBound(CZ_BLOCK, NULL) + LZ4F_HEADER_SIZE_MAX;
+    w->zbuf = (char *)malloc(w->zbuf_size);
+    if (w->zbuf == NULL) { return -1; }  /* Handle error. */
+    n = LZ4F_compressBegin(c, w->zbuf, w->zbuf_size, NULL);
+    if (LZ4F_isError(n)) { errno = EINVAL; return -1; }  /* Handle error. */
+    emit(w, w->zbuf, n);
+    break;
+  }
+#endif
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  w->block = (char *)malloc(CZ_BLOCK);
+  if (w->block == NULL) { return -1; }  /* Handle error. */
+  if (w->zbuf == NULL) {
+    w->zbuf = (char *)malloc(w->zbuf_size);
+    if (w->zbuf == NULL) { return -1; }  /* Handle error. */
+  }
+  return 0;
+}  /* codec_init */
+
+
+static void codec_free(cz_writer *w) {
+#ifdef HAVE_ZSTD
+  if (w->codec == CZ_ZSTD) ZSTD_freeCCtx((ZSTD_CCtx *)w->cctx);
+#endif
+#ifdef HAVE_LZ4
+  if (w->codec == CZ_LZ4) LZ4F_freeCompressionContext((LZ4F_cctx *)w->cctx);
+#endif
+  w->cctx = NULL;
+  free(w->block);
+  free(w->zbuf);
+  free(w->table);
+  w->block = w->zbuf = NULL;
+  w->table = NULL;
+}  /* codec_free */
+
+
+/*
+ * Create path and start the compression thread.  Returns -1 with errno
+ * set on failure.
+ */
+int cz_open(cz_writer *w, const char *path, int codec) {
+  int err;
+
+  memset(w, 0, sizeof(*w));
+  w->codec = codec;
+  w->fp = fopen(path, "w");
+  if (w->fp == NULL) { return -1; }  /* Handle error. */
+  setvbuf(w->fp, NULL, _IOFBF, CZ_FILE_BUF);
+
+  if (codec_init(w) < 0 || spsc_init(&w->ring, CZ_RING_SIZE) < 0) {
+    err = errno;
+    codec_free(w);
+    fclose(w->fp);
+    errno = err;
+    return -1;
+  }  /* Handle error. */
+  err = pthread_create(&w->thread, NULL, cz_thread, w);
+  if (err != 0) {
+    spsc_free(&w->ring);
+    codec_free(w);
+    fclose(w->fp);
+    errno = err;
+    return -1;
+  }  /* Handle error. */
+  return 0;
+}  /* cz_open */
+
+
+/*
+ * Add a chunk to the stream.  Never blocks: with no room in the ring,
+ * the chunk is dropped.
+ */
+void cz_write(cz_writer *w, const char *buf, size_t len) {
+  if (w->ring.size - spsc_used(&w->ring) < len) {
+    w->dropped += len;
+    return;
+  }
+  spsc_put(&w->ring, buf, len);
+  w->in_bytes += len;
+}  /* cz_write */
+
+
+/*
+ * Compress and write out everything taken, stop the thread and close
+ * the file.  Returns -1 if anything failed to be written.
+ */
+int cz_close(cz_writer *w) {
+  int failed;
+
+  __atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+  spsc_kick(&w->ring);
+  pthread_join(w->thread, NULL);
+  spsc_free(&w->ring);
+  codec_free(w);
+
+  failed = w->failed;
+  if (fclose(w->fp) != 0) failed = 1;
+  w->fp = NULL;
+  return failed ? -1 : 0;
+}  /* cz_close */
+
+
+/* ---- Reading --------------------------------------------------------------- */
+
+static uint32_t get_le32(const unsigned char *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+         ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}  /* get_le32 */
+
+
+static int decompress_lz(const unsigned char *p, size_t size, FILE *fp) {
+  char *buf = (char *)malloc(CZ_BLOCK);
+  size_t pos = 8;
+  int ret = CZ_OK;
+
+  if (buf == NULL) { return CZ_ERR_WRITE; }  /* Handle error. */
+  while (pos < size && ret == CZ_OK) {
+    uint32_t raw, stored;
+    if (size - pos < CZ_LZ_HDR) {
+      ret = CZ_ERR_DATA;
+      break;
+    }
+    raw = get_le32(p + pos);
+    stored = get_le32(p + pos + 4);
+    pos += CZ_LZ_HDR;
+    if (raw > CZ_BLOCK || stored > raw || stored > size - pos) {
+      ret = CZ_ERR_DATA;
+    } else if (stored == raw) {
+      if (fwrite(p + pos, 1, raw, fp) != raw) ret = CZ_ERR_WRITE;
+    } else if (lz_decompress((const char *)p + pos, stored, buf,
+                             CZ_BLOCK) != (long)raw) {
+      ret = CZ_ERR_DATA;
+    } else if (fwrite(buf, 1, raw, fp) != raw) {
+      ret = CZ_ERR_WRITE;
+    }
+    pos += stored;
+  }
+  free(buf);
+  return ret;
+}  /* decompress_lz */
+
+
+#ifdef HAVE_ZSTD
+static int decompress_zstd(const unsigned char *p, size_t size, FILE *fp) {
+  ZSTD_DCtx *d = ZSTD_createDCtx();
+  size_t out_size = ZSTD_DStreamOutSize();
+  char *buf = (char *)malloc(out_size);
+  ZSTD_inBuffer in = { p, size, 0 };
+  size_t left = 1;
+  int ret = CZ_OK;
+
+  if (d == NULL || buf == NULL) {
+    ZSTD_freeDCtx(d);
+    free(buf);
+    return CZ_ERR_WRITE;
+  }  /* Handle error. */
+  while (ret == CZ_OK && (in.pos < in.size || left != 0)) {
+    ZSTD_outBuffer out = { buf, out_size, 0 };
+    size_t in_before = in.pos;
+    left = ZSTD_decompressStream(d, &out, &in);
+    if (ZSTD_isError(left)) {
+      ret = CZ_ERR_DATA;
+    } else if (fwrite(buf, 1, out.pos, fp) != out.pos) {
+      ret = CZ_ERR_WRITE;
+    } else if (in.pos == in_before && out.pos < out_size) {
+      ret = CZ_ERR_DATA;   /* input used up in the middle of a frame */
+    }
+  }
+  ZSTD_freeDCtx(d);
+  free(buf);
+  return ret;
+}  /* decompress_zstd */
+#endif
+
+
+#ifdef HAVE_LZ4
+static int decompress_lz4(const unsigned char *p, size_t size, FILE *fp) {
+  LZ4F_dctx *d;
+  char *buf = (char *)malloc(CZ_BLOCK);
+  size_t pos = 0, left = 1;
+  int ret = CZ_OK;
+
+  if (buf == NULL) { return CZ_ERR_WRITE; }  /* Handle error. */
+  if (LZ4F_isError(LZ4F_createDecompressionContext(&d, LZ4F_VERSION))) {
+    free(buf);
+    return CZ_ERR_WRITE;
+  }  /* Handle error. */
+  while (ret == CZ_OK && (pos < size || left != 0)) {
+    size_t out_len = CZ_BLOCK, in_len = size - pos;
+    left = LZ4F_decompress(d, buf, &out_len, p + pos, &in_len, NULL);
+    pos += in_len;
+    if (LZ4F_isError(left)) {
+      ret = CZ_ERR_DATA;
+    } else if (fwrite(buf, 1, out_len, fp) != out_len) {
+      ret = CZ_ERR_WRITE;
+    } else if (in_len == 0 && out_len == 0) {
+      ret = CZ_ERR_DATA;   /* input used up in the middle of a frame */
+    }
+  }
+  LZ4F_freeDecompressionContext(d);
+  free(buf);
+  return ret;
+}  /* decompress_lz4 */
+#endif
+
+
+/*
+ * Write the decompressed contents of a file cz wrote (size bytes at
+ * base) to fp.  Returns CZ_OK or a CZ_ERR_ code; on CZ_ERR_DATA, what
+ * came before the damage has been written.
+ */
+int cz_decompress(const void *base, size_t size, FILE *fp) {
+  const unsigned char *p = (const unsigned char *)base;
+  int ret = CZ_ERR_FORMAT;
+
+  if (size >= 8 && memcmp(p, CZ_LZ_MAGIC, 8) == 0) {
+    ret = decompress_lz(p, size, fp);
+  } else if (size >= 4 && get_le32(p) == ZSTD_MAGIC) {
+#ifdef HAVE_ZSTD
+    ret = decompress_zstd(p, size, fp);
+#else
+    ret = CZ_ERR_CODEC;
+#endif
+  } else if (size >= 4 && get_le32(p) == LZ4_MAGIC) {
+#ifdef HAVE_LZ4
+    ret = decompress_lz4(p, size, fp);
+#else
+    ret = CZ_ERR_CODEC;
+#endif
+  }
+  if (ret == CZ_OK && fflush(fp) != 0) ret = CZ_ERR_WRITE;
+  return ret;
+}  /* cz_decompress */
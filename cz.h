@@ -0,0 +1,99 @@
+/* cz.h - Compressed capture file, written by a background thread.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* A long session's output is mostly the same few lines over and over,
+ * and can run to gigabytes.  cz_write() copies a chunk into a bounded
+ * lock-free ring (spsc.h) and returns; a compression thread takes it
+ * from there, compresses it in CZ_BLOCK pieces and writes the file.
+ * The relay loop never compresses and never waits on the disk, so
+ * keystrokes go through just as fast; if the thread falls so far
+ * behind that the ring is full, the chunk is dropped and counted.
+ * Output that pauses for CZ_FLUSH_MS gets what's pending compressed
+ * and written, so the file keeps up with a quiet session.
+ *
+ * Codecs:
+ *   zstd  standard .zst frames (zstd -d reads them); with HAVE_ZSTD
+ *   lz4   standard .lz4 frames (lz4 -d); with HAVE_LZ4
+ *   lz    always there (lz.c); layout below
+ *   none  written as is, still off the relay thread
+ *
+ * "lz" layout (integers little-endian):
+ *   header   "MPTYLZB\1"
+ *   block    u32 raw size, u32 stored size, stored bytes: an lz.c block,
+ *            or the raw bytes if the stored size equals the raw size
+ * cz_decompress() reads all of them (zstd and lz4 when built with them).
+ *
+ * One producer thread (the one calling cz_write()) per writer.
+ */
+
+#ifndef CZ_H
+#define CZ_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "spsc.h"
+
+/* Codecs. */
+#define CZ_NONE 0
+#define CZ_LZ   1
+#define CZ_ZSTD 2
+#define CZ_LZ4  3
+
+/* The default: the best one built in. */
+#if defined(HAVE_ZSTD)
+#define CZ_BEST CZ_ZSTD
+#elif defined(HAVE_LZ4)
+#define CZ_BEST CZ_LZ4
+#else
+#define CZ_BEST CZ_LZ
+#endif
+
+#define CZ_BLOCK    (256 * 1024)   /* compressed at a time */
+#define CZ_FLUSH_MS 1000           /* idle this long: write what's pending */
+
+/* cz_decompress() results. */
+#define CZ_OK          0
+#define CZ_ERR_FORMAT -1   /* not a file cz wrote */
+#define CZ_ERR_CODEC  -2   /* written with a codec this build doesn't have */
+#define CZ_ERR_DATA   -3   /* damaged or cut off */
+#define CZ_ERR_WRITE  -4   /* writing the output failed */
+
+typedef struct {
+  FILE *fp;
+  int codec;
+  spsc_ring ring;
+  pthread_t thread;
+  int stop;                /* writer: drain and quit */
+  unsigned long long in_bytes;      /* taken by cz_write() */
+  unsigned long long dropped;       /* lost to a full ring */
+  int failed;              /* a write failed; the rest is discarded */
+
+  /* Compression thread only (read by others after cz_close()). */
+  unsigned long long out_bytes;     /* written to the file */
+  char *block;             /* input not yet compressed */
+  size_t block_len;
+  char *zbuf;              /* compressor output */
+  size_t zbuf_size;
+  void *table;             /* lz: hash table */
+  void *cctx;              /* zstd or lz4 stream */
+} cz_writer;
+
+int cz_codec(const char *name);
+int cz_open(cz_writer *w, const char *path, int codec);
+void cz_write(cz_writer *w, const char *buf, size_t len);
+int cz_close(cz_writer *w);
+int cz_decompress(const void *base, size_t size, FILE *fp);
+
+#endif  /* CZ_H */
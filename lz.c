@@ -0,0 +1,217 @@
+/* lz.c - Small LZ77 block compressor.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* A sequence is:
+ *   token     high 4 bits literal count, low 4 bits match length - 4;
+ *             15 in either means more follows
+ *   [more]    for the literal count: bytes added on while they're 255
+ *   literals
+ *   offset    u16 little-endian, 1..65535 back from here
+ *   [more]    for the match length, the same way
+ * The last sequence is literals only and ends the block.  As in LZ4,
+ * the last LZ_LAST_LITERALS bytes are always literals and no match
+ * starts within LZ_MF_LIMIT of the end, which is what lets a decoder
+ * copy in words without checking each byte.
+ *
+ * The hash table holds, per hash of 4 bytes, the last position they
+ * were seen at.  It's cleared per block; a stale entry can only cost a
+ * compare, since every candidate is checked against the input.
+ */
+
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH     4
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT      12
+#define LZ_MAX_OFFSET    65535
+#define LZ_SKIP_SHIFT    6     /* stride grows by 1 every 64 misses */
+
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}  /* read32 */
+
+
+/*
+ * How many bytes at a and b are equal, stopping at b_end; 8 at a time.
+ */
+static size_t count_equal(const unsigned char *a, const unsigned char *b,
+                          const unsigned char *b_end) {
+  const unsigned char *start = b;
+
+  while (b + 8 <= b_end) {
+    uint64_t x, y;
+    memcpy(&x, a, 8);
+    memcpy(&y, b, 8);
+    if (x != y) break;
+    a += 8;
+    b += 8;
+  }
+  while (b < b_end && *a == *b) {
+    a++;
+    b++;
+  }
+  return (size_t)(b - start);
+}  /* count_equal */
+
+
+static uint32_t hash4(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}  /* hash4 */
+
+
+/*
+ * A length of 15 or more, after the token's 15: 255s and the rest.
+ */
+static unsigned char *put_len(unsigned char *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char)len;
+  return op;
+}  /* put_len */
+
+
+static unsigned char *put_sequence(unsigned char *op,
+                                   const unsigned char *lit, size_t n_lit,
+                                   size_t offset, size_t match) {
+  unsigned char *token = op++;
+  size_t m = match - LZ_MIN_MATCH;
+
+  *token = (unsigned char)(((n_lit < 15) ? n_lit : 15) << 4);
+  if (n_lit >= 15) op = put_len(op, n_lit - 15);
+  memcpy(op, lit, n_lit);
+  op += n_lit;
+  if (match == 0) { return op; }  /* the last sequence */
+  *op++ = (unsigned char)offset;
+  *op++ = (unsigned char)(offset >> 8);
+  *token |= (unsigned char)((m < 15) ? m : 15);
+  if (m >= 15) op = put_len(op, m - 15);
+  return op;
+}  /* put_sequence */
+
+
+/*
+ * Compress n bytes of src into dst, which has room for LZ_BOUND(n).
+ * table is LZ_TABLE_SIZE bytes of scratch.  Returns the compressed
+ * size.
+ */
+size_t lz_compress(const char *src, size_t n, char *dst, void *table) {
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *op = (unsigned char *)dst;
+  uint32_t *tab = (uint32_t *)table;
+  size_t ip = 0, anchor = 0;
+
+  memset(tab, 0, LZ_TABLE_SIZE);
+  if (n > LZ_MF_LIMIT) {
+    size_t limit = n - LZ_MF_LIMIT;          /* last match start */
+    size_t match_end = n - LZ_LAST_LITERALS;
+    while (ip < limit) {
+      uint32_t v = read32(in + ip);
+      uint32_t h = hash4(v);
+      size_t ref = tab[h];
+      size_t len;
+      tab[h] = (uint32_t)ip;
+      if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(in + ref) != v) {
+        ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+        continue;
+      }
+      /* Back over equal bytes before both, then forward. */
+      while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+        ip--;
+        ref--;
+      }
+      len = LZ_MIN_MATCH + count_equal(in + ref + LZ_MIN_MATCH,
+                                       in + ip + LZ_MIN_MATCH, in + match_end);
+      op = put_sequence(op, in + anchor, ip - anchor, ip - ref, len);
+      ip += len;
+      anchor = ip;
+      /* A position inside the match, for the next one to find. */
+      if (ip - 2 < limit)
+        tab[hash4(read32(in + ip - 2))] = (uint32_t)(ip - 2);
+    }
+  }
+  op = put_sequence(op, in + anchor, n - anchor, 0, 0);
+  return (size_t)(op - (unsigned char *)dst);
+}  /* lz_compress */
+
+
+/*
+ * A length continued past the token's 15, or -1 if the input ends.
+ */
+static long get_len(const unsigned char *in, size_t n, size_t *ip) {
+  long len = 0;
+  unsigned char b;
+
+  do {
+    if (*ip >= n) { return -1; }
+    b = in[(*ip)++];
+    len += b;
+  } while (b == 255);
+  return len;
+}  /* get_len */
+
+
+/*
+ * Decompress block src (n bytes) into dst, which holds cap.  Returns
+ * the decompressed size, or -1 if the block is damaged or doesn't fit.
+ */
+long lz_decompress(const char *src, size_t n, char *dst, size_t cap) {
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *out = (unsigned char *)dst;
+  size_t ip = 0, op = 0;
+
+  for (;;) {
+    unsigned token;
+    size_t n_lit, offset, match;
+    long more;
+
+    if (ip >= n) { return -1; }
+    token = in[ip++];
+    n_lit = token >> 4;
+    if (n_lit == 15) {
+      if ((more = get_len(in, n, &ip)) < 0) { return -1; }
+      n_lit += (size_t)more;
+    }
+    if (n_lit > n - ip || n_lit > cap - op) { return -1; }
+    memcpy(out + op, in + ip, n_lit);
+    ip += n_lit;
+    op += n_lit;
+    if (ip == n) break;   /* the last sequence */
+
+    if (n - ip < 2) { return -1; }
+    offset = in[ip] | ((size_t)in[ip + 1] << 8);
+    ip += 2;
+    match = (token & 15) + LZ_MIN_MATCH;
+    if ((token & 15) == 15) {
+      if ((more = get_len(in, n, &ip)) < 0) { return -1; }
+      match += (size_t)more;
+    }
+    if (offset == 0 || offset > op || match > cap - op) { return -1; }
+    if (offset >= match) {
+      memcpy(out + op, out + op - offset, match);
+      op += match;
+    } else {
+      /* Overlapping: a run repeating the last offset bytes. */
+      size_t i;
+      for (i = 0; i < match; i++, op++)
+        out[op] = out[op - offset];
+    }
+  }
+  return (long)op;
+}  /* lz_decompress */
@@ -38,6 +38,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "vtquery.h"
+#include "vtscreen.h"
+
 /* Buffer size for read/write shuttling. */
 #define BUF_SIZE 4096
 
@@ -96,93 +99,32 @@ static int create_pty_pipes(HANDLE *pty_in_rd, HANDLE *pty_in_wr,
 
 
 /* ----------------------------------------------------------------
- * VT query detection and synthetic response generation.
+ * VT query answering.
  *
  * ConPTY's internal conhost sends VT query sequences and expects
  * responses in its input stream.  Normally a real terminal provides
  * these, but when running headless (no console) there's nothing to
- * answer.  We scan ConPTY output for common queries and inject
- * synthetic responses into the pty input pipe.
- *
- * Handled queries:
- *   ESC[6n   DSR cursor position  ->  ESC[1;1R
- *   ESC[5n   DSR device status    ->  ESC[0n
- *   ESC[c    Primary DA           ->  ESC[?1;2c
- *   ESC[0c   Primary DA           ->  ESC[?1;2c
- *   ESC[>c   Secondary DA         ->  ESC[>0;0;0c
- *   ESC[>0c  Secondary DA         ->  ESC[>0;0;0c
+ * answer.  The output is run through a screen model (vtscreen.c, shared
+ * with minpty), which spots the common queries (vtquery.c) and answers
+ * them from what it tracks, cursor position included; we inject the
+ * answers into the pty input pipe.
  * ----------------------------------------------------------------
  */
 
-#define VT_NORMAL  0
-#define VT_ESC     1
-#define VT_CSI     2
-
-static void handle_vt_queries(const char *buf, DWORD len,
-                              HANDLE pty_in_wr) {
-  static int state = VT_NORMAL;
-  static char csi_buf[64];
-  static int csi_len = 0;
-
-  DWORD i;
-  for (i = 0; i < len; i++) {
-    unsigned char c = (unsigned char)buf[i];
-
-    switch (state) {
-    case VT_NORMAL:
-      if (c == 0x1B)
-        state = VT_ESC;
-      break;
-
-    case VT_ESC:
-      if (c == '[') {
-        state = VT_CSI;
-        csi_len = 0;
-      } else {
-        state = VT_NORMAL;
-      }
-      break;
-
-    case VT_CSI:
-      if (csi_len < (int)sizeof(csi_buf) - 1)
-        csi_buf[csi_len++] = (char)c;
-
-      /* CSI final bytes are 0x40-0x7E. */
-      if (c >= 0x40 && c <= 0x7E) {
-        const char *resp = NULL;
-        DWORD n_written;
-
-        csi_buf[csi_len] = '\0';
-
-        if (strcmp(csi_buf, "6n") == 0) {
-          resp = "\x1b[1;1R";         /* cursor at row 1, col 1 */
-        } else if (strcmp(csi_buf, "5n") == 0) {
-          resp = "\x1b[0n";           /* device OK */
-        } else if (strcmp(csi_buf, "c") == 0 ||
-                   strcmp(csi_buf, "0c") == 0) {
-          resp = "\x1b[?1;2c";        /* VT100 with AVO */
-        } else if (strcmp(csi_buf, ">c") == 0 ||
-                   strcmp(csi_buf, ">0c") == 0) {
-          resp = "\x1b[>0;0;0c";      /* secondary DA */
-        }
-
-        if (resp != NULL) {
-          WriteFile(pty_in_wr, resp, (DWORD)strlen(resp),
-                    &n_written, NULL);
-        }
-
-        state = VT_NORMAL;
-      }
-      break;
-    }  /* switch */
-  }  /* for */
-}  /* handle_vt_queries */
+/*
+ * vts_feed() callback: write a response to the pty input pipe.
+ */
+static void write_vt_reply(void *arg, const char *reply, size_t len) {
+  DWORD n_written;
+  WriteFile((HANDLE)arg, reply, (DWORD)len, &n_written, NULL);
+}  /* write_vt_reply */
 
 
 /* Context passed to the output thread. */
 typedef struct {
   HANDLE pty_out_rd;   /* read child output from here */
   HANDLE pty_in_wr;    /* write VT responses back here */
+  vts_screen screen;   /* what the console shows, for answers */
 } pty_out_ctx;
 
 
@@ -232,7 +174,7 @@ static DWORD WINAPI pty_to_stdout(LPVOID arg) {
 
   while (ReadFile(ctx->pty_out_rd, buf, sizeof(buf), &n_read, NULL)
          && n_read > 0) {
-    handle_vt_queries(buf, n_read, ctx->pty_in_wr);
+    vts_feed(&ctx->screen, buf, n_read);
     WriteFile(g_data_out, buf, n_read, &n_written, NULL);
   }
 
@@ -374,6 +316,11 @@ int main(int argc, char *argv[]) {
   pty_out_ctx out_ctx;
   out_ctx.pty_out_rd = pty_out_rd;
   out_ctx.pty_in_wr = pty_in_wr;
+  if (vts_init(&out_ctx.screen, con_size.Y, con_size.X) < 0) {
+    fprintf(stderr, "vts_init failed.\n");
+    return 1;
+  }
+  vts_set_reply(&out_ctx.screen, write_vt_reply, pty_in_wr);
 
   HANDLE h_in_thread = CreateThread(
       NULL, 0, stdin_to_pty, pty_in_wr, 0, NULL);
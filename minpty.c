@@ -18,201 +18,3449 @@
  *
  * The child process believes it's running on a real terminal.
  *
- * Usage: minpty <command> [args...]
+ * Usage: minpty [options] <command> [args...]
+ *        minpty [options] --supervise=<list>
  *
  * Design notes:
- *   - Uses poll() for multiplexed I/O (no threads needed)
+ *   - Uses an edge-triggered epoll set for multiplexed I/O (no threads
+ *     needed), blocking with no timeout until something happens
+ *   - Optionally (--engine=uring) uses io_uring instead: multishot reads
+ *     into registered buffers and linked writes, batched so a wakeup
+ *     costs one syscall
+ *   - Optionally (--engine=threads) runs a thread per direction, like
+ *     minconpty, with output stages on a third thread fed through a
+ *     lock-free SPSC ring
+ *   - When nothing needs to look at the child's output bytes, moves
+ *     them with splice() so they never get copied through userspace
  *   - Uses forkpty() which handles the pty allocation, fork, and
  *     slave-side setup (setsid, ioctl TIOCSCTTY, dup2) in one call
- *   - Detects child exit via POLLHUP on the master fd + waitpid()
+ *   - Detects child exit through a pidfd in the epoll set, which becomes
+ *     readable the moment the child exits (falls back to SIGCHLD on
+ *     kernels without pidfd_open())
+ *   - Signals (SIGWINCH, and SIGCHLD when there's no pidfd or there are
+ *     hooks to reap) are blocked
+ *     and read from a signalfd in the same epoll set, so they're handled
+ *     in the loop rather than in async-signal context
  *   - Puts the real terminal into raw mode so keystrokes pass through
  *     immediately (Ctrl-C, arrow keys, tab completion all work)
+ *   - All per-child state lives in a session.  With --supervise, one
+ *     process runs a whole list of commands, each on its own pty with
+ *     its own log file, all serviced by the one epoll loop
+ *   - Optionally (--script) drives the child from an expect script,
+ *     matched against the output as it's read, instead of stdin
+ *   - Optionally (--on) runs a command whenever some text appears in the
+ *     output; all hook texts share one streaming Aho-Corasick automaton,
+ *     and the loop starts the commands (posix_spawn) without waiting
+ *   - Script prompts that aren't fixed text (expect-re) are matched by a
+ *     lazily built DFA with a bounded cache, also fed as output is read
+ *   - Optionally (--answer, and by default with --screen) answers the
+ *     child's terminal queries (cursor position, device attributes,
+ *     window size) itself when no terminal sees the output, so it
+ *     doesn't sit out their timeouts; with --screen, from the model's
+ *     real cursor
+ *   - Optionally (--screen) keeps a model of the child's screen, built
+ *     from the output by a full VT parser, with per-row damage tracking
+ *   - Optionally (--snapshot) writes that screen, as text or JSON,
+ *     instead of the raw output: at the end, on a timer or from a script
+ *   - Optionally (--record) records the session with its timing, as
+ *     asciicast or as compact indexed binary, through a writer thread
+ *     the relay never waits on; converts binary to asciicast from any
+ *     point in the session
+ *   - Optionally (--transcript) also writes a plain-text transcript:
+ *     escape sequences stripped and CR/backspace overwrites applied,
+ *     with a vector scan over the text between control characters
+ *   - Optionally (--capture) also writes the raw output compressed
+ *     (zstd, lz4 or a built-in LZ), on a thread fed through a bounded
+ *     ring so compressing never holds up the relay
+ *   - Replays a binary recording (--replay) to stdout or into a screen
+ *     model, in real time, N times faster, or flat out for benchmarks
  */
 
 #define _GNU_SOURCE
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <poll.h>
+#include <pthread.h>
 #include <pty.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
 
-/* Buffer size for read/write shuttling. */
+#include "ac.h"
+#include "cz.h"
+#include "re.h"
+#include "rec.h"
+#include "tw.h"
+#include "vtquery.h"
+#include "vtscreen.h"
+#include "vttext.h"
+#include "spsc.h"
+#include "uring.h"
+
+/* Buffer size for read/write shuttling.  Also the smallest per-pass
+ * read budget; the adaptive budget grows from here up to --max-read. */
 #define BUF_SIZE 4096
 
-/* Global so the signal handler can set it. */
-static volatile sig_atomic_t child_exited = 0;
-static volatile sig_atomic_t child_status = 0;
+/* Default --max-read. */
+#define MAX_READ_DEFAULT (256 * 1024)
+
+/* epoll user data tags, and the most events taken per wakeup.  The
+ * session's index goes above the tag. */
+#define EV_MASTER 0
+#define EV_STDIN  1
+#define EV_CHILD  2
+#define EV_SIGNAL 3
+#define EV_STDOUT 4
+#define EV_MAX    64
+#define EV_TAG(kind, idx) ((uint64_t)(kind) | ((uint64_t)(idx) << 8))
+
+/* Default --size: the window size of a pty with no terminal to copy it
+ * from (supervised sessions, or stdin not a terminal). */
+#define DEFAULT_ROWS 24
+#define DEFAULT_COLS 80
+
+/* After the child exits, how long (ms) its output may stay quiet before
+ * we stop waiting for more. */
+#define EXIT_DRAIN_MS 100
+
+/* Minimum capacity of each direction's relay ring (power of 2, and at
+ * least SPLICE_CHUNK).  Grown to twice --max-read if that's bigger. */
+#define RING_SIZE (64 * 1024)
+
+/* Default byte threshold for --coalesce. */
+#define COALESCE_BYTES_DEFAULT (32 * 1024)
+
+/* Bytes requested per splice() call, and the capacity we ask for on
+ * the intermediate pipe. */
+#define SPLICE_CHUNK (64 * 1024)
+
+/* How child output gets from the pty master to stdout. */
+#define RELAY_COPY       0  /* read() into a buffer, write() it out */
+#define RELAY_SPLICE     1  /* splice() master -> stdout (stdout is a pipe) */
+#define RELAY_SPLICE_VIA 2  /* splice() master -> pipe -> stdout */
+
+/* I/O engines. */
+#define ENGINE_EPOLL   0
+#define ENGINE_URING   1
+#define ENGINE_THREADS 2
+
+/* Command-line options. */
+static int g_opt_splice = 1;  /* --no-splice clears this */
+static int g_opt_answer = -1;  /* --answer 1, --no-answer 0; -1: with --screen */
+static int g_opt_screen = 0;  /* --screen */
+static int g_opt_snapshot = 0;  /* --snapshot: SNAP_TEXT or SNAP_JSON */
+static long long g_opt_snapshot_every_us = -1;  /* --snapshot-every */
+static const char *g_opt_record = NULL;  /* --record */
+static int g_opt_record_input = 0;  /* --record-input */
+static int g_opt_record_format = REC_ASCIICAST;  /* --record-format */
+static const char *g_opt_transcript = NULL;  /* --transcript */
+static const char *g_opt_capture = NULL;  /* --capture */
+static int g_opt_compress = CZ_BEST;  /* --compress */
+static const char *g_opt_decompress = NULL;  /* --decompress */
+static const char *g_opt_to_asciicast = NULL;  /* --to-asciicast */
+static long long g_opt_from_us = 0;  /* --from */
+static const char *g_opt_replay = NULL;  /* --replay */
+static double g_opt_speed = 1.0;  /* --speed; 0 = as fast as possible */
+static int g_opt_rows = DEFAULT_ROWS;  /* --size */
+static int g_opt_cols = DEFAULT_COLS;
+static int g_opt_stats  = 0;  /* --stats */
+static int g_opt_engine = ENGINE_EPOLL;  /* --engine */
+static size_t g_opt_max_read = MAX_READ_DEFAULT;  /* --max-read */
+static long long g_opt_coalesce_us = -1;  /* --coalesce, -1 = off */
+static size_t g_opt_coalesce_bytes = COALESCE_BYTES_DEFAULT;
+static int g_opt_cpu_in = -1;     /* --pin, threads engine */
+static int g_opt_cpu_out = -1;
+static int g_opt_cpu_stage = -1;
+static const char *g_opt_supervise = NULL;  /* --supervise */
+static const char *g_opt_outdir = ".";      /* --outdir */
+
+static int g_engine = ENGINE_EPOLL;  /* what actually ran */
+
+/* Counters reported by --stats. */
+static struct {
+  unsigned long long out_bytes;  /* child -> stdout */
+  unsigned long long in_bytes;   /* stdin -> child */
+  unsigned long long reads;
+  unsigned long long writes;
+  unsigned long long splices;
+  unsigned long long polls;
+} g_stats;
+
+/* For counters the threads engine bumps from more than one thread. */
+#define STAT_ADD(field, n) \
+  __atomic_add_fetch(&(field), (unsigned long long)(n), __ATOMIC_RELAXED)
+
+
+/*
+ * Monotonic clock in microseconds.
+ */
+static long long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}  /* now_us */
+
+
+/*
+ * pidfd_open() wrapper; glibc only grew a stub for it in 2.36.
+ * Returns -1 with errno ENOSYS where the headers or kernel lack it.
+ */
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}  /* open_pidfd */
+
+
+/*
+ * Put the real terminal (if any) into raw mode so that:
+ *   - Characters are passed through immediately (no line buffering)
+ *   - Special keys (Ctrl-C, Ctrl-Z, etc.) aren't intercepted by the
+ *     outer terminal driver -- they go straight to the child's pty
+ *   - The child's terminal handles all line editing and echo
+ *
+ * Returns 0 on success, -1 if stdin isn't a terminal.
+ * Saves original settings into *saved for later restoration.
+ */
+static int set_raw_mode(struct termios *saved) {
+  struct termios raw;
+
+  if (tcgetattr(STDIN_FILENO, saved) < 0) { return -1; }  /* Handle error. */
+
+  raw = *saved;
+  cfmakeraw(&raw);
+
+  /* Keep output processing so \n -> \r\n still works on our stdout. */
+  raw.c_oflag |= OPOST;
+
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) < 0) { return -1; }  /* Handle error. */
+
+  return 0;
+}  /* set_raw_mode */
+
+
+static void restore_terminal(const struct termios *saved) {
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, saved);
+}  /* restore_terminal */
+
+
+/*
+ * Propagate the real terminal's window size to the pty master
+ * so the child sees the correct ROWS x COLS.  With no terminal, the
+ * --size default.  The size set goes in *ws.
+ */
+static void copy_window_size(int master_fd, struct winsize *ws) {
+  if (ioctl(STDIN_FILENO, TIOCGWINSZ, ws) != 0 ||
+      ws->ws_row == 0 || ws->ws_col == 0) {
+    memset(ws, 0, sizeof(*ws));
+    ws->ws_row = (unsigned short)g_opt_rows;
+    ws->ws_col = (unsigned short)g_opt_cols;
+  }
+  ioctl(master_fd, TIOCSWINSZ, ws);
+}  /* copy_window_size */
+
+
+/* ----------------------------------------------------------------
+ * Output stages.
+ *
+ * Anything that needs to see child output (logging, matching,
+ * answering terminal queries) is an output stage.  The epoll and
+ * uring engines feed each chunk to every stage right after reading
+ * it.  The threads engine hands the chunks to a stage thread through
+ * an SPSC ring instead, so slow stages never delay the relay itself.
+ * While any stage exists the bytes have to come through userspace, so
+ * splice is off.
+ * ----------------------------------------------------------------
+ */
+
+#define MAX_STAGES 8
+
+typedef struct {
+  void (*feed)(void *arg, const char *buf, size_t len);
+  void *arg;
+} out_stage;
+
+
+/*
+ * write() all of buf to fd, retrying on short writes.  Blocks (in
+ * poll) if fd is non-blocking and full; only used once the loop is
+ * done and there's nothing else to service.
+ */
+static void write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    STAT_ADD(g_stats.writes, 1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) {
+        /* Non-blocking fd is full; wait until it drains. */
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        poll(&pfd, 1, -1);
+        continue;
+      }
+      return;  /* Nowhere to report it; drop the rest. */
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+}  /* write_all */
+
+
+/* ----------------------------------------------------------------
+ * Byte ring buffer, one per direction.
+ *
+ * Data read from a source waits here until its destination accepts
+ * it, so a slow destination only stalls its own direction.  Reads go
+ * straight into the ring's free space and writes go straight out of
+ * its data, so there's no extra copy.  Positions are free-running;
+ * size is a power of 2.
+ * ----------------------------------------------------------------
+ */
+
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t head;   /* next byte to write out */
+  size_t tail;   /* next free byte */
+} relay_ring;
+
+
+static int ring_init(relay_ring *r, size_t size) {
+  r->buf = (char *)malloc(size);
+  if (r->buf == NULL) { return -1; }  /* Handle error. */
+  r->size = size;
+  r->head = r->tail = 0;
+  return 0;
+}  /* ring_init */
+
+
+static size_t ring_used(const relay_ring *r) {
+  return r->tail - r->head;
+}  /* ring_used */
+
+
+/*
+ * Contiguous free space at the tail; *len gets its length.
+ */
+static char *ring_space(relay_ring *r, size_t *len) {
+  size_t off = r->tail & (r->size - 1);
+  size_t avail = r->size - ring_used(r);
+  *len = (r->size - off < avail) ? r->size - off : avail;
+  return r->buf + off;
+}  /* ring_space */
+
+
+/*
+ * Copy in as much of buf as fits.  Returns the number of bytes taken.
+ */
+static size_t ring_put(relay_ring *r, const char *buf, size_t len) {
+  size_t done = 0;
+
+  while (done < len) {
+    size_t room;
+    char *p = ring_space(r, &room);
+    if (room == 0) break;
+    if (room > len - done) room = len - done;
+    memcpy(p, buf + done, room);
+    r->tail += room;
+    done += room;
+  }
+  return done;
+}  /* ring_put */
+
+
+/*
+ * Describe the ring's data as up to two iovecs (it may wrap).
+ */
+static int ring_data(const relay_ring *r, struct iovec iov[2]) {
+  size_t off = r->head & (r->size - 1);
+  size_t used = ring_used(r);
+  size_t first = (r->size - off < used) ? r->size - off : used;
+
+  if (used == 0) { return 0; }
+  iov[0].iov_base = r->buf + off;
+  iov[0].iov_len  = first;
+  if (first == used) { return 1; }
+  iov[1].iov_base = r->buf;
+  iov[1].iov_len  = used - first;
+  return 2;
+}  /* ring_data */
+
+
+/*
+ * writev() as much of the ring as fd will take without blocking.
+ * Returns 0 if fd stopped accepting (EAGAIN), 1 if the ring emptied
+ * or fd failed (the data is dropped; there's nowhere to report it).
+ */
+static int ring_flush(relay_ring *r, int fd) {
+  while (ring_used(r) > 0) {
+    struct iovec iov[2];
+    int cnt = ring_data(r, iov);
+    ssize_t n = writev(fd, iov, cnt);
+    g_stats.writes++;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) { return 0; }
+      r->head = r->tail;
+      break;
+    }
+    r->head += (size_t)n;
+  }
+  return 1;
+}  /* ring_flush */
+
+
+/* ----------------------------------------------------------------
+ * Adaptive read budget, one per direction.
+ *
+ * Each pass of the loop reads a source until it has taken 'size'
+ * bytes (or hits EAGAIN, or its ring fills).  Bulk traffic that uses
+ * the whole budget doubles it, so a big burst moves in a few passes
+ * with one writev() each instead of a read/write/epoll_wait per 4 KB.
+ * Passes that take under a quarter of it halve it again, so
+ * interactive traffic goes back to small passes that keep the two
+ * directions interleaved.
+ * ----------------------------------------------------------------
+ */
+
+typedef struct {
+  size_t size;   /* current budget */
+  size_t max;
+} read_sizer;
+
+
+static void sizer_init(read_sizer *s, size_t max) {
+  s->size = BUF_SIZE;
+  s->max  = max;
+}  /* sizer_init */
+
+
+static void sizer_update(read_sizer *s, size_t got) {
+  if (got >= s->size && s->size < s->max) {
+    s->size *= 2;
+    if (s->size > s->max) s->size = s->max;
+  } else if (got < s->size / 4 && s->size > BUF_SIZE) {
+    s->size /= 2;
+    if (s->size < BUF_SIZE) s->size = BUF_SIZE;
+  }
+}  /* sizer_update */
+
+
+/* ----------------------------------------------------------------
+ * Expect scripts (--script).
+ *
+ * A script drives the child instead of stdin, one step per line:
+ *
+ *   # comment
+ *   timeout 5          seconds each later expect may wait (0 = forever)
+ *   expect "login: "   wait until this text appears in the output
+ *   expect "$ " "# "   ... or any one of these
+ *   expect-re "[Pp]assword.*: $"
+ *                      wait for output matching a regular expression
+ *   send "root\r"      type this
+ *
+ * The text is either double-quoted or the rest of the line, and takes
+ * C-style escapes (\r \n \t \e \\ \" \xHH); a regular expression is
+ * taken as written, since the regex syntax has its own (see re.h).  An
+ * expect-re's alternatives are joined with |.  Each expect's texts go
+ * into one Aho-Corasick automaton that's fed the output as it's read,
+ * so the following sends go out the moment any of them appears rather
+ * than after a worst-case sleep, at the same cost however many
+ * alternatives there are.  An expect-re is fed the same way, so a match
+ * costs the same however much output came before it, and its $ means
+ * the prompt is the last thing the child has written.  An expect only
+ * sees output that arrived after the previous one matched.
+ * If its timeout runs out, the child is hung up on (SIGHUP) and minpty
+ * exits non-zero.
+ *
+ * The parsed script is shared by every session that runs it (only an
+ * expect-re's DFA cache changes as it's used); each has its own
+ * script_run.
+ * ----------------------------------------------------------------
+ */
+
+#define SCRIPT_TIMEOUT_DEFAULT 10   /* seconds */
+
+#define STEP_SEND      0
+#define STEP_EXPECT    1
+#define STEP_TIMEOUT   2
+#define STEP_EXPECT_RE 3
+#define STEP_SNAPSHOT  4
+
+typedef struct {
+  int op;
+  int line;          /* in the script file, for messages */
+  char *text;        /* STEP_SEND: what to type; STEP_EXPECT(_RE): the
+                      * texts as written, for messages */
+  size_t len;
+  ac_matcher ac;     /* STEP_EXPECT: any of its texts */
+  re_prog re;        /* STEP_EXPECT_RE */
+  long long us;      /* STEP_TIMEOUT */
+} script_step;
+
+typedef struct {
+  const char *path;
+  script_step *steps;
+  int n_steps;
+} script;
+
+/* One session's progress through a script. */
+typedef struct {
+  script *sc;
+  int step;          /* current step */
+  size_t sent;       /* STEP_SEND: bytes already queued */
+  int stalled;       /* STEP_SEND: waiting for input ring space */
+  int armed;         /* STEP_EXPECT(_RE): its timer is running */
+  ac_stream match;   /* STEP_EXPECT: progress through its automaton */
+  re_stream re_match;  /* STEP_EXPECT_RE: progress through its DFA */
+  long long timeout_us;
+  long long deadline;  /* armed expect gives up at; -1 = never */
+  int failed;
+} script_run;
+
+static script *g_script;  /* --script */
+
+/* --on: output-triggered hooks.  One automaton holds every hook's text
+ * (pattern id = hook index), shared by all sessions. */
+static ac_matcher g_hooks;
+static char **g_hook_cmds;
+static int *g_hook_next;   /* next hook with the same text, or -1 */
+static int g_n_hooks;
+
+/* A match waiting for the loop to start its hook. */
+#define HOOK_QUEUE 64
+typedef struct {
+  int id;
+  unsigned long long start;  /* stream offset of the match */
+} hook_call;
+
+/* Hooks' environment: ours plus the MINPTY_ variables, which fill the
+ * HOOK_ENV_VARS slots at the end before each start. */
+#define HOOK_ENV_VARS 3
+static char **g_hook_env;
+static int g_hook_env_n;         /* inherited entries */
+static unsigned long long g_hooks_run, g_hooks_dropped;
+
+/* Signal mask for anything we start (children, hooks). */
+static sigset_t g_child_mask;
+
+
+/*
+ * Parse one text argument at *pp (quoted, or the rest of the line)
+ * with escapes (or, if 'raw', leaving them for the regex parser), and
+ * advance *pp to the next one.  Returns a malloc'd buffer, length in
+ * *len, or NULL if malformed.
+ */
+static char *script_text(const char **pp, size_t *len, int raw) {
+  const char *p = *pp;
+  char *out = (char *)malloc(strlen(p) + 1);
+  size_t n = 0;
+  int quoted = (*p == '"');
+
+  if (out == NULL) { return NULL; }
+  if (quoted) p++;
+  while (*p != '\0' && !(quoted && *p == '"')) {
+    if (*p != '\\' || p[1] == '\0') {
+      out[n++] = *p++;
+      continue;
+    }
+    if (raw) {
+      out[n++] = *p++;
+      out[n++] = *p++;
+      continue;
+    }
+    p++;
+    switch (*p) {
+    case 'r': out[n++] = '\r'; break;
+    case 'n': out[n++] = '\n'; break;
+    case 't': out[n++] = '\t'; break;
+    case 'e': out[n++] = '\033'; break;
+    case 'x': {
+      unsigned v = 0;
+      int i;
+      for (i = 0; i < 2 && isxdigit((unsigned char)p[1]); i++, p++)
+        v = v * 16 + (isdigit((unsigned char)p[1]) ? p[1] - '0'
+                                                    : (tolower(p[1]) - 'a' + 10));
+      out[n++] = (char)v;
+      break;
+    }
+    default: out[n++] = *p; break;  /* \\, \", anything else */
+    }
+    p++;
+  }
+  if (quoted) {
+    if (*p != '"') {
+      free(out);
+      return NULL;
+    }
+    p++;
+    while (*p == ' ' || *p == '\t')
+      p++;
+  }
+  *pp = p;
+  *len = n;
+  return out;
+}  /* script_text */
+
+
+/*
+ * Free what a step holds (any step, even one half parsed).
+ */
+static void step_free(script_step *st) {
+  free(st->text);
+  ac_free(&st->ac);
+  re_free(&st->re);
+}  /* step_free */
+
+
+static void script_free(script *sc) {
+  int i;
+
+  for (i = 0; i < sc->n_steps; i++)
+    step_free(&sc->steps[i]);
+  free(sc->steps);
+  free(sc);
+}  /* script_free */
+
+
+/*
+ * Load and check a script.  Returns NULL (after saying why) if it
+ * can't be read or has a bad line.
+ */
+static script *script_load(const char *path) {
+  FILE *fp = fopen(path, "r");
+  script *sc;
+  script_step st;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  int line_no = 0, alloc = 0;
+
+  if (fp == NULL) { perror(path); return NULL; }  /* Handle error. */
+  sc = (script *)calloc(1, sizeof(*sc));
+  if (sc == NULL) { perror("calloc"); exit(1); }  /* Handle error. */
+  sc->path = path;
+  memset(&st, 0, sizeof(st));
+
+  while ((len = getline(&line, &cap, fp)) >= 0) {
+    char *p = line, *arg;
+
+    line_no++;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                       line[len - 1] == ' ' || line[len - 1] == '\t'))
+      line[--len] = '\0';
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == '\0' || *p == '#') continue;
+
+    memset(&st, 0, sizeof(st));
+    st.line = line_no;
+    arg = p + strcspn(p, " \t");
+    if (*arg != '\0') *arg++ = '\0';
+    while (*arg == ' ' || *arg == '\t')
+      arg++;
+
+    if (strcmp(p, "send") == 0) {
+      const char *a = arg;
+      st.op = STEP_SEND;
+      st.text = script_text(&a, &st.len, 0);
+      if (st.text == NULL) {
+        fprintf(stderr, "%s:%d: bad text\n", path, line_no);
+        goto fail;
+      }
+    } else if (strcmp(p, "expect") == 0) {
+      const char *a = arg;
+      st.op = STEP_EXPECT;
+      st.text = strdup(arg);
+      if (ac_init(&st.ac) < 0) { perror("ac_init"); exit(1); }  /* Handle error. */
+      do {
+        size_t n;
+        char *t = script_text(&a, &n, 0);
+        int id = (t == NULL) ? -1 : ac_add(&st.ac, t, n);
+        free(t);
+        if (id < 0) {
+          fprintf(stderr, "%s:%d: bad or empty text\n", path, line_no);
+          goto fail;
+        }
+      } while (*a != '\0');
+      if (ac_build(&st.ac) < 0) { perror("ac_build"); exit(1); }  /* Handle error. */
+    } else if (strcmp(p, "expect-re") == 0) {
+      const char *a = arg;
+      char *pat = NULL;
+      size_t pat_len = 0;
+      int ret;
+      st.op = STEP_EXPECT_RE;
+      st.text = strdup(arg);
+      do {
+        size_t n;
+        char *t = script_text(&a, &n, 1);
+        if (t == NULL) {
+          fprintf(stderr, "%s:%d: bad text\n", path, line_no);
+          free(pat);
+          goto fail;
+        }
+        /* Each alternative in its own group: (a)|(b)|... */
+        pat = (char *)realloc(pat, pat_len + n + 3);
+        if (pat == NULL) { perror("realloc"); exit(1); }  /* Handle error. */
+        if (pat_len > 0) pat[pat_len++] = '|';
+        pat[pat_len++] = '(';
+        memcpy(pat + pat_len, t, n);
+        pat_len += n;
+        pat[pat_len++] = ')';
+        free(t);
+      } while (*a != '\0');
+      ret = re_compile(&st.re, pat, pat_len, 0);
+      free(pat);
+      if (ret < 0) {
+        fprintf(stderr, "%s:%d: bad regex: %s\n", path, line_no, st.re.err);
+        goto fail;
+      }
+    } else if (strcmp(p, "snapshot") == 0) {
+      st.op = STEP_SNAPSHOT;
+      st.text = strdup("snapshot");
+    } else if (strcmp(p, "timeout") == 0) {
+      char *end;
+      double secs = strtod(arg, &end);
+      if (end == arg || secs < 0) {
+        fprintf(stderr, "%s:%d: bad timeout\n", path, line_no);
+        goto fail;
+      }
+      st.op = STEP_TIMEOUT;
+      st.us = (long long)(secs * 1e6);
+    } else {
+      fprintf(stderr, "%s:%d: unknown step '%s'\n", path, line_no, p);
+      goto fail;
+    }
+
+    if (sc->n_steps == alloc) {
+      alloc = alloc ? alloc * 2 : 16;
+      sc->steps = (script_step *)realloc(sc->steps,
+                                         alloc * sizeof(script_step));
+      if (sc->steps == NULL) { perror("realloc"); exit(1); }  /* Handle error. */
+    }
+    sc->steps[sc->n_steps++] = st;
+  }
+
+  free(line);
+  fclose(fp);
+  return sc;
+
+fail:
+  step_free(&st);
+  script_free(sc);
+  free(line);
+  fclose(fp);
+  return NULL;
+}  /* script_load */
+
+
+/* ----------------------------------------------------------------
+ * Screen snapshots (--snapshot).
+ *
+ * A session's output (stdout, or its log when supervised) gets what
+ * its screen model shows instead of the raw stream: at the end, every
+ * --snapshot-every (when something changed), and at each script
+ * "snapshot" step.  Text is the rows as lines, all of them, with a
+ * form feed line between snapshots.  JSON is one object per line.
+ *
+ * Each session keeps its rows rendered as UTF-8 and on each snapshot
+ * re-renders only the ones the model marked dirty since the last.
+ * ----------------------------------------------------------------
+ */
+
+#define SNAP_TEXT 1
+#define SNAP_JSON 2
+
+typedef struct {
+  char *text;        /* row r's text at text + r * row_size */
+  size_t *len;
+  int *dirty;        /* for vts_take_dirty() */
+  size_t row_size;
+  int rows, cols;    /* what text is sized for */
+  int count;         /* snapshots written */
+  int row, col;      /* cursor at the last one */
+  long long due;     /* next --snapshot-every, or -1 */
+} snap_state;
+
+static long long g_start_us;     /* for JSON "ms" */
+
+/* A snapshot being put together (one at a time: epoll engine only). */
+static char *g_snap_buf;
+static size_t g_snap_len, g_snap_cap;
+
+/* Where raw output is read to when it isn't going anywhere. */
+static char *g_snap_scratch;
+
+
+static void snap_put(const char *p, size_t n) {
+  if (g_snap_len + n > g_snap_cap) {
+    while (g_snap_len + n > g_snap_cap)
+      g_snap_cap = g_snap_cap ? g_snap_cap * 2 : 4096;
+    g_snap_buf = (char *)realloc(g_snap_buf, g_snap_cap);
+    if (g_snap_buf == NULL) { perror("realloc"); exit(1); }  /* Handle error. */
+  }
+  memcpy(g_snap_buf + g_snap_len, p, n);
+  g_snap_len += n;
+}  /* snap_put */
+
+
+/*
+ * p as the inside of a JSON string.  Screen text is UTF-8 already;
+ * only quotes, backslashes and control characters need escaping.
+ */
+static void snap_put_json(const char *p, size_t n) {
+  size_t i, start = 0;
+
+  for (i = 0; i < n; i++) {
+    unsigned char c = (unsigned char)p[i];
+    char esc[8];
+
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
+    snap_put(p + start, i - start);
+    if (c == '"' || c == '\\')
+      snprintf(esc, sizeof(esc), "\\%c", c);
+    else
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+    snap_put(esc, strlen(esc));
+    start = i + 1;
+  }
+  snap_put(p + start, n - start);
+}  /* snap_put_json */
+
+
+/*
+ * Bring sn's rendered rows up to date with scr.  Returns whether
+ * anything (a row or the cursor) changed since the last call.
+ */
+static int snap_update(snap_state *sn, vts_screen *scr) {
+  int changed = (scr->row != sn->row || scr->col != sn->col);
+  int n, i;
+
+  if (scr->rows != sn->rows || scr->cols != sn->cols) {
+    free(sn->text);
+    free(sn->len);
+    free(sn->dirty);
+    sn->row_size = VTS_ROW_TEXT_MAX(scr);
+    sn->text = (char *)malloc((size_t)scr->rows * sn->row_size);
+    sn->len = (size_t *)malloc(scr->rows * sizeof(size_t));
+    sn->dirty = (int *)malloc(scr->rows * sizeof(int));
+    if (sn->text == NULL || sn->len == NULL || sn->dirty == NULL) {
+      perror("malloc");
+      exit(1);
+    }  /* Handle error. */
+    sn->rows = scr->rows;
+    sn->cols = scr->cols;
+    vts_take_dirty(scr, sn->dirty);
+    for (i = 0; i < scr->rows; i++)
+      sn->len[i] = vts_row_text(scr, i, sn->text + i * sn->row_size,
+                                sn->row_size);
+    changed = 1;
+  } else {
+    n = vts_take_dirty(scr, sn->dirty);
+    for (i = 0; i < n; i++) {
+      int r = sn->dirty[i];
+      sn->len[r] = vts_row_text(scr, r, sn->text + r * sn->row_size,
+                                sn->row_size);
+    }
+    if (n > 0) changed = 1;
+  }
+  sn->row = scr->row;
+  sn->col = scr->col;
+  return changed;
+}  /* snap_update */
+
+
+/*
+ * Put snapshot number sn->count of scr in g_snap_buf.  why says what
+ * triggered it, ms when (since the start).
+ */
+static void snap_render(snap_state *sn, const vts_screen *scr,
+                        const char *why, long long ms) {
+  char head[256];
+  int i;
+
+  g_snap_len = 0;
+  if (g_opt_snapshot == SNAP_TEXT) {
+    if (sn->count > 0)
+      snap_put("\f\n", 2);
+    for (i = 0; i < sn->rows; i++) {
+      snap_put(sn->text + i * sn->row_size, sn->len[i]);
+      snap_put("\n", 1);
+    }
+  } else {
+    snprintf(head, sizeof(head),
+             "{\"seq\":%d,\"reason\":\"%s\",\"ms\":%lld,"
+             "\"rows\":%d,\"cols\":%d,\"cursor\":{\"row\":%d,\"col\":%d,"
+             "\"visible\":%s},\"alt\":%s,\"title\":\"",
+             sn->count + 1, why, ms,
+             scr->rows, scr->cols, scr->row, scr->col,
+             scr->cursor_visible ? "true" : "false",
+             scr->alt ? "true" : "false");
+    snap_put(head, strlen(head));
+    snap_put_json(scr->title, strlen(scr->title));
+    snap_put("\",\"lines\":[", 11);
+    for (i = 0; i < sn->rows; i++) {
+      if (i > 0) snap_put(",", 1);
+      snap_put("\"", 1);
+      snap_put_json(sn->text + i * sn->row_size, sn->len[i]);
+      snap_put("\"", 1);
+    }
+    snap_put("]}\n", 3);
+  }
+  sn->count++;
+}  /* snap_render */
+
+
+/* ----------------------------------------------------------------
+ * Recording (--record).
+ *
+ * Output is recorded by an output stage, so each event is one read
+ * with one clock reading.  Input is recorded as it's written to the
+ * child, from whatever source (stdin, a script, query answers), so the
+ * file shows when the child actually got it.  rec.c does the rest off
+ * this thread.
+ * ----------------------------------------------------------------
+ */
+
+static rec_writer g_rec;
+
+
+/*
+ * Output stage: record a chunk of output.
+ */
+static void record_feed(void *arg, const char *buf, size_t len) {
+  (void)arg;
+  rec_event(&g_rec, now_us(), REC_OUTPUT, buf, len);
+}  /* record_feed */
+
+
+/*
+ * Record what went out of r since position from.
+ */
+static void record_input(const relay_ring *r, size_t from) {
+  long long now = now_us();
+
+  while (from != r->head) {
+    size_t off = from & (r->size - 1);
+    size_t len = r->head - from;
+    if (len > r->size - off) len = r->size - off;
+    rec_event(&g_rec, now, REC_INPUT, r->buf + off, len);
+    from += len;
+  }
+}  /* record_input */
+
+
+/*
+ * Start recording to g_opt_record: a header for a ws-sized terminal
+ * running argv.  Returns -1 with errno set on failure.
+ */
+static int record_open(char **argv, const struct winsize *ws) {
+  rec_header h;
+  char *cmd;
+  size_t len = 1;
+  int i, ret;
+
+  for (i = 0; argv[i] != NULL; i++)
+    len += strlen(argv[i]) + 1;
+  cmd = (char *)malloc(len);
+  if (cmd == NULL) { return -1; }  /* Handle error. */
+  cmd[0] = '\0';
+  for (i = 0; argv[i] != NULL; i++) {
+    if (i > 0) strcat(cmd, " ");
+    strcat(cmd, argv[i]);
+  }
+
+  h.cols = ws->ws_col;
+  h.rows = ws->ws_row;
+  h.timestamp = (long long)time(NULL);
+  h.command = cmd;
+  h.term = getenv("TERM");
+  ret = rec_open(&g_rec, g_opt_record, g_opt_record_format, &h, now_us());
+  free(cmd);
+  return ret;
+}  /* record_open */
+
+
+/*
+ * Finish the recording, saying so if some of it is missing.
+ */
+static void record_close(void) {
+  if (rec_close(&g_rec) < 0)
+    fprintf(stderr, "[minpty: --record: writing %s failed]\n", g_opt_record);
+  if (g_rec.dropped > 0)
+    fprintf(stderr, "[minpty: --record: %llu bytes dropped; the disk "
+            "couldn't keep up]\n", g_rec.dropped);
+}  /* record_close */
+
+
+/*
+ * "SECONDS", "M:SS" or "H:MM:SS" (seconds may have a fraction) in
+ * microseconds, or -1 if it's none of those.
+ */
+static long long parse_time(const char *s) {
+  double t = 0;
+  int fields = 0;
+
+  for (;;) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v < 0 || ++fields > 3) { return -1; }
+    t = t * 60 + v;
+    if (*end == '\0') break;
+    if (*end != ':') { return -1; }
+    s = end + 1;
+  }
+  return (long long)(t * 1e6);
+}  /* parse_time */
+
+
+/*
+ * Map path read-only.  Returns NULL with errno set on failure.
+ */
+static void *map_file(const char *path, size_t *size) {
+  struct stat st;
+  void *p;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) { return NULL; }  /* Handle error. */
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }  /* Handle error. */
+  if (st.st_size == 0) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }  /* Handle error. */
+  p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) { return NULL; }  /* Handle error. */
+  *size = (size_t)st.st_size;
+  return p;
+}  /* map_file */
+
+
+/*
+ * --to-asciicast: write binary recording path to stdout as asciicast,
+ * starting at --from.  Returns the exit code.
+ */
+static int to_asciicast(const char *path) {
+  rec_reader r;
+  size_t size;
+  void *p = map_file(path, &size);
+  int ret = 0;
+
+  if (p == NULL) {
+    perror(path);
+    return 1;
+  }
+  if (rec_reader_init(&r, p, size) < 0) {
+    fprintf(stderr, "%s: not a binary minpty recording\n", path);
+    munmap(p, size);
+    return 1;
+  }
+  if (g_opt_from_us > 0)
+    rec_reader_seek(&r, g_opt_from_us);
+  if (rec_to_asciicast(&r, stdout, g_opt_from_us) < 0) {
+    perror("stdout");
+    ret = 1;
+  }
+  munmap(p, size);
+  return ret;
+}  /* to_asciicast */
+
+
+/* ----------------------------------------------------------------
+ * Plain-text transcript (--transcript).
+ *
+ * An output stage feeds vttext.c, which hands back each line once its
+ * LF arrives, escape sequences gone and CR/backspace rewrites applied.
+ * Lines collect in a buffer that's written out TRANSCRIPT_BUF at a
+ * time; the file is regular, so those writes only reach the page cache
+ * and don't need --record's writer thread.  The raw output goes to
+ * stdout as usual.
+ * ----------------------------------------------------------------
+ */
+
+#define TRANSCRIPT_BUF (64 * 1024)
+
+static vtt_state g_transcript;
+static int g_transcript_fd = -1;
+static char *g_transcript_buf;
+static size_t g_transcript_len;
+static int g_transcript_failed;  /* a write failed; the rest is dropped */
+
+
+/*
+ * Write len bytes of buf to the transcript file.
+ */
+static void transcript_write_file(const char *buf, size_t len) {
+  while (len > 0 && !g_transcript_failed) {
+    ssize_t n = write(g_transcript_fd, buf, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      g_transcript_failed = 1;
+      return;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+}  /* transcript_write_file */
+
+
+/*
+ * vttext.c's output: finished lines.
+ */
+static void transcript_out(void *arg, const char *buf, size_t len) {
+  (void)arg;
+  if (g_transcript_len + len > TRANSCRIPT_BUF) {
+    transcript_write_file(g_transcript_buf, g_transcript_len);
+    g_transcript_len = 0;
+  }
+  if (len > TRANSCRIPT_BUF) {
+    transcript_write_file(buf, len);
+    return;
+  }
+  memcpy(g_transcript_buf + g_transcript_len, buf, len);
+  g_transcript_len += len;
+}  /* transcript_out */
+
+
+/*
+ * Output stage: a chunk of output into the transcript.
+ */
+static void transcript_feed(void *arg, const char *buf, size_t len) {
+  (void)arg;
+  vtt_feed(&g_transcript, buf, len);
+}  /* transcript_feed */
+
+
+/*
+ * Create (or truncate) g_opt_transcript.  Returns -1 with errno set on
+ * failure.
+ */
+static int transcript_open(void) {
+  g_transcript_buf = (char *)malloc(TRANSCRIPT_BUF);
+  if (g_transcript_buf == NULL) { return -1; }  /* Handle error. */
+  if (vtt_init(&g_transcript, transcript_out, NULL) < 0) { return -1; }  /* Handle error. */
+  g_transcript_fd = open(g_opt_transcript,
+                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (g_transcript_fd < 0) { return -1; }  /* Handle error. */
+  return 0;
+}  /* transcript_open */
+
+
+/*
+ * Write out the last line and what's buffered, and close the file.
+ */
+static void transcript_close(void) {
+  vtt_finish(&g_transcript);
+  transcript_write_file(g_transcript_buf, g_transcript_len);
+  g_transcript_len = 0;
+  if (close(g_transcript_fd) < 0)
+    g_transcript_failed = 1;
+  if (g_transcript_failed)
+    fprintf(stderr, "[minpty: --transcript: writing %s failed]\n",
+            g_opt_transcript);
+  vtt_free(&g_transcript);
+  free(g_transcript_buf);
+}  /* transcript_close */
+
+
+/* ----------------------------------------------------------------
+ * Compressed capture (--capture).
+ *
+ * A copy of the raw output, compressed.  The output stage only copies
+ * each chunk into cz.c's ring; compressing and writing happen on its
+ * own thread, so the relay (and the keystrokes going the other way)
+ * never wait for either.
+ * ----------------------------------------------------------------
+ */
+
+static cz_writer g_capture;
+
+
+/*
+ * Output stage: a chunk of output into the capture.
+ */
+static void capture_feed(void *arg, const char *buf, size_t len) {
+  (void)arg;
+  cz_write(&g_capture, buf, len);
+}  /* capture_feed */
+
+
+/*
+ * Finish the capture, saying so if some of it is missing.
+ */
+static void capture_close(void) {
+  if (cz_close(&g_capture) < 0)
+    fprintf(stderr, "[minpty: --capture: writing %s failed]\n",
+            g_opt_capture);
+  if (g_capture.dropped > 0)
+    fprintf(stderr, "[minpty: --capture: %llu bytes dropped; compression "
+            "couldn't keep up]\n", g_capture.dropped);
+}  /* capture_close */
+
+
+/*
+ * --decompress: write capture path to stdout.  Returns the exit code.
+ */
+static int decompress(const char *path) {
+  size_t size;
+  void *p = map_file(path, &size);
+  int ret;
+
+  if (p == NULL) {
+    perror(path);
+    return 1;
+  }
+  ret = cz_decompress(p, size, stdout);
+  munmap(p, size);
+  switch (ret) {
+  case CZ_OK: return 0;
+  case CZ_ERR_FORMAT:
+    fprintf(stderr, "%s: not a minpty capture\n", path);
+    break;
+  case CZ_ERR_CODEC:
+    fprintf(stderr, "%s: compressed with a codec this minpty was built "
+            "without\n", path);
+    break;
+  case CZ_ERR_DATA:
+    fprintf(stderr, "%s: damaged or cut off\n", path);
+    break;
+  default:
+    perror("stdout");
+    break;
+  }
+  return 1;
+}  /* decompress */
+
+
+/* ----------------------------------------------------------------
+ * Replay (--replay).
+ *
+ * Plays a binary recording's output back to stdout or, with --screen,
+ * into a screen model (--snapshot writes the model's screen to stdout,
+ * on recording time).  At --speed=max it's a benchmark of whatever the
+ * output goes through: frames come straight out of the mapped file,
+ * to the model or to stdout in one writev() per REPLAY_IOV frames.
+ *
+ * --from skips ahead through the index for stdout.  A screen model
+ * needs everything before that point to be right, so it's fed that
+ * part at full speed instead, and the clock starts at --from.
+ * ----------------------------------------------------------------
+ */
+
+#define REPLAY_IOV 64
+
+
+/*
+ * writev() all of iov to fd, like write_all().
+ */
+static void writev_all(int fd, struct iovec *iov, int cnt) {
+  while (cnt > 0) {
+    ssize_t n = writev(fd, iov, cnt);
+    g_stats.writes++;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;  /* Nowhere to report it; drop the rest. */
+    }
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= (ssize_t)iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= (size_t)n;
+    }
+  }
+}  /* writev_all */
+
+
+static void sleep_until(long long when_us) {
+  struct timespec ts;
+  ts.tv_sec = when_us / 1000000;
+  ts.tv_nsec = (when_us % 1000000) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}  /* sleep_until */
+
+
+static void replay_snapshot(snap_state *sn, vts_screen *scr,
+                            const char *why, long long t_us, int if_changed) {
+  if (!snap_update(sn, scr) && if_changed) { return; }
+  snap_render(sn, scr, why, t_us / 1000);
+  write_all(STDOUT_FILENO, g_snap_buf, g_snap_len);
+}  /* replay_snapshot */
+
+
+/*
+ * --replay: play recording path back.  Returns the exit code.
+ */
+static int replay(const char *path) {
+  struct iovec iov[REPLAY_IOV];
+  int n_iov = 0;
+  vts_screen scr;
+  snap_state sn;
+  rec_reader r;
+  rec_frame f;
+  size_t size;
+  long long start, elapsed, snap_due = -1, t_us = 0;
+  unsigned long long frames = 0, bytes = 0;
+  void *p = map_file(path, &size);
+
+  if (p == NULL) {
+    perror(path);
+    return 1;
+  }
+  if (rec_reader_init(&r, p, size) < 0) {
+    fprintf(stderr, "%s: not a binary minpty recording\n", path);
+    munmap(p, size);
+    return 1;
+  }
+  if (g_opt_screen && vts_init(&scr, r.h.rows, r.h.cols) < 0) {
+    perror("malloc");
+    munmap(p, size);
+    return 1;
+  }
+  memset(&sn, 0, sizeof(sn));
+  if (!g_opt_screen && g_opt_from_us > 0)
+    rec_reader_seek(&r, g_opt_from_us);
+  if (g_opt_snapshot && g_opt_snapshot_every_us > 0)
+    snap_due = g_opt_from_us + g_opt_snapshot_every_us;
+
+  start = now_us();
+  while (rec_reader_next(&r, &f)) {
+    long long t = f.t_us - g_opt_from_us;
+    t_us = f.t_us;
+
+    if (g_opt_speed > 0 && t > 0) {
+      long long due = start + (long long)((double)t / g_opt_speed);
+      if (due > now_us()) {
+        writev_all(STDOUT_FILENO, iov, n_iov);
+        n_iov = 0;
+        sleep_until(due);
+      }
+    }
+    while (snap_due >= 0 && f.t_us >= snap_due) {
+      replay_snapshot(&sn, &scr, "interval", snap_due, 1);
+      snap_due += g_opt_snapshot_every_us;
+    }
+
+    if (f.code == REC_RESIZE && g_opt_screen) {
+      char text[32];
+      int cols, rows;
+      snprintf(text, sizeof(text), "%.*s", (int)f.len, f.data);
+      if (sscanf(text, "%dx%d", &cols, &rows) == 2)
+        vts_resize(&scr, rows, cols);
+    }
+    if (f.code != REC_OUTPUT) continue;
+    frames++;
+    bytes += f.len;
+    if (g_opt_screen) {
+      vts_feed(&scr, f.data, f.len);
+    } else {
+      iov[n_iov].iov_base = (void *)f.data;
+      iov[n_iov].iov_len = f.len;
+      if (++n_iov == REPLAY_IOV) {
+        writev_all(STDOUT_FILENO, iov, n_iov);
+        n_iov = 0;
+      }
+    }
+  }
+  writev_all(STDOUT_FILENO, iov, n_iov);
+  if (g_opt_snapshot)
+    replay_snapshot(&sn, &scr, "final", t_us, 0);
+  elapsed = now_us() - start;
+
+  if (g_opt_stats) {
+    fprintf(stderr, "[minpty: replay: %llu frames, %llu bytes in %.1f ms "
+            "(%.1f MB/s), %llu writes]\n", frames, bytes, elapsed / 1e3,
+            elapsed > 0 ? (double)bytes / elapsed : 0.0, g_stats.writes);
+    if (g_opt_screen)
+      fprintf(stderr, "[minpty: replay: screen %llu row updates, "
+              "%llu scrolls]\n", scr.n_row_updates, scr.n_scrolls);
+  }
+  if (g_opt_screen)
+    vts_free(&scr);
+  munmap(p, size);
+  return 0;
+}  /* replay */
+
+
+/* ----------------------------------------------------------------
+ * Sessions.
+ *
+ * A session is one child on one pty plus everything it takes to relay
+ * it: where its input comes from and its output goes, its rings and
+ * read budgets, its output stages, and the ready flags the
+ * edge-triggered loop keeps.  Normally there's exactly one, wired to
+ * our stdin and stdout.  With --supervise there's one per command,
+ * each writing to its own log with no input, and one io_loop()
+ * services them all.
+ * ----------------------------------------------------------------
+ */
+
+typedef struct session session;
+struct session {
+  int id;                  /* 1-based; names the session's log */
+  const char *cmd;         /* supervised command line, for reports */
+  pid_t pid;
+  int master_fd;
+  int pidfd;               /* -1: exit arrives as SIGCHLD */
+  int in_fd;               /* stdin, or -1 for no input */
+  int out_fd;              /* stdout, or the session's log */
+  int exited;              /* child has been reaped ... */
+  int status;              /* ... with this wait status */
+
+  int relay_mode;
+  int splice_pipe[2];
+  size_t splice_pending;   /* bytes sitting in splice_pipe */
+  relay_ring out_ring;     /* child output waiting for out_fd */
+  relay_ring in_ring;      /* input waiting for the child */
+  read_sizer out_sizer;    /* master read budget */
+  read_sizer in_sizer;     /* in_fd read budget */
+  int coalesce;            /* --coalesce in effect */
+  long long out_since;     /* when pending output first arrived */
+
+  out_stage stages[MAX_STAGES];
+  int n_stages;
+  script_run run;          /* --script progress (run.sc NULL: none) */
+  ac_stream hook_match;    /* --on progress */
+  hook_call hook_calls[HOOK_QUEUE];  /* matches whose hooks haven't run */
+  int n_hook_calls;
+  int answer;              /* answering terminal queries ... */
+  vtq_state vtq;           /* ... with this scanner */
+  vts_screen *screen;      /* --screen model, or NULL */
+  int screen_resize;       /* new size (rows << 16 | cols) not applied */
+  snap_state snap;         /* --snapshot */
+
+  /* io_loop() state. */
+  int master_ready, master_hup, master_writable;
+  int in_ready, in_open;
+  int out_writable;
+  long long drain_until;   /* once exited: stop waiting for output */
+  int io_done;             /* relay over, master closed */
+  int finished;            /* io_done and reaped */
+  int queued;              /* on the run queue */
+  session *next_run;
+  tw_timer timer;          /* on its session_deadline() */
+  long long timer_due;
+};
+
+static session *g_sessions;     /* array of g_n_sessions */
+static int g_n_sessions;
+static session **g_live;        /* the g_n_live unfinished ones */
+static int g_n_live;
+
+/* Sessions that can make progress without waiting for an event. */
+static session *g_runq;
+static session **g_runq_tail = &g_runq;
+
+/* Every session's next deadline, for io_loop(). */
+static tw_wheel g_wheel;
+
+
+/*
+ * Have feed() see every chunk of s's output from now on.
+ */
+static void add_stage(session *s, void (*feed)(void *, const char *, size_t),
+                      void *arg) {
+  if (s->n_stages == MAX_STAGES) { return; }
+  s->stages[s->n_stages].feed = feed;
+  s->stages[s->n_stages].arg = arg;
+  s->n_stages++;
+}  /* add_stage */
+
+
+static void run_stages(session *s, const char *buf, size_t len) {
+  int i;
+  for (i = 0; i < s->n_stages; i++)
+    s->stages[i].feed(s->stages[i].arg, buf, len);
+}  /* run_stages */
+
+
+/*
+ * Does s take input (from in_fd, a script or query answers)?
+ */
+static int session_has_input(const session *s) {
+  return s->in_fd >= 0 || s->run.sc != NULL || s->answer;
+}  /* session_has_input */
+
+
+/*
+ * Queue a snapshot of s's screen on its output; with if_changed, only
+ * if the screen changed since the last one.  If it doesn't fit in the
+ * ring, what's queued goes out first (blocking) to keep the order.
+ */
+static void session_snapshot(session *s, const char *why, int if_changed) {
+  struct iovec iov[2];
+  int cnt, i;
+
+  if (!g_opt_snapshot || s->screen == NULL) { return; }
+  if (!snap_update(&s->snap, s->screen) && if_changed) { return; }
+  snap_render(&s->snap, s->screen, why, (now_us() - g_start_us) / 1000);
+
+  if (s->out_ring.size - ring_used(&s->out_ring) >= g_snap_len) {
+    ring_put(&s->out_ring, g_snap_buf, g_snap_len);
+    return;
+  }
+  cnt = ring_data(&s->out_ring, iov);
+  for (i = 0; i < cnt; i++)
+    write_all(s->out_fd, (const char *)iov[i].iov_base, iov[i].iov_len);
+  s->out_ring.head = s->out_ring.tail;
+  write_all(s->out_fd, g_snap_buf, g_snap_len);
+}  /* session_snapshot */
+
+
+/*
+ * The script's current step can't complete; say why and stop it.
+ */
+static void script_fail(session *s, const char *why) {
+  script_run *r = &s->run;
+  const script_step *st = &r->sc->steps[r->step];
+
+  fprintf(stderr, "[minpty: %s:%d: %s waiting for %s]\n",
+          r->sc->path, st->line, why, st->text);
+  r->failed = 1;
+  r->armed = 0;
+  r->step = r->sc->n_steps;
+}  /* script_fail */
+
+
+/*
+ * Run s's script forward from the current step: queue sends on the
+ * input ring and arm the next expect.  Stops at an expect (until its
+ * text shows up) or when the ring is full.
+ */
+static void script_pump(session *s, long long now) {
+  script_run *r = &s->run;
+
+  r->stalled = 0;
+  while (r->step < r->sc->n_steps) {
+    const script_step *st = &r->sc->steps[r->step];
+
+    if (st->op == STEP_TIMEOUT) {
+      r->timeout_us = st->us;
+    } else if (st->op == STEP_SEND) {
+      r->sent += ring_put(&s->in_ring, st->text + r->sent, st->len - r->sent);
+      if (r->sent < st->len) {
+        r->stalled = 1;
+        return;
+      }
+      g_stats.in_bytes += st->len;
+      r->sent = 0;
+    } else if (st->op == STEP_SNAPSHOT) {
+      session_snapshot(s, "script", 0);
+    } else {
+      if (!r->armed) {
+        r->armed = 1;
+        if (st->op == STEP_EXPECT)
+          ac_stream_init(&r->match);
+        else
+          re_stream_free(&r->re_match);  /* also starts it over */
+        r->deadline = (r->timeout_us > 0) ? now + r->timeout_us : -1;
+      }
+      return;
+    }
+    r->step++;
+  }
+}  /* script_pump */
+
+
+/*
+ * ac_feed() callback for expects: any match will do, so stop there.
+ */
+static int script_hit(void *arg, int id, unsigned long long end) {
+  (void)id;
+  (void)end;
+  *(int *)arg = 1;
+  return 1;
+}  /* script_hit */
+
+
+/*
+ * re_feed() callback for expect-re: the same.
+ */
+static int script_re_hit(void *arg, unsigned long long end) {
+  (void)end;
+  *(int *)arg = 1;
+  return 1;
+}  /* script_re_hit */
+
+
+/*
+ * Output stage: match the armed expect against each chunk of output,
+ * carrying a partial match over to the next chunk.  Whatever follows a
+ * match goes on to the next expect.
+ */
+static void script_feed(void *arg, const char *buf, size_t len) {
+  session *s = (session *)arg;
+  script_run *r = &s->run;
+
+  while (len > 0 && r->armed) {
+    script_step *st = &r->sc->steps[r->step];
+    int hit = 0;
+    size_t n;
+
+    if (st->op == STEP_EXPECT)
+      n = ac_feed(&st->ac, &r->match, buf, len, script_hit, &hit);
+    else
+      n = re_feed(&st->re, &r->re_match, buf, len, script_re_hit, &hit);
+    if (n == 0 && !hit) break;  /* out of memory */
+
+    buf += n;
+    len -= n;
+    if (hit) {
+      r->armed = 0;
+      r->step++;
+      script_pump(s, now_us());
+    }
+  }
+}  /* script_feed */
+
+
+/*
+ * Check s's script for an expect that has run out of time.  Hanging up
+ * on the child is what a terminal would do if its user walked away.
+ */
+static void script_check(session *s, long long now) {
+  script_run *r = &s->run;
+
+  if (r->stalled)
+    script_pump(s, now);
+  if (r->armed && r->deadline >= 0 && now >= r->deadline) {
+    script_fail(s, "timed out");
+    if (!s->exited)
+      kill(s->pid, SIGHUP);
+  }
+}  /* script_check */
+
+
+/*
+ * Set up the hooks' environment once, so starting one builds nothing
+ * but its three values.  Returns 0, or -1 if out of memory.
+ */
+static int hook_env_init(void) {
+  extern char **environ;
+  int n = 0, i;
+
+  while (environ[n] != NULL) n++;
+  g_hook_env = (char **)malloc((n + HOOK_ENV_VARS + 1) * sizeof(char *));
+  if (g_hook_env == NULL) { return -1; }  /* Handle error. */
+  for (i = 0; i < n; i++) {
+    if (strncmp(environ[i], "MINPTY_", 7) == 0) continue;
+    g_hook_env[g_hook_env_n++] = environ[i];
+  }
+  return 0;
+}  /* hook_env_init */
+
+
+/*
+ * Start hook 'id' for a match in s's output that starts at stream offset
+ * 'start', with stdin, stdout and stderr on /dev/null (so nothing it
+ * prints lands in the relayed output) and its details in the
+ * environment.  It's not waited for; the loop reaps it on SIGCHLD.
+ */
+static void run_hook(session *s, int id, unsigned long long start) {
+  char session_var[32], pid_var[32], offset_var[48];
+  char *argv[] = { "sh", "-c", g_hook_cmds[id], NULL };
+  char **env = g_hook_env + g_hook_env_n;
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  pid_t pid;
+
+  snprintf(session_var, sizeof(session_var), "MINPTY_SESSION=%d", s->id);
+  snprintf(pid_var, sizeof(pid_var), "MINPTY_PID=%d", (int)s->pid);
+  snprintf(offset_var, sizeof(offset_var), "MINPTY_OFFSET=%llu", start);
+  env[0] = session_var;
+  env[1] = pid_var;
+  env[2] = offset_var;
+  env[3] = NULL;
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null",
+                                   O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  posix_spawn_file_actions_adddup2(&fa, STDOUT_FILENO, STDERR_FILENO);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &g_child_mask);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+  if (posix_spawn(&pid, "/bin/sh", &fa, &attr, argv, g_hook_env) == 0)
+    g_hooks_run++;
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+}  /* run_hook */
+
+
+/*
+ * Start the hooks for the matches queued since the last call.
+ */
+static void run_hooks(session *s) {
+  int i;
+  for (i = 0; i < s->n_hook_calls; i++)
+    run_hook(s, s->hook_calls[i].id, s->hook_calls[i].start);
+  s->n_hook_calls = 0;
+}  /* run_hooks */
+
+
+/*
+ * ac_feed() callback for hooks: every match counts, for every hook on
+ * that text (the automaton only reports the first).  They're only
+ * queued here; the loop starts them, between reads.  Matches past a
+ * full queue are dropped.
+ */
+static int hook_hit(void *arg, int id, unsigned long long end) {
+  session *s = (session *)arg;
+  unsigned long long start = end - ac_pat_len(&g_hooks, id);
+
+  for (; id >= 0; id = g_hook_next[id]) {
+    if (s->n_hook_calls == HOOK_QUEUE) {
+      g_hooks_dropped++;
+      continue;
+    }
+    s->hook_calls[s->n_hook_calls].id = id;
+    s->hook_calls[s->n_hook_calls].start = start;
+    s->n_hook_calls++;
+  }
+  return 0;
+}  /* hook_hit */
+
+
+/*
+ * Output stage: one pass over each chunk finds every hook's matches.
+ */
+static void hook_feed(void *arg, const char *buf, size_t len) {
+  session *s = (session *)arg;
+  ac_feed(&g_hooks, &s->hook_match, buf, len, hook_hit, s);
+}  /* hook_feed */
+
+
+/*
+ * Parse --on=TEXT=CMD.  TEXT takes the same escapes as script text.
+ * Hooks on the same text are chained from the first, in order.
+ */
+static int hook_add(const char *spec) {
+  const char *eq = strchr(spec, '=');
+  char *text, *raw;
+  const char *p;
+  size_t len;
+  int id, first = -1;
+
+  if (eq == NULL || eq == spec) { return -1; }
+  if (g_n_hooks == 0 && ac_init(&g_hooks) < 0) { return -1; }
+
+  raw = strndup(spec, eq - spec);
+  p = raw;
+  text = script_text(&p, &len, 0);
+  if (text != NULL)
+    first = ac_lookup(&g_hooks, text, len);
+  id = (text != NULL) ? ac_add(&g_hooks, text, len) : -1;
+  free(text);
+  free(raw);
+  if (id < 0) { return -1; }
+
+  g_hook_cmds = (char **)realloc(g_hook_cmds, (id + 1) * sizeof(char *));
+  if (g_hook_cmds == NULL) { perror("realloc"); exit(1); }  /* Handle error. */
+  g_hook_next = (int *)realloc(g_hook_next, (id + 1) * sizeof(int));
+  if (g_hook_next == NULL) { perror("realloc"); exit(1); }  /* Handle error. */
+  g_hook_cmds[id] = strdup(eq + 1);
+  g_hook_next[id] = -1;
+  if (first >= 0) {
+    while (g_hook_next[first] >= 0)
+      first = g_hook_next[first];
+    g_hook_next[first] = id;
+  }
+  g_n_hooks = id + 1;
+  return 0;
+}  /* hook_add */
+
+
+/*
+ * vtq_feed() or vts_feed() callback: type the answer as if a terminal
+ * had.  If the input ring is full the answer is dropped, just as a slow
+ * terminal's would be late; the child's own timeout covers it.
+ */
+static void answer_reply(void *arg, const char *reply, size_t len) {
+  session *s = (session *)arg;
+  if (s->in_ring.size - ring_used(&s->in_ring) >= len)
+    ring_put(&s->in_ring, reply, len);
+}  /* answer_reply */
+
+
+/*
+ * Output stage: watch for terminal queries.
+ */
+static void answer_feed(void *arg, const char *buf, size_t len) {
+  session *s = (session *)arg;
+  vtq_feed(&s->vtq, buf, len, answer_reply, s);
+}  /* answer_feed */
+
+
+/*
+ * Output stage: apply the output to the screen model.  A resize is
+ * picked up here rather than where SIGWINCH is read, since with the
+ * threads engine that's another thread; the child redraws after a
+ * resize, so output follows soon enough.
+ */
+static void screen_feed(void *arg, const char *buf, size_t len) {
+  session *s = (session *)arg;
+  int size = __atomic_exchange_n(&s->screen_resize, 0, __ATOMIC_ACQUIRE);
+
+  if (size != 0)
+    vts_resize(s->screen, size >> 16, size & 0xFFFF);
+  vts_feed(s->screen, buf, len);
+}  /* screen_feed */
+
+
+/*
+ * With --screen, give s a screen model of the pty's size.  Returns -1
+ * if it can't be allocated.
+ */
+static int session_screen_init(session *s, const struct winsize *ws) {
+  if (!g_opt_screen) { return 0; }
+  s->screen = (vts_screen *)malloc(sizeof(vts_screen));
+  if (s->screen == NULL) { return -1; }  /* Handle error. */
+  if (vts_init(s->screen, ws->ws_row, ws->ws_col) < 0) {
+    free(s->screen);
+    s->screen = NULL;
+    return -1;
+  }  /* Handle error. */
+  /* First in line, so that later stages (a script's snapshot step) see
+   * the screen with the chunk applied. */
+  add_stage(s, screen_feed, s);
+  memmove(&s->stages[1], &s->stages[0],
+          (s->n_stages - 1) * sizeof(out_stage));
+  s->stages[0].feed = screen_feed;
+  s->stages[0].arg = s;
+  return 0;
+}  /* session_screen_init */
+
+
+/*
+ * The terminal was resized: pass its size on to s's pty, screen and
+ * query answers.
+ */
+static void session_window_size(session *s) {
+  struct winsize ws;
+
+  copy_window_size(s->master_fd, &ws);
+  if (s->screen != NULL)
+    __atomic_store_n(&s->screen_resize, (ws.ws_row << 16) | ws.ws_col,
+                     __ATOMIC_RELEASE);
+  else if (s->answer)
+    vtq_set_size(&s->vtq, ws.ws_row, ws.ws_col);
+  if (g_opt_record != NULL) {
+    char size[32];
+    int n = snprintf(size, sizeof(size), "%dx%d", ws.ws_col, ws.ws_row);
+    rec_event(&g_rec, now_us(), REC_RESIZE, size, (size_t)n);
+  }
+}  /* session_window_size */
+
+
+/*
+ * Shell-style exit code for a wait status.
+ */
+static int exit_code(int status) {
+  if (WIFEXITED(status)) { return WEXITSTATUS(status); }
+  if (WIFSIGNALED(status)) { return 128 + WTERMSIG(status); }
+  return 0;
+}  /* exit_code */
+
+
+/*
+ * Exit code to report for s: the child's, but a failed script turns
+ * success into 1.
+ */
+static int session_result(const session *s) {
+  int code = exit_code(s->status);
+  return (code == 0 && s->run.failed) ? 1 : code;
+}  /* session_result */
+
+
+static void session_init(session *s, int id, int in_fd, int out_fd) {
+  memset(s, 0, sizeof(*s));
+  s->id = id;
+  s->master_fd = -1;
+  s->pidfd = -1;
+  s->in_fd = in_fd;
+  s->out_fd = out_fd;
+  s->relay_mode = RELAY_COPY;
+  s->splice_pipe[0] = s->splice_pipe[1] = -1;
+  s->master_writable = 1;
+  s->out_writable = 1;
+  s->snap.due = -1;
+
+  /* A script stands in for input. */
+  if (g_script != NULL) {
+    s->in_fd = -1;
+    s->run.sc = g_script;
+    s->run.timeout_us = SCRIPT_TIMEOUT_DEFAULT * 1000000LL;
+    s->run.deadline = -1;
+    add_stage(s, script_feed, s);
+  }
+  if (g_n_hooks > 0) {
+    ac_stream_init(&s->hook_match);
+    add_stage(s, hook_feed, s);
+  }
+  s->in_open = (s->in_fd >= 0);
+}  /* session_init */
+
+
+/*
+ * Put s on the run queue (once) so the loop services it next pass.
+ */
+static void session_wake(session *s) {
+  if (s->queued || s->finished) { return; }
+  s->queued = 1;
+  s->next_run = NULL;
+  *g_runq_tail = s;
+  g_runq_tail = &s->next_run;
+}  /* session_wake */
+
+
+/*
+ * s is done with: no more relaying to do and the child reaped.
+ */
+static void session_finish(session *s) {
+  int i;
+
+  s->finished = 1;
+  if (s->pidfd >= 0) {
+    close(s->pidfd);
+    s->pidfd = -1;
+  }
+  for (i = 0; i < g_n_live; i++) {
+    if (g_live[i] == s) {
+      g_live[i] = g_live[--g_n_live];
+      break;
+    }
+  }
+
+  if (g_opt_supervise != NULL) {
+    printf("%d\t%d\t%s\n", s->id, session_result(s), s->cmd);
+    fflush(stdout);
+  }
+}  /* session_finish */
+
+
+/*
+ * s's child has exited with 'status'.  Its output gets EXIT_DRAIN_MS of
+ * grace (renewed whenever more arrives) rather than waiting for a
+ * hangup that won't come if a background grandchild still holds the
+ * slave open.
+ */
+static void session_exited(session *s, int status) {
+  s->exited = 1;
+  s->status = status;
+  if (s->io_done) {
+    session_finish(s);
+    return;
+  }
+  s->drain_until = now_us() + EXIT_DRAIN_MS * 1000LL;
+  session_wake(s);
+}  /* session_exited */
+
+
+/*
+ * Reap s's child if it has exited (non-blocking).
+ */
+static void reap_child(session *s) {
+  int status;
+  if (s->exited) { return; }
+  if (waitpid(s->pid, &status, WNOHANG) > 0)
+    session_exited(s, status);
+}  /* reap_child */
+
+
+/*
+ * SIGCHLD (without pidfds, or with hooks): reap every child that has
+ * exited, sessions' and hooks' alike.
+ */
+static void reap_any(void) {
+  pid_t pid;
+  int status, i;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (i = 0; i < g_n_sessions; i++) {
+      if (g_sessions[i].pid == pid && !g_sessions[i].exited) {
+        session_exited(&g_sessions[i], status);
+        break;
+      }
+    }
+  }
+}  /* reap_any */
+
+
+/*
+ * Pick s's output relay mode.  splice() needs a pipe on at least one
+ * side, so a pipe for output gets a direct master -> out_fd splice and
+ * other non-terminal outputs (files, /dev/null, sockets) go through an
+ * intermediate pipe.  Terminals can't be spliced to, so they keep the
+ * plain read/write path, as does anything that has to see the bytes.
+ */
+static void choose_relay_mode(session *s) {
+  struct stat st;
+
+  s->relay_mode = RELAY_COPY;
+  if (!g_opt_splice || s->n_stages > 0) { return; }
+  if (isatty(s->out_fd)) { return; }
+  if (fstat(s->out_fd, &st) < 0) { return; }
+
+  if (S_ISFIFO(st.st_mode)) {
+    s->relay_mode = RELAY_SPLICE;
+    return;
+  }
+
+  if (pipe2(s->splice_pipe, O_CLOEXEC | O_NONBLOCK) < 0) { return; }  /* Handle error. */
+  fcntl(s->splice_pipe[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+  s->relay_mode = RELAY_SPLICE_VIA;
+}  /* choose_relay_mode */
+
+
+/* ----------------------------------------------------------------
+ * Output relay (pty master -> out_fd), per relay mode.
+ *
+ * RELAY_COPY reads into the output ring and writev()s it out.
+ * RELAY_SPLICE_VIA uses the intermediate pipe as its ring.
+ * RELAY_SPLICE has no ring at all: the out_fd pipe is the buffer, and
+ * an EAGAIN can't tell a quiet master from a full out_fd, so the loop
+ * retries the master whenever out_fd becomes writable again.
+ * ----------------------------------------------------------------
+ */
+
+/*
+ * Is there room to read more child output?
+ */
+static int output_has_room(const session *s) {
+  if (s->relay_mode == RELAY_SPLICE_VIA)
+    return s->splice_pending < SPLICE_CHUNK;
+  if (s->relay_mode == RELAY_COPY)
+    return ring_used(&s->out_ring) < s->out_ring.size;
+  return 1;
+}  /* output_has_room */
+
+
+/*
+ * Is child output waiting for out_fd?
+ */
+static int output_pending(const session *s) {
+  if (s->relay_mode == RELAY_SPLICE_VIA)
+    return s->splice_pending > 0;
+  return ring_used(&s->out_ring) > 0;
+}  /* output_pending */
+
+
+/*
+ * Should pending output go out now?  Without coalescing, always.
+ * With it, once enough has piled up, the oldest byte has waited its
+ * latency budget, or no more can be read in.  'final' forces it.
+ */
+static int output_due(const session *s, long long now, int final) {
+  size_t pending;
+
+  if (!s->coalesce || final) { return 1; }
+  if (!output_has_room(s)) { return 1; }
+  pending = (s->relay_mode == RELAY_SPLICE_VIA) ? s->splice_pending
+                                                : ring_used(&s->out_ring);
+  if (pending >= g_opt_coalesce_bytes) { return 1; }
+  return now - s->out_since >= g_opt_coalesce_us;
+}  /* output_due */
+
+
+/*
+ * Read one chunk (at most max bytes) of child output from the pty
+ * master.  Returns the number of bytes taken, 0 on EOF, -1 on error
+ * (errno set).  Falls back to the copy path for good if the kernel
+ * refuses to splice from the pty.
+ */
+static ssize_t read_output(session *s, size_t max) {
+  ssize_t n;
+  size_t len;
+  char *p;
+
+  if (s->relay_mode == RELAY_SPLICE) {
+    n = splice(s->master_fd, NULL, s->out_fd, NULL, max,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    g_stats.splices++;
+    if (n >= 0 || errno != EINVAL) {
+      if (n > 0) g_stats.out_bytes += (unsigned long long)n;
+      return n;
+    }
+    s->relay_mode = RELAY_COPY;
+  }
+
+  if (s->relay_mode == RELAY_SPLICE_VIA) {
+    len = SPLICE_CHUNK - s->splice_pending;
+    n = splice(s->master_fd, NULL, s->splice_pipe[1], NULL,
+               len < max ? len : max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    g_stats.splices++;
+    if (n > 0) {
+      s->splice_pending += (size_t)n;
+      g_stats.out_bytes += (unsigned long long)n;
+      return n;
+    }
+    if (n == 0 || errno != EINVAL) { return n; }
+    s->relay_mode = RELAY_COPY;
+  }
+
+  /* With --snapshot the raw output only goes to the stages; the ring
+   * holds snapshots. */
+  if (g_opt_snapshot) {
+    p = g_snap_scratch;
+    len = g_opt_max_read;
+  } else {
+    p = ring_space(&s->out_ring, &len);
+  }
+  if (len > max) len = max;
+  n = read(s->master_fd, p, len);
+  g_stats.reads++;
+  if (n > 0) {
+    run_stages(s, p, (size_t)n);
+    if (!g_opt_snapshot)
+      s->out_ring.tail += (size_t)n;
+    g_stats.out_bytes += (unsigned long long)n;
+  }
+  return n;
+}  /* read_output */
+
+
+/*
+ * Read one chunk (at most max bytes) of input from in_fd into the
+ * input ring.  Returns like read().
+ */
+static ssize_t read_input(session *s, size_t max) {
+  size_t len;
+  char *p = ring_space(&s->in_ring, &len);
+  ssize_t n;
+
+  if (len > max) len = max;
+  n = read(s->in_fd, p, len);
+  g_stats.reads++;
+  if (n > 0) {
+    s->in_ring.tail += (size_t)n;
+    g_stats.in_bytes += (unsigned long long)n;
+  }
+  return n;
+}  /* read_input */
+
+
+/*
+ * Push pending child output to out_fd without blocking.
+ * Returns 0 if out_fd stopped accepting (EAGAIN), else 1.
+ */
+static int flush_output(session *s) {
+  if (s->relay_mode == RELAY_SPLICE_VIA) {
+    while (s->splice_pending > 0) {
+      ssize_t n = splice(s->splice_pipe[0], NULL, s->out_fd, NULL,
+                         s->splice_pending,
+                         SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+      g_stats.splices++;
+      if (n > 0) {
+        s->splice_pending -= (size_t)n;
+        continue;
+      }
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && errno == EAGAIN) { return 0; }
+
+      /*
+       * out_fd won't take splice() after all.  Move what's in the
+       * pipe into the output ring (it fits: the ring is empty in
+       * this mode and at least SPLICE_CHUNK) and copy from now on.
+       */
+      while (s->splice_pending > 0) {
+        size_t len;
+        char *p = ring_space(&s->out_ring, &len);
+        n = read(s->splice_pipe[0], p, len);
+        g_stats.reads++;
+        if (n <= 0) break;
+        s->out_ring.tail += (size_t)n;
+        s->splice_pending -= (size_t)n;
+      }
+      s->splice_pending = 0;
+      s->relay_mode = RELAY_COPY;
+      break;
+    }
+  }
+
+  return ring_flush(&s->out_ring, s->out_fd);
+}  /* flush_output */
+
+
+/*
+ * Push pending input to the child without blocking, recording it if
+ * asked.  Returns like ring_flush().
+ */
+static int flush_input(session *s) {
+  size_t head = s->in_ring.head;
+  int ret = ring_flush(&s->in_ring, s->master_fd);
+
+  if (g_opt_record_input && s->in_ring.head != head)
+    record_input(&s->in_ring, head);
+  return ret;
+}  /* flush_input */
+
+
+/*
+ * epoll_wait() with a microsecond timeout (-1 = forever).  Uses
+ * epoll_pwait2() where the kernel has it (5.11+) so small coalescing
+ * budgets aren't rounded up to a whole millisecond.
+ */
+static int wait_events(int epfd, struct epoll_event *events, int max,
+                       long long timeout_us) {
+#ifdef SYS_epoll_pwait2
+  static int have_pwait2 = 1;
+  if (have_pwait2) {
+    struct timespec ts;
+    int n;
+    ts.tv_sec  = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+    n = (int)syscall(SYS_epoll_pwait2, epfd, events, max,
+                     timeout_us < 0 ? NULL : &ts, NULL, 0);
+    if (n >= 0 || errno != ENOSYS) { return n; }
+    have_pwait2 = 0;
+  }
+#endif
+  return epoll_wait(epfd, events, max,
+                    timeout_us < 0 ? -1 : (int)((timeout_us + 999) / 1000));
+}  /* wait_events */
+
+
+/*
+ * Set O_NONBLOCK on fd.  Returns the previous file status flags so
+ * they can be put back (stdin is usually shared with our parent).
+ */
+static int set_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0)
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  return flags;
+}  /* set_nonblock */
+
+
+/*
+ * Will output to out_fd have queries answered?  Answering has to see
+ * the output, which rules out splice, so it's only on by default when
+ * the screen model sees it anyway.
+ */
+static int answer_wanted(int out_fd) {
+  if (isatty(out_fd)) { return 0; }
+  return g_opt_answer > 0 || (g_opt_answer < 0 && g_opt_screen);
+}  /* answer_wanted */
+
+
+/*
+ * Set s up for io_loop(): relay mode, rings and read budgets.  Every
+ * fd the loop touches must be non-blocking; the caller handles in_fd
+ * and out_fd, which may be shared with our parent.
+ */
+static int session_relay_init(session *s) {
+  size_t ring_size = RING_SIZE;
+
+  /* Nothing else will answer the child's queries. */
+  if (answer_wanted(s->out_fd)) {
+    s->answer = 1;
+    if (s->screen != NULL) {
+      /* The model knows where the cursor really is. */
+      vts_set_reply(s->screen, answer_reply, s);
+    } else {
+      struct winsize ws;
+      vtq_init(&s->vtq);
+      if (ioctl(s->master_fd, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0)
+        vtq_set_size(&s->vtq, ws.ws_row, ws.ws_col);
+      add_stage(s, answer_feed, s);
+    }
+  }
+
+  choose_relay_mode(s);
+
+  /* A terminal on output always gets it immediately. */
+  s->coalesce = (g_opt_coalesce_us >= 0 && !isatty(s->out_fd));
+
+  while (ring_size < 2 * g_opt_max_read)
+    ring_size *= 2;
+  sizer_init(&s->out_sizer, g_opt_max_read);
+  sizer_init(&s->in_sizer, g_opt_max_read);
+  if (ring_init(&s->out_ring, ring_size) < 0) { return -1; }  /* Handle error. */
+  if (session_has_input(s) && ring_init(&s->in_ring, ring_size) < 0) { return -1; }  /* Handle error. */
+
+  if (g_opt_snapshot && g_snap_scratch == NULL) {
+    g_snap_scratch = (char *)malloc(g_opt_max_read);
+    if (g_snap_scratch == NULL) { return -1; }  /* Handle error. */
+  }
+  if (g_opt_snapshot && g_opt_snapshot_every_us > 0)
+    s->snap.due = now_us() + g_opt_snapshot_every_us;
+
+  set_nonblock(s->master_fd);
+  if (s->run.sc != NULL)
+    script_pump(s, now_us());
+  return 0;
+}  /* session_relay_init */
+
+
+/*
+ * Add s's fds to the epoll set, tagged with its index.
+ */
+static void session_watch(session *s, int epfd) {
+  struct epoll_event ev;
+  uint64_t idx = (uint64_t)(s - g_sessions);
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events   = EPOLLIN | EPOLLRDHUP | EPOLLET;
+  if (session_has_input(s))
+    ev.events |= EPOLLOUT;  /* only input needs the master writable */
+  ev.data.u64 = EV_TAG(EV_MASTER, idx);
+  epoll_ctl(epfd, EPOLL_CTL_ADD, s->master_fd, &ev);
+
+  if (s->in_fd >= 0) {
+    ev.events   = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = EV_TAG(EV_STDIN, idx);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->in_fd, &ev) < 0) {
+      /*
+       * EPERM: input is a regular file (or /dev/null), which epoll
+       * won't watch.  Those are always readable, so just say so.
+       */
+      s->in_ready = 1;
+    }
+  }
+
+  /* Same for output: if epoll won't watch it, it never blocks. */
+  ev.events   = EPOLLOUT | EPOLLET;
+  ev.data.u64 = EV_TAG(EV_STDOUT, idx);
+  epoll_ctl(epfd, EPOLL_CTL_ADD, s->out_fd, &ev);
+
+  if (s->pidfd >= 0) {
+    ev.events   = EPOLLIN;
+    ev.data.u64 = EV_TAG(EV_CHILD, idx);
+    epoll_ctl(epfd, EPOLL_CTL_ADD, s->pidfd, &ev);
+  }
+}  /* session_watch */
+
+
+/*
+ * The relay for s is over.  Whatever child output is still buffered
+ * goes out now, waiting on out_fd if need be.  Undelivered input is
+ * dropped; its reader is gone.  Closing the master also hangs up any
+ * background grandchild still holding the slave.
+ */
+static void session_end_io(session *s, int epfd) {
+  struct iovec iov[2];
+  int cnt, i;
+
+  if (s->relay_mode == RELAY_SPLICE_VIA) {
+    while (flush_output(s) == 0) {
+      struct pollfd pfd = { s->out_fd, POLLOUT, 0 };
+      poll(&pfd, 1, -1);
+    }
+  }
+  session_snapshot(s, "final", 0);
+  cnt = ring_data(&s->out_ring, iov);
+  for (i = 0; i < cnt; i++)
+    write_all(s->out_fd, (const char *)iov[i].iov_base, iov[i].iov_len);
+  s->out_ring.head = s->out_ring.tail;
+
+  if (s->in_open)
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->in_fd, NULL);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, s->out_fd, NULL);
+  close(s->master_fd);
+  s->master_fd = -1;
+  s->master_ready = s->in_ready = s->in_open = 0;
+
+  if (s->run.sc != NULL && s->run.step < s->run.sc->n_steps)
+    script_fail(s, "output ended");
+
+  if (s->splice_pipe[0] >= 0) {
+    close(s->splice_pipe[0]);
+    close(s->splice_pipe[1]);
+    s->splice_pipe[0] = s->splice_pipe[1] = -1;
+  }
+  free(s->out_ring.buf);
+  free(s->in_ring.buf);
+  re_stream_free(&s->run.re_match);
+  memset(&s->out_ring, 0, sizeof(s->out_ring));
+  memset(&s->in_ring, 0, sizeof(s->in_ring));
+
+  s->io_done = 1;
+  if (s->exited)
+    session_finish(s);
+}  /* session_end_io */
+
+
+/*
+ * Can s still make progress without waiting for an event?
+ */
+static int session_busy(const session *s) {
+  if (s->io_done) { return 0; }
+  return (s->master_ready && output_has_room(s)) ||
+         (s->in_ready && ring_used(&s->in_ring) < s->in_ring.size) ||
+         (s->master_writable && ring_used(&s->in_ring) > 0) ||
+         (s->run.stalled && ring_used(&s->in_ring) < s->in_ring.size);
+}  /* session_busy */
+
+
+/*
+ * When s next needs servicing with no event (absolute us), or -1.
+ * That's output held back for coalescing running out of budget, an
+ * exited child's output drain running out of grace, an expect timing
+ * out, and the next periodic snapshot.
+ */
+static long long session_deadline(const session *s) {
+  long long d = -1;
+
+  if (s->io_done) { return -1; }
+  if (s->out_writable && output_pending(s) && s->coalesce)
+    d = s->out_since + g_opt_coalesce_us;
+  if (s->exited && (d < 0 || s->drain_until < d))
+    d = s->drain_until;
+  if (s->run.armed && s->run.deadline >= 0 &&
+      (d < 0 || s->run.deadline < d))
+    d = s->run.deadline;
+  if (s->snap.due >= 0 && (d < 0 || s->snap.due < d))
+    d = s->snap.due;
+  return d;
+}  /* session_deadline */
+
+
+/*
+ * Timer callback: one of s's deadlines has come due.
+ */
+static void session_timeout(void *arg) {
+  session_wake((session *)arg);
+}  /* session_timeout */
+
+
+/*
+ * Keep s's timer on its next deadline.  Deadlines only move when s is
+ * serviced, so that's when this is called; it's O(1), where finding
+ * the earliest deadline by looking at every session was O(sessions)
+ * per loop pass.
+ */
+static void session_arm(session *s) {
+  long long d = session_deadline(s);
+
+  if (d < 0)
+    tw_cancel(&g_wheel, &s->timer);
+  else if (!tw_armed(&s->timer) || d != s->timer_due)
+    tw_arm(&g_wheel, &s->timer, d);
+  s->timer_due = d;
+}  /* session_arm */
+
+
+/*
+ * One pass over s: service one budget's worth of each ready source and
+ * flush each direction as far as its destination allows.  Each pass
+ * services one chunk per ready source, so a flood of child output
+ * can't starve keystrokes (or, supervised, other sessions).
+ */
+static void session_service(session *s, int epfd, long long now) {
+  int was_empty = !output_pending(s);
+
+  /* Child's pty produced output.  Take up to this pass's budget. */
+  if (s->master_ready && output_has_room(s)) {
+    size_t got = 0;
+    ssize_t n = 0;
+    int err;
+    while (got < s->out_sizer.size && output_has_room(s)) {
+      n = read_output(s, s->out_sizer.size - got);
+      if (n <= 0) break;
+      got += (size_t)n;
+    }
+    err = errno;  /* run_hooks() may change it */
+    sizer_update(&s->out_sizer, got);
+    if (s->n_hook_calls > 0)
+      run_hooks(s);
+    if (got > 0 && s->exited)
+      s->drain_until = now + EXIT_DRAIN_MS * 1000LL;
+    if (n < 0 && err == EAGAIN) {
+      s->master_ready = 0;
+      /* Master side hung up and is now drained. */
+      if (s->master_hup) {
+        session_end_io(s, epfd);
+        return;
+      }
+    } else if (n <= 0 && !(n < 0 && err == EINTR)) {
+      /* EOF or error on master -- child side closed. */
+      session_end_io(s, epfd);
+      return;
+    }
+  }
+
+  /* User typed something on stdin. */
+  if (s->in_ready && ring_used(&s->in_ring) < s->in_ring.size) {
+    size_t got = 0;
+    ssize_t n = 0;
+    while (got < s->in_sizer.size &&
+           ring_used(&s->in_ring) < s->in_ring.size) {
+      n = read_input(s, s->in_sizer.size - got);
+      if (n <= 0) break;
+      got += (size_t)n;
+    }
+    sizer_update(&s->in_sizer, got);
+    if (n > 0) {
+      /* Budget used up or ring full; more next pass. */
+    } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      if (errno == EAGAIN) s->in_ready = 0;
+    } else {
+      /*
+       * stdin EOF (e.g. pipe closed or user typed Ctrl-D at
+       * the outer level). We could close master to signal
+       * the child, but just stop reading stdin.
+       */
+      s->in_ready = 0;
+      if (s->in_open)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, s->in_fd, NULL);
+      s->in_open = 0;
+    }
+  }
+
+  if (s->run.sc != NULL)
+    script_check(s, now);
+  if (s->snap.due >= 0 && now >= s->snap.due) {
+    session_snapshot(s, "interval", 1);
+    while (s->snap.due <= now)
+      s->snap.due += g_opt_snapshot_every_us;
+  }
+
+  /* Flush each direction as far as its destination allows. */
+  if (was_empty && output_pending(s))
+    s->out_since = now;
+  if (s->out_writable && output_pending(s) &&
+      output_due(s, now, s->master_hup || s->exited))
+    s->out_writable = flush_output(s);
+  if (s->master_writable && ring_used(&s->in_ring) > 0)
+    s->master_writable = flush_input(s);
+
+  /* Child gone and its output has gone quiet. */
+  if (s->exited && now >= s->drain_until && !session_busy(s))
+    session_end_io(s, epfd);
+}  /* session_service */
+
+
+/*
+ * Main I/O loop: shuttle bytes between stdin<->master and master<->stdout
+ * for every session, using one edge-triggered epoll set.
+ *
+ *   stdin  --> in ring  -->  pty master  (user keystrokes -> child's tty input)
+ *   stdout <-- out ring <--  pty master  (child's tty output -> our display)
+ *
+ * Every fd is non-blocking and each direction has its own ring, so a
+ * slow stdout consumer never holds up keystrokes and a child that stops
+ * reading its tty never holds up output capture.  A source is only read
+ * while its ring has room, which is the back-pressure.
+ *
+ * With --coalesce, child output may sit in its ring for up to the
+ * latency budget (or until the byte threshold) so that many small
+ * writes from the child go out as one writev().
+ *
+ * Edge-triggered means an event only says "this fd became readable (or
+ * writable)", so each fd keeps a flag that stays set until a read or
+ * write hits EAGAIN.  Sessions whose flags say they can still make
+ * progress sit on a run queue, and each pass services every session on
+ * it once.  When nothing is ready the loop blocks in epoll_wait() until
+ * an event or the earliest session deadline.  Deadlines (held-back
+ * output, exit drain, expect timeouts) live on a timer wheel, one timer
+ * per session, so neither keeping them nor finding the next one costs
+ * more with more sessions.
+ *
+ * Child exit arrives as a readable pidfd, or as SIGCHLD on the signalfd
+ * for sessions without one.  SIGWINCH arrives on the signalfd too; a
+ * burst of resizes collapses into one window size copy after the
+ * wakeup's events have been read.  It only applies to the interactive
+ * session; supervised ones have no terminal to follow.
+ *
+ * Returns once every session has finished.
+ */
+static void io_loop(int sigfd) {
+  struct epoll_event ev, events[EV_MAX];
+  int epfd, i;
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) { perror("epoll_create1"); return; }  /* Handle error. */
+
+  tw_init(&g_wheel, now_us());
+  for (i = 0; i < g_n_live; i++) {
+    session_watch(g_live[i], epfd);
+    session_wake(g_live[i]);
+    tw_timer_init(&g_live[i]->timer, session_timeout, g_live[i]);
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events   = EPOLLIN;
+  ev.data.u64 = EV_TAG(EV_SIGNAL, 0);
+  epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+
+  while (g_n_live > 0) {
+    long long timeout_us = -1, next_due = -1, now = now_us();
+    session *s, *next;
+    int n_ev, winch = 0;
+
+    /* Service everything that's runnable; keep what still is. */
+    s = g_runq;
+    g_runq = NULL;
+    g_runq_tail = &g_runq;
+    for (; s != NULL; s = next) {
+      next = s->next_run;
+      s->queued = 0;
+      if (s->io_done) continue;
+      session_service(s, epfd, now);
+      session_arm(s);
+      if (session_busy(s))
+        session_wake(s);
+    }
+    if (g_n_live == 0) break;
+
+    /*
+     * Don't sleep while something can still make progress.  Otherwise
+     * sleep until the earliest deadline.
+     */
+    next_due = tw_next(&g_wheel);
+    if (g_runq != NULL)
+      timeout_us = 0;
+    else if (next_due >= 0)
+      timeout_us = (next_due > now) ? next_due - now : 0;
+
+    n_ev = wait_events(epfd, events, EV_MAX, timeout_us);
+    g_stats.polls++;
+
+    if (n_ev < 0) {
+      if (errno == EINTR)
+        continue;  /* Stopped and continued (SIGTSTP/SIGCONT). */
+      break;       /* Real error. */
+    }
+
+    /* Deadlines that came due wake their sessions. */
+    if (next_due >= 0)
+      tw_advance(&g_wheel, now_us());
+
+    for (i = 0; i < n_ev; i++) {
+      uint32_t e = events[i].events;
+      int kind = (int)(events[i].data.u64 & 0xff);
+
+      s = &g_sessions[events[i].data.u64 >> 8];
+      if (kind != EV_SIGNAL && s->finished) continue;
+
+      if (kind == EV_CHILD) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, s->pidfd, NULL);
+        reap_child(s);
+      } else if (kind == EV_SIGNAL) {
+        struct signalfd_siginfo si;
+        while (read(sigfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+          if (si.ssi_signo == SIGWINCH)
+            winch = 1;
+          else if (si.ssi_signo == SIGCHLD)
+            reap_any();
+        }
+      } else if (kind == EV_MASTER) {
+        if (e & EPOLLIN) s->master_ready = 1;
+        if (e & EPOLLOUT) s->master_writable = 1;
+        /* Master side hung up (child closed its slave fd or exited).
+         * Drain any remaining output first. */
+        if (e & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+          s->master_ready = 1;
+          s->master_hup = 1;
+        }
+        session_wake(s);
+      } else if (kind == EV_STDOUT) {
+        s->out_writable = 1;
+        /* A direct splice may have stalled on a full out_fd. */
+        if (s->relay_mode == RELAY_SPLICE) s->master_ready = 1;
+        session_wake(s);
+      } else if (s->in_open) {
+        /* Hangup still leaves buffered input; read() reports EOF. */
+        s->in_ready = 1;
+        session_wake(s);
+      }
+    }
+
+    /*
+     * When the outer terminal is resized, propagate the new size to
+     * the child's pty (once, however many SIGWINCHes arrived).
+     */
+    if (winch && g_opt_supervise == NULL && g_sessions[0].master_fd >= 0)
+      session_window_size(&g_sessions[0]);
+  }
+
+  close(epfd);
+}  /* io_loop */
+
+
+/* ----------------------------------------------------------------
+ * io_uring engine (--engine=uring).
+ *
+ * Both reads are buffer-select reads from one provided buffer ring,
+ * multishot where the kernel and fd allow it, so one SQE keeps
+ * delivering chunks until it runs out of buffers.  The buffer pool is
+ * also registered as a fixed buffer, so the writes that forward each
+ * chunk are WRITE_FIXED.  Each direction has one write chain in flight
+ * at a time; everything queued behind it goes out as the next chain of
+ * IOSQE_IO_LINK'ed SQEs, which keeps writes ordered and costs a single
+ * io_uring_enter() that also waits for the next completions.
+ *
+ * A read can't be linked to the write that forwards it (its length
+ * isn't known until it completes), so each chunk is one read CQE plus
+ * one write SQE, batched with everything else in the same enter.
+ * ----------------------------------------------------------------
+ */
+
+#define URING_ENTRIES  128
+#define URING_NBUFS    64          /* power of 2 */
+#define URING_BUF_SIZE (16 * 1024)
+#define URING_BGID     0
 
-/* For signal handler access. */
-static int g_master_fd = -1;
+/* user_data: low byte is the operation, the rest an index. */
+#define UD_MASTER_READ 1
+#define UD_STDIN_READ  2
+#define UD_OUT_WRITE   3
+#define UD_IN_WRITE    4
+#define UD_CHILD       5
+#define UD_SIGNAL      6
+#define UD_TIMEOUT     7
+#define UD(op, idx)    ((uint64_t)(op) | ((uint64_t)(idx) << 8))
 
+/* One buffer waiting to be (fully) written. */
+typedef struct {
+  uint16_t bid;
+  uint32_t off, len;
+} uring_wq_ent;
 
-static void sigchld_handler(int sig) {
-  (void)sig;
-  int status;
-  /* Reap the child (non-blocking). We only have one child. */
-  if (waitpid(-1, &status, WNOHANG) > 0) {
-    child_status = status;
-    child_exited = 1;
+/* Per-direction write queue; indexes are free-running. */
+typedef struct {
+  int fd;
+  int op;                          /* UD_OUT_WRITE or UD_IN_WRITE */
+  uring_wq_ent q[URING_NBUFS];
+  unsigned head, tail;             /* queued entries: [head, tail) */
+  unsigned inflight;               /* SQEs of the current chain */
+} uring_wq;
+
+/* A read source. */
+typedef struct {
+  int fd;
+  int op;                          /* UD_MASTER_READ or UD_STDIN_READ */
+  int multishot;
+  int armed;                       /* a read SQE is outstanding */
+  int open;                        /* not yet at EOF */
+  int starved;                     /* stopped by -ENOBUFS */
+} uring_reader;
+
+typedef struct {
+  uring ring;
+  uring_bufring bufs;
+  char *pool;
+} uring_engine;
+
+
+static char *uring_buf(uring_engine *u, unsigned bid) {
+  return u->pool + (size_t)bid * URING_BUF_SIZE;
+}  /* uring_buf */
+
+
+static void uring_recycle(uring_engine *u, unsigned bid) {
+  uring_bufring_add(&u->bufs, uring_buf(u, bid), URING_BUF_SIZE,
+                    (uint16_t)bid);
+}  /* uring_recycle */
+
+
+static void uring_arm_read(uring_engine *u, uring_reader *rd) {
+  struct io_uring_sqe *sqe;
+
+  if (rd->armed || !rd->open) { return; }
+  sqe = uring_get_sqe(&u->ring);
+  if (sqe == NULL) { return; }
+
+  sqe->opcode    = rd->multishot ? IORING_OP_READ_MULTISHOT : IORING_OP_READ;
+  sqe->fd        = rd->fd;
+  sqe->off       = rd->multishot ? 0 : (uint64_t)-1;  /* -1: file position */
+  sqe->len       = rd->multishot ? 0 : URING_BUF_SIZE;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = UD(rd->op, 0);
+  rd->armed = 1;
+  rd->starved = 0;
+}  /* uring_arm_read */
+
+
+static void uring_arm_poll(uring_engine *u, int fd, int op) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+  if (sqe == NULL) { return; }
+
+  sqe->opcode      = IORING_OP_POLL_ADD;
+  sqe->fd          = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data   = UD(op, 0);
+}  /* uring_arm_poll */
+
+
+static void uring_arm_timeout(uring_engine *u, struct __kernel_timespec *ts) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+  if (sqe == NULL) { return; }
+
+  sqe->opcode    = IORING_OP_TIMEOUT;
+  sqe->fd        = -1;
+  sqe->addr      = (uint64_t)(uintptr_t)ts;
+  sqe->len       = 1;
+  sqe->user_data = UD(UD_TIMEOUT, 0);
+}  /* uring_arm_timeout */
+
+
+/*
+ * If the previous chain for this direction is finished, send
+ * everything queued as one linked chain of fixed-buffer writes.  The
+ * whole chain has to be published by one submit (uring_get_sqe()
+ * submits when the SQ is full, and a chain split there would go out
+ * with its last link dangling), so SQ space is made first, and what
+ * doesn't fit waits for the next chain.
+ */
+static void uring_flush_wq(uring_engine *u, uring_wq *wq) {
+  unsigned i, n, space;
+
+  if (wq->inflight > 0 || wq->head == wq->tail) { return; }
+
+  n = wq->tail - wq->head;
+  space = uring_sq_space(&u->ring);
+  if (space < n) {
+    uring_submit_and_wait(&u->ring, 0);
+    space = uring_sq_space(&u->ring);
+  }
+  if (n > space) n = space;
+  for (i = 0; i < n; i++) {
+    unsigned idx = wq->head + i;
+    uring_wq_ent *e = &wq->q[idx % URING_NBUFS];
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+    if (sqe == NULL) break;
+
+    sqe->opcode    = IORING_OP_WRITE_FIXED;
+    sqe->fd        = wq->fd;
+    sqe->addr      = (uint64_t)(uintptr_t)(uring_buf(u, e->bid) + e->off);
+    sqe->len       = e->len - e->off;
+    sqe->off       = (uint64_t)-1;
+    sqe->buf_index = 0;
+    sqe->user_data = UD(wq->op, idx);
+    if (i + 1 < n)
+      sqe->flags = IOSQE_IO_LINK;
+    wq->inflight++;
   }
-}  /* sigchld_handler */
+}  /* uring_flush_wq */
 
 
 /*
- * Put the real terminal (if any) into raw mode so that:
- *   - Characters are passed through immediately (no line buffering)
- *   - Special keys (Ctrl-C, Ctrl-Z, etc.) aren't intercepted by the
- *     outer terminal driver -- they go straight to the child's pty
- *   - The child's terminal handles all line editing and echo
- *
- * Returns 0 on success, -1 if stdin isn't a terminal.
- * Saves original settings into *saved for later restoration.
+ * A write in wq's chain completed.  A short write fails the link, so
+ * the rest of the chain comes back -ECANCELED and is simply resent
+ * from where it left off on the next flush.  Returns how many buffers
+ * went back to the kernel.
  */
-static int set_raw_mode(struct termios *saved) {
-  struct termios raw;
+static int uring_write_done(uring_engine *u, uring_wq *wq, unsigned idx,
+                            int res) {
+  uring_wq_ent *e = &wq->q[idx % URING_NBUFS];
+  int recycled = 0;
 
-  if (tcgetattr(STDIN_FILENO, saved) < 0) { return -1; }  /* Handle error. */
+  g_stats.writes++;
+  wq->inflight--;
+  if (res > 0)
+    e->off += (uint32_t)res;
+  else if (res != -ECANCELED && res != -EAGAIN && res != -EINTR)
+    e->off = e->len;  /* Nowhere to report it; drop the rest. */
 
-  raw = *saved;
-  cfmakeraw(&raw);
+  /* Retire fully written buffers from the front of the queue. */
+  while (wq->head != wq->tail) {
+    uring_wq_ent *h = &wq->q[wq->head % URING_NBUFS];
+    if (h->off < h->len) break;
+    uring_recycle(u, h->bid);
+    wq->head++;
+    recycled++;
+  }
+  return recycled;
+}  /* uring_write_done */
 
-  /* Keep output processing so \n -> \r\n still works on our stdout. */
-  raw.c_oflag |= OPOST;
 
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) < 0) { return -1; }  /* Handle error. */
+/*
+ * A buffer went back to the kernel: a read that stopped for lack of
+ * one can go again.  Until then a starved reader stays unarmed, since
+ * re-arming it would only get -ENOBUFS straight back.
+ */
+static void uring_unstarve(uring_engine *u, uring_reader *rd) {
+  if (!rd->starved) { return; }
+  rd->starved = 0;
+  uring_arm_read(u, rd);
+}  /* uring_unstarve */
+
+
+static int uring_engine_init(uring_engine *u) {
+  unsigned i;
+
+  memset(u, 0, sizeof(*u));
+  if (uring_init(&u->ring, URING_ENTRIES) < 0) { return -1; }
+
+  if (!uring_op_supported(&u->ring, IORING_OP_READ) ||
+      !uring_op_supported(&u->ring, IORING_OP_WRITE_FIXED)) {
+    uring_exit(&u->ring);
+    return -1;
+  }
+
+  u->pool = (char *)mmap(NULL, (size_t)URING_NBUFS * URING_BUF_SIZE,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->pool == MAP_FAILED) {
+    uring_exit(&u->ring);
+    return -1;
+  }
+
+  if (uring_register_buffer(&u->ring, u->pool,
+                            (size_t)URING_NBUFS * URING_BUF_SIZE) < 0 ||
+      uring_bufring_init(&u->ring, &u->bufs, URING_BGID, URING_NBUFS) < 0) {
+    uring_exit(&u->ring);
+    munmap(u->pool, (size_t)URING_NBUFS * URING_BUF_SIZE);
+    return -1;
+  }
+
+  for (i = 0; i < URING_NBUFS; i++)
+    uring_recycle(u, i);
 
   return 0;
-}  /* set_raw_mode */
+}  /* uring_engine_init */
 
 
-static void restore_terminal(const struct termios *saved) {
-  tcsetattr(STDIN_FILENO, TCSAFLUSH, saved);
-}  /* restore_terminal */
+static void uring_engine_free(uring_engine *u) {
+  uring_bufring_free(&u->ring, &u->bufs);
+  uring_exit(&u->ring);
+  munmap(u->pool, (size_t)URING_NBUFS * URING_BUF_SIZE);
+}  /* uring_engine_free */
 
 
 /*
- * Propagate the real terminal's window size to the pty master
- * so the child sees the correct ROWS x COLS.
+ * Can an fd be read multishot?  The kernel needs to be able to poll it,
+ * which rules out regular files and the like.
  */
-static void copy_window_size(int master_fd) {
-  struct winsize ws;
-  if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0)
-    ioctl(master_fd, TIOCSWINSZ, &ws);
-}  /* copy_window_size */
+static int uring_pollable(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) { return 0; }
+  return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || isatty(fd);
+}  /* uring_pollable */
 
 
 /*
- * Handle SIGWINCH: when the outer terminal is resized, propagate
- * the new size to the child's pty.
+ * io_loop() equivalent on io_uring.  Same semantics: hangup on the
+ * master drains then exits, stdin EOF just stops reading stdin, and
+ * after the child exits its output gets EXIT_DRAIN_MS of grace.
  */
-static void sigwinch_handler(int sig) {
-  (void)sig;
-  if (g_master_fd >= 0)
-    copy_window_size(g_master_fd);
-}  /* sigwinch_handler */
+static void io_loop_uring(uring_engine *u, session *s, int sigfd) {
+  uring_reader master, in;
+  uring_wq out_wq, in_wq;
+  struct __kernel_timespec drain_ts;
+  int have_multishot = uring_op_supported(&u->ring, IORING_OP_READ_MULTISHOT);
+  int master_activity = 0, draining = 0, done = 0;
 
+  memset(&master, 0, sizeof(master));
+  master.fd = s->master_fd;
+  master.op = UD_MASTER_READ;
+  master.open = 1;
+  master.multishot = have_multishot;
 
-/*
- * Main I/O loop: shuttle bytes between stdin<->master and master<->stdout
- * using poll() for multiplexed, non-blocking I/O.
+  memset(&in, 0, sizeof(in));
+  in.fd = s->in_fd;
+  in.op = UD_STDIN_READ;
+  in.open = 1;
+  in.multishot = have_multishot && uring_pollable(s->in_fd);
+
+  memset(&out_wq, 0, sizeof(out_wq));
+  out_wq.fd = s->out_fd;
+  out_wq.op = UD_OUT_WRITE;
+
+  memset(&in_wq, 0, sizeof(in_wq));
+  in_wq.fd = s->master_fd;
+  in_wq.op = UD_IN_WRITE;
+
+  drain_ts.tv_sec  = 0;
+  drain_ts.tv_nsec = EXIT_DRAIN_MS * 1000000LL;
+
+  uring_arm_read(u, &master);
+  uring_arm_read(u, &in);
+  uring_arm_poll(u, s->pidfd >= 0 ? s->pidfd : sigfd,
+                 s->pidfd >= 0 ? UD_CHILD : UD_SIGNAL);
+  if (s->pidfd >= 0)
+    uring_arm_poll(u, sigfd, UD_SIGNAL);
+
+  while (!done || out_wq.head != out_wq.tail) {
+    struct io_uring_cqe *cqe;
+    int winch = 0;
+
+    uring_flush_wq(u, &out_wq);
+    uring_flush_wq(u, &in_wq);
+    if (uring_submit_and_wait(&u->ring, 1) < 0 && errno != EINTR)
+      break;
+    g_stats.polls++;
+
+    while ((cqe = uring_peek_cqe(&u->ring)) != NULL) {
+      int op = (int)(cqe->user_data & 0xff);
+      unsigned idx = (unsigned)(cqe->user_data >> 8);
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      uring_reader *rd = (op == UD_MASTER_READ) ? &master : &in;
+      uring_cqe_seen(&u->ring);
+
+      switch (op) {
+      case UD_MASTER_READ:
+      case UD_STDIN_READ:
+        if (!(flags & IORING_CQE_F_MORE))
+          rd->armed = 0;
+        if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+          uring_wq *wq = (op == UD_MASTER_READ) ? &out_wq : &in_wq;
+          uring_wq_ent *e = &wq->q[wq->tail++ % URING_NBUFS];
+          e->bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+          e->off = 0;
+          e->len = (uint32_t)res;
+          g_stats.reads++;
+          if (op == UD_MASTER_READ) {
+            run_stages(s, uring_buf(u, e->bid), (size_t)res);
+            g_stats.out_bytes += (unsigned long long)res;
+            master_activity = 1;
+          } else {
+            g_stats.in_bytes += (unsigned long long)res;
+          }
+        } else if (res == -ENOBUFS) {
+          rd->starved = 1;  /* Re-armed once a write frees a buffer. */
+        } else if (res == 0 || (res < 0 && res != -EAGAIN &&
+                                res != -EINTR && res != -ECANCELED)) {
+          /* EOF or error.  On the master, the child side closed. */
+          rd->open = 0;
+          if (op == UD_MASTER_READ) done = 1;
+        }
+        break;
+
+      case UD_OUT_WRITE:
+      case UD_IN_WRITE:
+        if (uring_write_done(u, (op == UD_OUT_WRITE) ? &out_wq : &in_wq,
+                             idx, res) > 0) {
+          if (!done)
+            uring_unstarve(u, &master);
+          uring_unstarve(u, &in);
+        }
+        break;
+
+      case UD_CHILD:
+        reap_child(s);
+        break;
+
+      case UD_SIGNAL: {
+        struct signalfd_siginfo si;
+        while (read(sigfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+          if (si.ssi_signo == SIGWINCH)
+            winch = 1;
+          else if (si.ssi_signo == SIGCHLD)
+            reap_child(s);
+        }
+        uring_arm_poll(u, sigfd, UD_SIGNAL);
+        break;
+      }
+
+      case UD_TIMEOUT:
+        /* Child gone; stop once its output has gone quiet. */
+        if (!master_activity)
+          done = 1;
+        else
+          uring_arm_timeout(u, &drain_ts);
+        master_activity = 0;
+        break;
+      }
+    }
+
+    if (s->exited && !draining) {
+      draining = 1;
+      master_activity = 0;
+      uring_arm_timeout(u, &drain_ts);
+    }
+
+    /* One-shot reads that completed go again.  Starved ones wait for
+     * a write to free a buffer (uring_unstarve()). */
+    if (!master.armed && !master.starved && !done)
+      uring_arm_read(u, &master);
+    if (!in.armed && !in.starved)
+      uring_arm_read(u, &in);
+
+    if (winch)
+      session_window_size(s);
+  }
+}  /* io_loop_uring */
+
+
+/* ----------------------------------------------------------------
+ * Threaded engine (--engine=threads).
  *
- *   stdin  ------>  pty master  (user keystrokes -> child's tty input)
- *   stdout <------  pty master  (child's tty output -> our display)
+ * Like minconpty, each direction gets its own thread:
+ *   input thread:  stdin -> pty master (keystrokes only)
+ *   output thread: pty master -> stdout, plus a copy of each chunk
+ *                  into an SPSC ring when output stages exist
+ *   stage thread:  drains that ring through the output stages
+ * The main thread watches the signalfd/pidfd and decides when to stop.
+ * Nothing a stage does (or how long it takes) can delay keystrokes,
+ * and a slow stage only slows output once its ring fills.  Each
+ * thread can be pinned to a CPU with --pin.
+ * ----------------------------------------------------------------
  */
-static void io_loop(int master_fd) {
-  char buf[BUF_SIZE];
-  struct pollfd fds[2];
 
-  /*
-   * fds[0] = pty master  (always poll for child output)
-   * fds[1] = stdin        (poll for user input)
-   */
-  fds[0].fd     = master_fd;
-  fds[0].events = POLLIN;
+#define STAGE_RING_SIZE (1024 * 1024)
 
-  fds[1].fd     = STDIN_FILENO;
-  fds[1].events = POLLIN;
+static spsc_ring g_stage_ring;    /* output thread -> stage thread */
+static int g_stop_efd = -1;       /* readable once threads should quit */
+static int g_main_efd = -1;       /* output thread -> main: master closed */
+static int g_stages_stop;         /* stage thread: drain and quit */
+static unsigned long g_out_activity;  /* bumped per chunk relayed */
+static session *g_tsess;          /* the session, for the threads */
 
-  while (!child_exited) {
-    int ret = poll(fds, 2, 100 /* ms, allows periodic child_exited check */);
 
-    if (ret < 0) {
-      if (errno == EINTR)
-        continue;  /* Interrupted by SIGCHLD or SIGWINCH. */
-      break;       /* Real error. */
+static void pin_self(int cpu) {
+  cpu_set_t set;
+
+  if (cpu < 0) { return; }
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}  /* pin_self */
+
+
+/*
+ * Wait for fd to be ready for 'events' or for the stop eventfd.
+ * Returns 1 if fd is ready, 0 if it's time to stop.
+ */
+static int wait_or_stop(int fd, short events) {
+  for (;;) {
+    struct pollfd pfd[2];
+    pfd[0].fd = fd;
+    pfd[0].events = events;
+    pfd[1].fd = g_stop_efd;
+    pfd[1].events = POLLIN;
+    if (poll(pfd, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      return 0;
     }
+    if (pfd[1].revents) { return 0; }
+    if (pfd[0].revents) { return 1; }
+  }
+}  /* wait_or_stop */
 
-    /* Child's pty produced output. */
-    if (fds[0].revents & POLLIN) {
-      ssize_t n = read(master_fd, buf, sizeof(buf));
-      if (n > 0) {
-        write(STDOUT_FILENO, buf, n);
-      } else if (n <= 0) {
-        break;  /* EOF or error on master -- child side closed. */
+
+static void *in_thread(void *arg) {
+  char buf[BUF_SIZE];
+  (void)arg;
+
+  pin_self(g_opt_cpu_in);
+  while (wait_or_stop(g_tsess->in_fd, POLLIN)) {
+    ssize_t n = read(g_tsess->in_fd, buf, sizeof(buf));
+    const char *p = buf;
+    STAT_ADD(g_stats.reads, 1);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+    if (n <= 0) break;  /* stdin EOF: just stop reading stdin. */
+    STAT_ADD(g_stats.in_bytes, n);
+
+    /* The master is non-blocking so a child that never reads can't
+     * wedge us past the stop signal. */
+    while (n > 0) {
+      ssize_t w = write(g_tsess->master_fd, p, (size_t)n);
+      STAT_ADD(g_stats.writes, 1);
+      if (w > 0) {
+        p += w;
+        n -= w;
+      } else if (w < 0 && errno == EAGAIN) {
+        if (!wait_or_stop(g_tsess->master_fd, POLLOUT)) { return NULL; }
+      } else if (!(w < 0 && errno == EINTR)) {
+        return NULL;
       }
     }
+  }
+  return NULL;
+}  /* in_thread */
 
-    /* Master side hung up (child closed its slave fd or exited). */
-    if (fds[0].revents & (POLLHUP | POLLERR)) {
-      /* Drain any remaining output first. */
-      for (;;) {
-        ssize_t n = read(master_fd, buf, sizeof(buf));
-        if (n <= 0) break;
-        write(STDOUT_FILENO, buf, n);
-      }
+
+static void *out_thread(void *arg) {
+  (void)arg;
+  char *buf = (char *)malloc(g_opt_max_read);
+  uint64_t one = 1;
+
+  pin_self(g_opt_cpu_out);
+  while (buf != NULL && wait_or_stop(g_tsess->master_fd, POLLIN)) {
+    ssize_t n = read(g_tsess->master_fd, buf, g_opt_max_read);
+    STAT_ADD(g_stats.reads, 1);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+    if (n <= 0) break;  /* EOF or error on master -- child side closed. */
+    STAT_ADD(g_stats.out_bytes, n);
+
+    write_all(g_tsess->out_fd, buf, (size_t)n);
+    if (g_tsess->n_stages > 0)
+      spsc_put_all(&g_stage_ring, buf, (size_t)n);
+    __atomic_add_fetch(&g_out_activity, 1, __ATOMIC_RELAXED);
+  }
+
+  free(buf);
+  if (write(g_main_efd, &one, sizeof(one)) < 0) { /* Nothing to do. */ }
+  return NULL;
+}  /* out_thread */
+
+
+static void *stage_thread(void *arg) {
+  (void)arg;
+
+  pin_self(g_opt_cpu_stage);
+  for (;;) {
+    size_t len;
+    const char *p = spsc_peek(&g_stage_ring, &len);
+    if (len > 0) {
+      run_stages(g_tsess, p, len);
+      spsc_consume(&g_stage_ring, len);
+      continue;
+    }
+    if (__atomic_load_n(&g_stages_stop, __ATOMIC_ACQUIRE)) break;
+    spsc_wait_data(&g_stage_ring, -1, -1);
+  }
+  return NULL;
+}  /* stage_thread */
+
+
+/*
+ * io_loop() equivalent with a thread per direction.  The calling
+ * thread handles signals and child exit: hangup on the master ends the
+ * output thread, and after the child exits its output gets
+ * EXIT_DRAIN_MS of grace, as in the other engines.
+ */
+static void io_loop_threads(session *s, int sigfd) {
+  pthread_t t_in, t_out, t_stage;
+  unsigned long last_activity = 0;
+  uint64_t one = 1;
+
+  g_tsess = s;
+  g_stop_efd = eventfd(0, EFD_CLOEXEC);
+  g_main_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (g_stop_efd < 0 || g_main_efd < 0 ||
+      spsc_init(&g_stage_ring, STAGE_RING_SIZE) < 0) {
+    perror("eventfd");
+    return;
+  }
+
+  pthread_create(&t_stage, NULL, stage_thread, NULL);
+  pthread_create(&t_out, NULL, out_thread, NULL);
+  pthread_create(&t_in, NULL, in_thread, NULL);
+
+  for (;;) {
+    struct pollfd pfd[3];
+    int n_fd = 0, ret;
+
+    pfd[n_fd].fd = g_main_efd;  pfd[n_fd++].events = POLLIN;
+    pfd[n_fd].fd = sigfd;       pfd[n_fd++].events = POLLIN;
+    if (s->pidfd >= 0 && !s->exited) {
+      pfd[n_fd].fd = s->pidfd;
+      pfd[n_fd++].events = POLLIN;
+    }
+
+    ret = poll(pfd, n_fd, s->exited ? EXIT_DRAIN_MS : -1);
+    g_stats.polls++;
+    if (ret < 0) {
+      if (errno == EINTR) continue;
       break;
     }
 
-    /* User typed something on stdin. */
-    if (fds[1].revents & POLLIN) {
-      ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
-      if (n > 0) {
-        write(master_fd, buf, n);
-      } else if (n <= 0) {
-        /*
-         * stdin EOF (e.g. pipe closed or user typed Ctrl-D at
-         * the outer level). We could close master to signal
-         * the child, but just stop reading stdin.
-         */
-        fds[1].fd = -1;  /* Tell poll() to skip this fd. */
-      }
+    if (ret == 0) {
+      /* Child gone; stop once its output has gone quiet. */
+      unsigned long a = __atomic_load_n(&g_out_activity, __ATOMIC_RELAXED);
+      if (a == last_activity) break;
+      last_activity = a;
+      continue;
     }
 
-    if (fds[1].revents & (POLLHUP | POLLERR)) {
-      fds[1].fd = -1;
+    if (pfd[0].revents) break;  /* Master closed and drained. */
+
+    if (pfd[1].revents) {
+      struct signalfd_siginfo si;
+      int winch = 0;
+      while (read(sigfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+        if (si.ssi_signo == SIGWINCH)
+          winch = 1;
+        else if (si.ssi_signo == SIGCHLD)
+          reap_child(s);
+      }
+      if (winch)
+        session_window_size(s);
     }
+
+    if (n_fd > 2 && pfd[2].revents)
+      reap_child(s);
+
+    if (s->exited)
+      last_activity = __atomic_load_n(&g_out_activity, __ATOMIC_RELAXED);
   }
-}  /* io_loop */
 
+  /* Stop the relay threads, then let the stage thread finish what the
+   * output thread handed it. */
+  if (write(g_stop_efd, &one, sizeof(one)) < 0) { /* Nothing to do. */ }
+  pthread_join(t_out, NULL);
+  pthread_join(t_in, NULL);
+  __atomic_store_n(&g_stages_stop, 1, __ATOMIC_RELEASE);
+  spsc_kick(&g_stage_ring);
+  pthread_join(t_stage, NULL);
 
-int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <command> [args...]\n", argv[0]);
-    fprintf(stderr, "\nRuns <command> inside a pseudo-TTY.\n");
-    fprintf(stderr, "The child thinks it's on a real terminal.\n");
-    return 1;
+  spsc_free(&g_stage_ring);
+  close(g_stop_efd);
+  close(g_main_efd);
+}  /* io_loop_threads */
+
+
+/*
+ * Report relay counters and our own CPU time on stderr.  The CPU
+ * figure is per GB relayed so runs of different sizes compare.
+ */
+static void print_stats(int relay_mode) {
+  struct rusage ru;
+  double cpu_ms, gb;
+
+  getrusage(RUSAGE_SELF, &ru);
+  cpu_ms = ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3 +
+           ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+  gb = (double)(g_stats.out_bytes + g_stats.in_bytes) / 1e9;
+
+  fprintf(stderr, "[minpty: stats: out %llu bytes, in %llu bytes, "
+          "%llu reads, %llu writes, %llu splices, %llu polls, "
+          "%llu syscalls]\n",
+          g_stats.out_bytes, g_stats.in_bytes, g_stats.reads,
+          g_stats.writes, g_stats.splices, g_stats.polls,
+          g_stats.reads + g_stats.writes + g_stats.splices + g_stats.polls);
+  fprintf(stderr, "[minpty: stats: cpu %.1f ms (%.1f ms/GB), "
+          "engine %s, relay %s]\n",
+          cpu_ms, gb > 0 ? cpu_ms / gb : 0.0,
+          g_engine == ENGINE_URING ? "uring" :
+          g_engine == ENGINE_THREADS ? "threads" : "epoll",
+          relay_mode == RELAY_COPY ? "copy" : "splice");
+
+  if (g_opt_screen) {
+    unsigned long long rows = 0, scrolls = 0;
+    int i;
+    for (i = 0; i < g_n_sessions; i++) {
+      const vts_screen *scr = g_sessions[i].screen;
+      if (scr == NULL) continue;
+      rows += scr->n_row_updates;
+      scrolls += scr->n_scrolls;
+    }
+    fprintf(stderr, "[minpty: stats: screen %llu row updates, "
+            "%llu scrolls]\n", rows, scrolls);
   }
+  if (g_opt_record != NULL)
+    fprintf(stderr, "[minpty: stats: record %llu events, %llu bytes "
+            "dropped]\n", g_rec.events, g_rec.dropped);
+  if (g_opt_transcript != NULL)
+    fprintf(stderr, "[minpty: stats: transcript %llu lines]\n",
+            g_transcript.lines);
+  if (g_n_hooks > 0)
+    fprintf(stderr, "[minpty: stats: hooks %llu run, %llu dropped]\n",
+            g_hooks_run, g_hooks_dropped);
+  if (g_opt_capture != NULL)
+    fprintf(stderr, "[minpty: stats: capture %llu bytes in, %llu out "
+            "(%.1fx), %llu dropped]\n", g_capture.in_bytes,
+            g_capture.out_bytes, g_capture.out_bytes > 0 ?
+            (double)g_capture.in_bytes / (double)g_capture.out_bytes : 0.0,
+            g_capture.dropped);
+}  /* print_stats */
 
-  /* Set up signal handlers. */
-  struct sigaction sa;
 
-  /* SIGCHLD: detect child exit. */
-  memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = sigchld_handler;
-  sa.sa_flags   = SA_RESTART;
-  sigaction(SIGCHLD, &sa, NULL);
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] <command> [args...]\n", prog);
+  fprintf(stderr, "       %s [options] --supervise=<list>\n", prog);
+  fprintf(stderr, "       %s [options] --replay=<recording>\n", prog);
+  fprintf(stderr, "       %s [--from=T] --to-asciicast=<recording>\n", prog);
+  fprintf(stderr, "       %s --decompress=<capture>\n", prog);
+  fprintf(stderr, "\nRuns <command> inside a pseudo-TTY.\n");
+  fprintf(stderr, "The child thinks it's on a real terminal.\n");
+  fprintf(stderr, "\nOptions:\n");
+  fprintf(stderr, "  --engine=E   I/O engine: epoll (default), uring or "
+          "threads\n");
+  fprintf(stderr, "  --capture=F  also write the raw output to file F, "
+          "compressed on a\n               separate thread\n");
+  fprintf(stderr, "  --coalesce=US[,BYTES]  hold output up to US microseconds "
+          "or BYTES\n               (default %d) before writing it; "
+          "not for a tty stdout\n", COALESCE_BYTES_DEFAULT);
+  fprintf(stderr, "  --compress=C codec for --capture: zstd or lz4 (if "
+          "built with them),\n               lz (built in) or none "
+          "(default %s)\n",
+          CZ_BEST == CZ_ZSTD ? "zstd" : CZ_BEST == CZ_LZ4 ? "lz4" : "lz");
+  fprintf(stderr, "  --decompress=F  write capture F to stdout "
+          "uncompressed\n");
+  fprintf(stderr, "  --from=T     with --replay or --to-asciicast, start "
+          "at T (seconds,\n               M:SS or H:MM:SS)\n");
+  fprintf(stderr, "  --max-read=N most bytes read from one source per pass "
+          "(default %d)\n", MAX_READ_DEFAULT);
+  fprintf(stderr, "  --answer     answer the child's terminal queries when "
+          "stdout isn't a\n               terminal (epoll engine; rules out "
+          "splice; on by default\n               with --screen, where the "
+          "cursor position is exact)\n");
+  fprintf(stderr, "  --no-answer  don't, even with --screen\n");
+  fprintf(stderr, "  --no-splice  always copy output through a buffer\n");
+  fprintf(stderr, "  --on=TEXT=CMD  run CMD with /bin/sh -c whenever TEXT "
+          "appears in\n               the output (repeatable)\n");
+  fprintf(stderr, "  --outdir=DIR supervised sessions log to "
+          "DIR/session-N.log (default .)\n");
+  fprintf(stderr, "  --pin=I,O[,S]  threads engine: pin the input, output "
+          "and stage\n               threads to these CPUs\n");
+  fprintf(stderr, "  --record=F   record the session with its timing to "
+          "file F\n               (epoll engine)\n");
+  fprintf(stderr, "  --record-format=F  asciicast (default) or binary "
+          "(smaller, indexed)\n");
+  fprintf(stderr, "  --record-input  record the child's input too\n");
+  fprintf(stderr, "  --replay=F   play binary recording F's output to stdout "
+          "(with --screen,\n               into a screen model)\n");
+  fprintf(stderr, "  --screen     keep a model of the child's screen "
+          "(what a terminal\n               would show); --stats reports "
+          "its activity\n");
+  fprintf(stderr, "  --script=F   drive the child with the send/expect/timeout "
+          "script F\n               instead of stdin\n");
+  fprintf(stderr, "  --size=CxR   window size when there's no terminal "
+          "to copy it from\n               (default %dx%d)\n",
+          DEFAULT_COLS, DEFAULT_ROWS);
+  fprintf(stderr, "  --snapshot=F write the screen as F (text or json) "
+          "instead of the raw\n               output, when the child is "
+          "done (epoll engine)\n");
+  fprintf(stderr, "  --snapshot-every=MS  also every MS milliseconds, "
+          "if it changed\n");
+  fprintf(stderr, "  --speed=N    --replay N times as fast as recorded, or "
+          "'max' (default 1)\n");
+  fprintf(stderr, "  --stats      print relay counters and CPU use at exit\n");
+  fprintf(stderr, "  --supervise=LIST  run each line of file LIST ('-' for "
+          "stdin) with\n               /bin/sh -c on its own pty, all in "
+          "one process (epoll engine)\n");
+  fprintf(stderr, "  --to-asciicast=F  convert binary recording F to "
+          "asciicast on stdout\n");
+  fprintf(stderr, "  --transcript=F  also write the output to file F as "
+          "plain text: escape\n               sequences removed, CR and "
+          "backspace rewrites applied\n");
+}  /* usage */
 
-  /* SIGWINCH: propagate terminal resize. */
-  sa.sa_handler = sigwinch_handler;
-  sigaction(SIGWINCH, &sa, NULL);
 
+/*
+ * Start s's child on a new pty: argv, or with argv NULL, s->cmd through
+ * /bin/sh -c.  ws (if not NULL) is the pty's window size.  The child
+ * gets child_mask as its signal mask.  Returns 0, or -1 if the fork
+ * failed.
+ */
+static int session_spawn(session *s, char **argv, const struct winsize *ws,
+                         const sigset_t *child_mask) {
   /*
    * forkpty() does the heavy lifting. In one call, it:
    *   1. Opens a pty master/slave pair (like openpty)
@@ -224,11 +3472,10 @@ int main(int argc, char *argv[]) {
    *      - Closes the master fd
    *   4. Returns the master fd to the parent
    */
-  int master_fd;
-  pid_t pid = forkpty(&master_fd, NULL, NULL, NULL);
+  pid_t pid = forkpty(&s->master_fd, NULL, NULL, ws);
   if (pid < 0) {
     perror("forkpty");
-    return 1;
+    return -1;
   }
 
   if (pid == 0) {
@@ -236,53 +3483,499 @@ int main(int argc, char *argv[]) {
      * Running with the pty slave as stdin/stdout/stderr.
      * As far as we know, we're on a real terminal.
      */
-    execvp(argv[1], &argv[1]);
-    perror("execvp");
+    sigprocmask(SIG_SETMASK, child_mask, NULL);
+    if (argv != NULL)
+      execvp(argv[0], argv);
+    else
+      execl("/bin/sh", "sh", "-c", s->cmd, (char *)NULL);
+    perror("exec");
     _exit(127);
   }
 
-  /* Parent process. */
-  g_master_fd = master_fd;
+  /* Parent process.  Later children mustn't inherit this master. */
+  s->pid = pid;
+  fcntl(s->master_fd, F_SETFD, FD_CLOEXEC);
+
+  /*
+   * Child exit detection.  A pidfd is readable as soon as the child
+   * exits, with no signal involved.  It works on a zombie too, so a
+   * child that has already exited is still caught.  Without pidfd
+   * support, fall back to SIGCHLD on the signalfd; it stays pending
+   * while blocked, so an early exit is still seen.
+   */
+  s->pidfd = open_pidfd(pid);
+  return 0;
+}  /* session_spawn */
+
+
+/*
+ * Read the --supervise list: one shell command per line, skipping
+ * blank lines and '#' comments.  Returns the count (commands in *cmds),
+ * or -1 if the list can't be read.
+ */
+static int read_command_list(const char *path, char ***cmds) {
+  FILE *fp = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  int n = 0, alloc = 0;
+
+  if (fp == NULL) { perror(path); return -1; }  /* Handle error. */
+
+  *cmds = NULL;
+  while ((len = getline(&line, &cap, fp)) >= 0) {
+    char *p = line;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == '\0' || *p == '#') continue;
+
+    if (n == alloc) {
+      alloc = alloc ? alloc * 2 : 64;
+      *cmds = (char **)realloc(*cmds, alloc * sizeof(char *));
+      if (*cmds == NULL) { perror("realloc"); exit(1); }  /* Handle error. */
+    }
+    (*cmds)[n++] = strdup(p);
+  }
+
+  free(line);
+  if (fp != stdin)
+    fclose(fp);
+  return n;
+}  /* read_command_list */
+
+
+/*
+ * Each supervised session holds a handful of fds (master, pidfd, log,
+ * splice pipe), so a long list needs more than the usual soft limit.
+ */
+static void raise_fd_limit(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}  /* raise_fd_limit */
+
+
+/*
+ * --supervise: run every command in the list on its own pty, each
+ * logging to its own file, all from one io_loop().  A line
+ * "N<TAB>exit code<TAB>command" goes to stdout as each one finishes.
+ * Returns 0 if every command exited 0, else 1.
+ */
+static int supervise(sigset_t *sig_mask, const sigset_t *old_mask) {
+  struct winsize ws;
+  char **cmds;
+  int n, i, failed = 0, need_sigchld = 0, sigfd;
+
+  n = read_command_list(g_opt_supervise, &cmds);
+  if (n < 0) { return 1; }  /* Handle error. */
+
+  raise_fd_limit();
+  g_sessions = (session *)calloc(n > 0 ? n : 1, sizeof(session));
+  g_live = (session **)calloc(n > 0 ? n : 1, sizeof(session *));
+  if (g_sessions == NULL || g_live == NULL) { perror("calloc"); return 1; }  /* Handle error. */
+  g_n_sessions = n;
+
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_row = (unsigned short)g_opt_rows;
+  ws.ws_col = (unsigned short)g_opt_cols;
+
+  for (i = 0; i < n; i++) {
+    session *s = &g_sessions[i];
+    char path[4096];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/session-%d.log", g_opt_outdir, i + 1);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    session_init(s, i + 1, -1, fd);
+    s->cmd = cmds[i];
+
+    if (fd < 0 || session_spawn(s, NULL, &ws, old_mask) < 0 ||
+        session_screen_init(s, &ws) < 0 || session_relay_init(s) < 0) {
+      if (fd < 0) perror(path);
+      s->status = 127 << 8;  /* as the shell reports "can't run it" */
+      s->exited = s->io_done = 1;
+      if (s->master_fd >= 0) close(s->master_fd);
+      if (fd >= 0) close(fd);
+      session_finish(s);
+      failed = 1;
+      continue;
+    }
+    if (s->pidfd < 0) need_sigchld = 1;
+    g_live[g_n_live++] = s;
+  }
+
+  if (!need_sigchld && g_n_hooks == 0)
+    sigdelset(sig_mask, SIGCHLD);
+  sigfd = signalfd(-1, sig_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigfd < 0) {
+    perror("signalfd");
+    return 1;
+  }
+
+  io_loop(sigfd);
+  close(sigfd);
+
+  for (i = 0; i < n; i++) {
+    session *s = &g_sessions[i];
+    if (s->out_fd >= 0)
+      close(s->out_fd);
+    if (session_result(s) != 0)
+      failed = 1;
+  }
+
+  if (g_opt_stats)
+    print_stats(n > 0 ? g_sessions[0].relay_mode : RELAY_COPY);
+
+  return failed;
+}  /* supervise */
+
+
+int main(int argc, char *argv[]) {
+  static const struct option long_opts[] = {
+    { "capture",   required_argument, NULL, 'K' },
+    { "coalesce",  required_argument, NULL, 'C' },
+    { "compress",  required_argument, NULL, 'Z' },
+    { "decompress", required_argument, NULL, 'U' },
+    { "engine",    required_argument, NULL, 'E' },
+    { "max-read",  required_argument, NULL, 'M' },
+    { "answer",    no_argument, NULL, 'Q' },
+    { "no-answer", no_argument, NULL, 'A' },
+    { "no-splice", no_argument, NULL, 'S' },
+    { "on",        required_argument, NULL, 'H' },
+    { "outdir",    required_argument, NULL, 'O' },
+    { "pin",       required_argument, NULL, 'P' },
+    { "record",    required_argument, NULL, 'R' },
+    { "record-input", no_argument, NULL, 'I' },
+    { "record-format", required_argument, NULL, 'F' },
+    { "to-asciicast", required_argument, NULL, 'J' },
+    { "from",      required_argument, NULL, 'B' },
+    { "replay",    required_argument, NULL, 'Y' },
+    { "speed",     required_argument, NULL, 'D' },
+    { "screen",    no_argument, NULL, 'V' },
+    { "script",    required_argument, NULL, 'X' },
+    { "size",      required_argument, NULL, 'W' },
+    { "snapshot",  required_argument, NULL, 'N' },
+    { "snapshot-every", required_argument, NULL, 'T' },
+    { "stats",     no_argument, NULL, 's' },
+    { "supervise", required_argument, NULL, 'L' },
+    { "transcript", required_argument, NULL, 'G' },
+    { "help",      no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  int opt;
+
+  /* Leading "+" stops at the command so its own options are left alone. */
+  while ((opt = getopt_long(argc, argv, "+h", long_opts, NULL)) != -1) {
+    switch (opt) {
+    case 'E':
+      if (strcmp(optarg, "epoll") == 0) {
+        g_opt_engine = ENGINE_EPOLL;
+      } else if (strcmp(optarg, "uring") == 0) {
+        g_opt_engine = ENGINE_URING;
+      } else if (strcmp(optarg, "threads") == 0) {
+        g_opt_engine = ENGINE_THREADS;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'C': {
+      char *end;
+      g_opt_coalesce_us = strtoll(optarg, &end, 0);
+      if (*end == ',')
+        g_opt_coalesce_bytes = (size_t)strtoul(end + 1, NULL, 0);
+      if (g_opt_coalesce_us < 0) g_opt_coalesce_us = 0;
+      break;
+    }
+    case 'M':
+      g_opt_max_read = (size_t)strtoul(optarg, NULL, 0);
+      if (g_opt_max_read < BUF_SIZE) g_opt_max_read = BUF_SIZE;
+      break;
+    case 'H':
+      if (hook_add(optarg) < 0) {
+        fprintf(stderr, "bad --on=%s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'O': g_opt_outdir = optarg; break;
+    case 'P':
+      if (sscanf(optarg, "%d,%d,%d", &g_opt_cpu_in, &g_opt_cpu_out,
+                 &g_opt_cpu_stage) < 2) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'L': g_opt_supervise = optarg; break;
+    case 'R': g_opt_record = optarg; break;
+    case 'G': g_opt_transcript = optarg; break;
+    case 'K': g_opt_capture = optarg; break;
+    case 'Z':
+      g_opt_compress = cz_codec(optarg);
+      if (g_opt_compress < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'U': g_opt_decompress = optarg; break;
+    case 'I': g_opt_record_input = 1; break;
+    case 'F':
+      if (strcmp(optarg, "asciicast") == 0) {
+        g_opt_record_format = REC_ASCIICAST;
+      } else if (strcmp(optarg, "binary") == 0) {
+        g_opt_record_format = REC_BINARY;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'J': g_opt_to_asciicast = optarg; break;
+    case 'Y': g_opt_replay = optarg; break;
+    case 'D':
+      if (strcmp(optarg, "max") == 0) {
+        g_opt_speed = 0;
+      } else {
+        g_opt_speed = strtod(optarg, NULL);
+        if (g_opt_speed <= 0) {
+          usage(argv[0]);
+          return 1;
+        }
+      }
+      break;
+    case 'B':
+      g_opt_from_us = parse_time(optarg);
+      if (g_opt_from_us < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'X':
+      g_script = script_load(optarg);
+      if (g_script == NULL) { return 1; }
+      break;
+    case 'W':
+      if (sscanf(optarg, "%dx%d", &g_opt_cols, &g_opt_rows) != 2 ||
+          g_opt_cols < 1 || g_opt_rows < 1 ||
+          g_opt_cols > 0xFFFF || g_opt_rows > 0xFFFF) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'V': g_opt_screen = 1; break;
+    case 'N':
+      if (strcmp(optarg, "text") == 0) {
+        g_opt_snapshot = SNAP_TEXT;
+      } else if (strcmp(optarg, "json") == 0) {
+        g_opt_snapshot = SNAP_JSON;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      g_opt_screen = 1;
+      break;
+    case 'T':
+      g_opt_snapshot_every_us = strtoll(optarg, NULL, 0) * 1000;
+      break;
+    case 'Q': g_opt_answer = 1; break;
+    case 'A': g_opt_answer = 0; break;
+    case 'S': g_opt_splice = 0; break;
+    case 's': g_opt_stats = 1; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (g_opt_to_asciicast != NULL)
+    return to_asciicast(g_opt_to_asciicast);
+  if (g_opt_replay != NULL)
+    return replay(g_opt_replay);
+  if (g_opt_decompress != NULL)
+    return decompress(g_opt_decompress);
+  if ((g_opt_supervise == NULL) == (optind >= argc) ||
+      (g_opt_supervise != NULL &&
+       (g_opt_record != NULL || g_opt_transcript != NULL ||
+        g_opt_capture != NULL))) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (g_n_hooks > 0 && ac_build(&g_hooks) < 0) {
+    perror("ac_build");
+    return 1;
+  }
+  if (g_n_hooks > 0 && hook_env_init() < 0) {
+    perror("malloc");
+    return 1;
+  }
+  char **cmd_argv = &argv[optind];
+
+  /*
+   * Block the signals we care about; they're read from a signalfd in
+   * io_loop() instead of interrupting it.  Blocking before the fork
+   * means none can be lost in between.  The child gets the original
+   * mask back before exec.
+   */
+  sigset_t sig_mask, old_mask;
+  sigemptyset(&sig_mask);
+  sigaddset(&sig_mask, SIGCHLD);   /* detect child exit (no pidfd) */
+  sigaddset(&sig_mask, SIGWINCH);  /* propagate terminal resize */
+  sigprocmask(SIG_BLOCK, &sig_mask, &old_mask);
+  g_child_mask = old_mask;
+  g_start_us = now_us();
+
+  if (g_opt_supervise != NULL)
+    return supervise(&sig_mask, &old_mask);
+
+  /* One interactive session on our stdin/stdout. */
+  static session sess;
+  static session *live;
+  session *s = &sess;
+  session_init(s, 1, STDIN_FILENO, STDOUT_FILENO);
+  g_sessions = s;
+  g_n_sessions = 1;
+  live = s;
+  g_live = &live;
+  g_n_live = 1;
+
+  if (session_spawn(s, cmd_argv, NULL, &old_mask) < 0) { return 1; }  /* Handle error. */
+
+  if (s->pidfd >= 0 && g_n_hooks == 0)
+    sigdelset(&sig_mask, SIGCHLD);
+
+  int sigfd = signalfd(-1, &sig_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigfd < 0) {
+    perror("signalfd");
+    return 1;
+  }
 
   /* Copy the real terminal's size to the child's pty. */
-  copy_window_size(master_fd);
+  struct winsize ws;
+  copy_window_size(s->master_fd, &ws);
+  if (session_screen_init(s, &ws) < 0) {
+    perror("malloc");
+    return 1;
+  }
+  if (g_opt_record != NULL) {
+    if (record_open(cmd_argv, &ws) < 0) {
+      perror(g_opt_record);
+      return 1;
+    }
+    add_stage(s, record_feed, NULL);
+  }
+  if (g_opt_transcript != NULL) {
+    if (transcript_open() < 0) {
+      perror(g_opt_transcript);
+      return 1;
+    }
+    add_stage(s, transcript_feed, NULL);
+  }
+  if (g_opt_capture != NULL) {
+    if (cz_open(&g_capture, g_opt_capture, g_opt_compress) < 0) {
+      perror(g_opt_capture);
+      return 1;
+    }
+    add_stage(s, capture_feed, NULL);
+  }
 
   /*
    * Put the real terminal into raw mode. Without it:
    *   - Keystrokes are line-buffered (must press Enter)
    *   - Ctrl-C kills us instead of reaching the child
    *   - Arrow keys, tab completion, etc. don't work
+   * A script replaces the keyboard, so then it's left alone.
    */
   struct termios saved_termios;
-  int is_tty = (set_raw_mode(&saved_termios) == 0);
+  int is_tty = (g_script == NULL && set_raw_mode(&saved_termios) == 0);
+
+  /*
+   * The uring engine is used when asked for and the kernel has what
+   * it needs (provided buffer rings, 5.19+); otherwise epoll.  Scripts,
+   * snapshots, recording, hooks and query answers run in the epoll loop
+   * only, so asking for another engine with one of them says so.
+   */
+  uring_engine ue;
+  int epoll_only = (g_script != NULL || g_opt_snapshot ||
+                    g_opt_record != NULL || g_n_hooks > 0 ||
+                    answer_wanted(STDOUT_FILENO));
+  if (g_opt_engine != ENGINE_EPOLL && epoll_only)
+    fprintf(stderr, "[minpty: using the epoll engine; only it runs "
+            "scripts, snapshots, recording, hooks and query answers]\n");
+  if (g_opt_engine == ENGINE_URING && !epoll_only &&
+      uring_engine_init(&ue) == 0)
+    g_engine = ENGINE_URING;
+
+  if (g_opt_engine == ENGINE_THREADS && !epoll_only)
+    g_engine = ENGINE_THREADS;
 
-  io_loop(master_fd);
+  if (g_engine == ENGINE_URING) {
+    /* io_uring waits internally; fds stay blocking. */
+    io_loop_uring(&ue, s, sigfd);
+    uring_engine_free(&ue);
+  } else if (g_engine == ENGINE_THREADS) {
+    /* Only the master is non-blocking; see in_thread(). */
+    set_nonblock(s->master_fd);
+    io_loop_threads(s, sigfd);
+  } else {
+    if (session_relay_init(s) < 0) {
+      perror("malloc");
+      return 1;
+    }
+
+    /*
+     * The edge-triggered loop needs reads and writes that stop at
+     * EAGAIN.  stdin and stdout are usually shared with our parent,
+     * so their flags get put back afterward.
+     */
+    int stdin_flags  = set_nonblock(STDIN_FILENO);
+    int stdout_flags = set_nonblock(STDOUT_FILENO);
+
+    io_loop(sigfd);
+
+    if (stdout_flags >= 0)
+      fcntl(STDOUT_FILENO, F_SETFL, stdout_flags);
+    if (stdin_flags >= 0)
+      fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+  }
 
   /* Restore the terminal before printing exit message. */
   if (is_tty)
     restore_terminal(&saved_termios);
 
-  close(master_fd);
+  if (s->master_fd >= 0)
+    close(s->master_fd);
+  if (s->pidfd >= 0)
+    close(s->pidfd);
+  close(sigfd);
+  if (g_opt_record != NULL)
+    record_close();
+  if (g_opt_transcript != NULL)
+    transcript_close();
+  if (g_opt_capture != NULL)
+    capture_close();
 
   /* Make sure we've reaped the child. */
-  if (!child_exited) {
+  if (!s->exited) {
     int status;
-    waitpid(pid, &status, 0);
-    child_status = status;
-    child_exited = 1;
+    waitpid(s->pid, &status, 0);
+    s->status = status;
+    s->exited = 1;
   }
 
+  if (g_opt_stats)
+    print_stats(s->relay_mode);
+
   /* Report how the child exited. */
-  if (WIFEXITED(child_status)) {
-    int code = WEXITSTATUS(child_status);
+  if (WIFEXITED(s->status)) {
+    int code = WEXITSTATUS(s->status);
     fprintf(stderr, "\n[minpty: child exited with status %d]\n", code);
-    return code;
-  } else if (WIFSIGNALED(child_status)) {
-    int sig = WTERMSIG(child_status);
+  } else if (WIFSIGNALED(s->status)) {
+    int sig = WTERMSIG(s->status);
     fprintf(stderr, "\n[minpty: child killed by signal %d (%s)]\n",
             sig, strsignal(sig));
-    return 128 + sig;
   }
 
-  return 0;
+  return session_result(s);
 }  /* main */
@@ -0,0 +1,899 @@
+/* re.c - Streaming regular expression matcher (lazy DFA).
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* The pattern is parsed into a small tree, which is then emitted as a
+ * Thompson NFA (byte set, split, jump, anchors, match).  Bytes that
+ * every set treats alike share an equivalence class, so a DFA state's
+ * row has one entry per class rather than 256.
+ *
+ * A DFA state is the set of NFA instructions that consume a byte (or
+ * match) reachable at a position, kept sorted so equal sets are found
+ * by hashing.  Since this is a search rather than an anchored match,
+ * every transition also adds the start of the pattern.  The anchors
+ * are resolved as sets are built: ^ is followed only when the byte
+ * just consumed was a newline (or at the very start), and $ stays in
+ * the set so the state's F_EOL flag can say whether a CR, LF or the end
+ * of the chunk would complete a match there.
+ *
+ * The cache grows until its budget is spent, then is emptied and
+ * starts again; the state being left is rebuilt from its set.  Streams
+ * notice the emptying by generation number and rebuild theirs the
+ * same way.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "re.h"
+
+#define RI_CLASS 0   /* consume a byte in cls[x] */
+#define RI_SPLIT 1   /* go to x and y */
+#define RI_JMP   2   /* go to x */
+#define RI_BOL   3
+#define RI_EOL   4
+#define RI_MATCH 5
+
+#define F_MATCH 0x01   /* contains RI_MATCH */
+#define F_EOL   0x02   /* a match if the line (or output) ends here */
+
+#define REP_MAX 255    /* largest {m,n} count */
+
+/* Parse tree. */
+#define N_EMPTY 0
+#define N_CLASS 1
+#define N_CAT   2
+#define N_ALT   3
+#define N_REP   4   /* a repeated min..max (max -1: unbounded) times */
+#define N_BOL   5
+#define N_EOL   6
+
+typedef struct {
+  int type;
+  int a, b;         /* children; N_CLASS: a is the class */
+  int min, max;     /* N_REP */
+} re_node;
+
+typedef struct {
+  re_prog *re;
+  const char *p, *end;
+  re_node *nodes;
+  int n_nodes, alloc_nodes;
+  int depth;
+} re_parser;
+
+
+static int parse_alt(re_parser *ps);
+
+
+/* ----------------------------------------------------------------
+ * Parsing.
+ * ----------------------------------------------------------------
+ */
+
+static int new_node(re_parser *ps, int type, int a, int b) {
+  if (ps->n_nodes == ps->alloc_nodes) {
+    int n = ps->alloc_nodes ? ps->alloc_nodes * 2 : 32;
+    re_node *nodes = (re_node *)realloc(ps->nodes, n * sizeof(re_node));
+    if (nodes == NULL) { ps->re->err = "out of memory"; return -1; }
+    ps->nodes = nodes;
+    ps->alloc_nodes = n;
+  }
+  ps->nodes[ps->n_nodes].type = type;
+  ps->nodes[ps->n_nodes].a = a;
+  ps->nodes[ps->n_nodes].b = b;
+  ps->nodes[ps->n_nodes].min = ps->nodes[ps->n_nodes].max = 0;
+  return ps->n_nodes++;
+}  /* new_node */
+
+
+static int new_class(re_prog *re) {
+  uint8_t (*cls)[32] = (uint8_t (*)[32])realloc(re->cls,
+                                                (re->n_cls + 1) * 32);
+  if (cls == NULL) { re->err = "out of memory"; return -1; }
+  re->cls = cls;
+  memset(re->cls[re->n_cls], 0, 32);
+  return re->n_cls++;
+}  /* new_class */
+
+
+static void class_set(uint8_t *bits, int c) {
+  bits[c >> 3] |= (uint8_t)(1 << (c & 7));
+}  /* class_set */
+
+
+static int class_has(const uint8_t *bits, int c) {
+  return (bits[c >> 3] >> (c & 7)) & 1;
+}  /* class_has */
+
+
+static int hex_val(int c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}  /* hex_val */
+
+
+/*
+ * After a backslash: add what the escape stands for to bits.  Returns
+ * the byte for a single-byte escape (so it can start a range), or -1
+ * for a class like \d.
+ */
+static int parse_escape(re_parser *ps, uint8_t *bits) {
+  int c, i, v;
+  uint8_t tmp[32];
+  int negate = 0;
+
+  if (ps->p == ps->end) { ps->re->err = "trailing backslash"; return -2; }
+  c = (unsigned char)*ps->p++;
+  switch (c) {
+  case 'n': c = '\n'; break;
+  case 'r': c = '\r'; break;
+  case 't': c = '\t'; break;
+  case 'e': c = 0x1B; break;
+  case 'x':
+    for (v = 0, i = 0; i < 2 && ps->p < ps->end && hex_val(*ps->p) >= 0; i++)
+      v = v * 16 + hex_val(*ps->p++);
+    c = v;
+    break;
+  case 'D': negate = 1;  /* fall through */
+  case 'd':
+    memset(tmp, 0, sizeof(tmp));
+    for (i = '0'; i <= '9'; i++) class_set(tmp, i);
+    goto set;
+  case 'S': negate = 1;  /* fall through */
+  case 's':
+    memset(tmp, 0, sizeof(tmp));
+    for (i = 0; i < 6; i++) class_set(tmp, " \t\n\r\f\v"[i]);
+    goto set;
+  case 'W': negate = 1;  /* fall through */
+  case 'w':
+    memset(tmp, 0, sizeof(tmp));
+    for (i = 0; i < 256; i++)
+      if ((i >= '0' && i <= '9') || (i >= 'a' && i <= 'z') ||
+          (i >= 'A' && i <= 'Z') || i == '_')
+        class_set(tmp, i);
+    goto set;
+  default:
+    break;
+  }
+  class_set(bits, c);
+  return c;
+
+set:
+  for (i = 0; i < 32; i++)
+    bits[i] |= negate ? (uint8_t)~tmp[i] : tmp[i];
+  return -1;
+}  /* parse_escape */
+
+
+/*
+ * After '[': a bracket expression, up to and including ']'.
+ */
+static int parse_bracket(re_parser *ps) {
+  int k = new_class(ps->re);
+  uint8_t bits[32];
+  int negate = 0, first = 1, i;
+
+  if (k < 0) { return -1; }
+  memset(bits, 0, sizeof(bits));
+  if (ps->p < ps->end && *ps->p == '^') {
+    negate = 1;
+    ps->p++;
+  }
+  for (;;) {
+    int lo, hi;
+
+    if (ps->p == ps->end) { ps->re->err = "missing ]"; return -1; }
+    if (*ps->p == ']' && !first) {
+      ps->p++;
+      break;
+    }
+    first = 0;
+    lo = (unsigned char)*ps->p++;
+    if (lo == '\\') {
+      lo = parse_escape(ps, bits);
+      if (lo == -2) { return -1; }
+      if (lo < 0) continue;  /* \d and friends don't start ranges */
+    }
+    class_set(bits, lo);
+    if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+      ps->p++;
+      hi = (unsigned char)*ps->p++;
+      if (hi == '\\') {
+        uint8_t junk[32];
+        memset(junk, 0, sizeof(junk));
+        hi = parse_escape(ps, junk);
+        if (hi < 0) { ps->re->err = "bad range"; return -1; }
+      }
+      if (hi < lo) { ps->re->err = "bad range"; return -1; }
+      for (i = lo; i <= hi; i++) class_set(bits, i);
+    }
+  }
+  for (i = 0; i < 32; i++)
+    ps->re->cls[k][i] = negate ? (uint8_t)~bits[i] : bits[i];
+  return new_node(ps, N_CLASS, k, 0);
+}  /* parse_bracket */
+
+
+static int parse_atom(re_parser *ps) {
+  int c = (unsigned char)*ps->p++;
+  int k, n;
+
+  switch (c) {
+  case '(':
+    if (ps->end - ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':')
+      ps->p += 2;
+    if (++ps->depth > 100) { ps->re->err = "nested too deep"; return -1; }
+    n = parse_alt(ps);
+    ps->depth--;
+    if (n < 0) { return -1; }
+    if (ps->p == ps->end || *ps->p != ')') {
+      ps->re->err = "missing )";
+      return -1;
+    }
+    ps->p++;
+    return n;
+  case '[':
+    return parse_bracket(ps);
+  case '^':
+    return new_node(ps, N_BOL, 0, 0);
+  case '$':
+    return new_node(ps, N_EOL, 0, 0);
+  case '*': case '+': case '?': case '{':
+    ps->re->err = "nothing to repeat";
+    return -1;
+  default:
+    break;
+  }
+
+  k = new_class(ps->re);
+  if (k < 0) { return -1; }
+  if (c == '.') {
+    memset(ps->re->cls[k], 0xff, 32);
+    ps->re->cls[k]['\n' >> 3] &= (uint8_t)~(1 << ('\n' & 7));
+  } else if (c == '\\') {
+    if (parse_escape(ps, ps->re->cls[k]) == -2) { return -1; }
+  } else {
+    class_set(ps->re->cls[k], c);
+  }
+  return new_node(ps, N_CLASS, k, 0);
+}  /* parse_atom */
+
+
+/*
+ * After '{': m}, m,} or m,n}.  Returns 0, or -1 if it isn't one.
+ */
+static int parse_count(re_parser *ps, int *min, int *max) {
+  const char *p = ps->p;
+  int v = 0, digits = 0;
+
+  while (p < ps->end && *p >= '0' && *p <= '9' && v <= REP_MAX) {
+    v = v * 10 + (*p++ - '0');
+    digits++;
+  }
+  if (digits == 0) { return -1; }
+  *min = *max = v;
+  if (p < ps->end && *p == ',') {
+    p++;
+    *max = -1;
+    if (p < ps->end && *p >= '0' && *p <= '9') {
+      v = 0;
+      while (p < ps->end && *p >= '0' && *p <= '9' && v <= REP_MAX)
+        v = v * 10 + (*p++ - '0');
+      *max = v;
+    }
+  }
+  if (p == ps->end || *p != '}') { return -1; }
+  ps->p = p + 1;
+  return 0;
+}  /* parse_count */
+
+
+static int parse_repeat(re_parser *ps) {
+  int n = parse_atom(ps);
+
+  while (n >= 0 && ps->p < ps->end) {
+    int c = *ps->p, min, max, r;
+
+    if (c == '*') { min = 0; max = -1; }
+    else if (c == '+') { min = 1; max = -1; }
+    else if (c == '?') { min = 0; max = 1; }
+    else if (c != '{') break;
+    ps->p++;
+    if (c == '{') {
+      if (parse_count(ps, &min, &max) < 0) {
+        ps->re->err = "bad {count}";
+        return -1;
+      }
+      if (min > REP_MAX || max > REP_MAX || (max >= 0 && max < min)) {
+        ps->re->err = "bad {count}";
+        return -1;
+      }
+    }
+    if (ps->p < ps->end && *ps->p == '?') ps->p++;  /* lazy: same here */
+    r = new_node(ps, N_REP, n, 0);
+    if (r < 0) { return -1; }
+    ps->nodes[r].min = min;
+    ps->nodes[r].max = max;
+    n = r;
+  }
+  return n;
+}  /* parse_repeat */
+
+
+static int parse_cat(re_parser *ps) {
+  int n = -1;
+
+  while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+    int m = parse_repeat(ps);
+    if (m < 0) { return -1; }
+    n = (n < 0) ? m : new_node(ps, N_CAT, n, m);
+    if (n < 0) { return -1; }
+  }
+  return (n < 0) ? new_node(ps, N_EMPTY, 0, 0) : n;
+}  /* parse_cat */
+
+
+static int parse_alt(re_parser *ps) {
+  int n = parse_cat(ps);
+
+  while (n >= 0 && ps->p < ps->end && *ps->p == '|') {
+    int m;
+    ps->p++;
+    m = parse_cat(ps);
+    if (m < 0) { return -1; }
+    n = new_node(ps, N_ALT, n, m);
+  }
+  return n;
+}  /* parse_alt */
+
+
+/* ----------------------------------------------------------------
+ * NFA.
+ * ----------------------------------------------------------------
+ */
+
+static int emit(re_prog *re, int op, int x, int y) {
+  /* Capacity is 16, then each power of two. */
+  if (re->n_inst == 0 ||
+      (re->n_inst >= 16 && (re->n_inst & (re->n_inst - 1)) == 0)) {
+    int n = re->n_inst ? re->n_inst * 2 : 16;
+    re_inst *inst = (re_inst *)realloc(re->inst, n * sizeof(re_inst));
+    if (inst == NULL) { re->err = "out of memory"; return -1; }
+    re->inst = inst;
+  }
+  re->inst[re->n_inst].op = (uint8_t)op;
+  re->inst[re->n_inst].x = x;
+  re->inst[re->n_inst].y = y;
+  return re->n_inst++;
+}  /* emit */
+
+
+/*
+ * Emit node n.  The same subtree may be emitted several times (that's
+ * how {m,n} is done).  Returns 0 or -1.
+ */
+static int emit_node(re_prog *re, const re_node *nodes, int n) {
+  const re_node *nd = &nodes[n];
+  int i, j, l;
+
+  if (re->n_inst > 100000) { re->err = "pattern too big"; return -1; }
+
+  switch (nd->type) {
+  case N_EMPTY:
+    return 0;
+  case N_CLASS:
+    return (emit(re, RI_CLASS, nd->a, 0) < 0) ? -1 : 0;
+  case N_BOL:
+    return (emit(re, RI_BOL, 0, 0) < 0) ? -1 : 0;
+  case N_EOL:
+    return (emit(re, RI_EOL, 0, 0) < 0) ? -1 : 0;
+  case N_CAT:
+    if (emit_node(re, nodes, nd->a) < 0) { return -1; }
+    return emit_node(re, nodes, nd->b);
+  case N_ALT:
+    /* split L1, L2; L1: a; jmp L3; L2: b; L3: */
+    i = emit(re, RI_SPLIT, 0, 0);
+    if (i < 0 || emit_node(re, nodes, nd->a) < 0) { return -1; }
+    j = emit(re, RI_JMP, 0, 0);
+    if (j < 0 || emit_node(re, nodes, nd->b) < 0) { return -1; }
+    re->inst[i].x = i + 1;
+    re->inst[i].y = j + 1;
+    re->inst[j].x = re->n_inst;
+    return 0;
+  case N_REP:
+    for (l = 0; l < nd->min; l++)
+      if (emit_node(re, nodes, nd->a) < 0) { return -1; }
+    if (nd->max < 0) {
+      /* L1: split L2, L3; L2: a; jmp L1; L3: */
+      i = emit(re, RI_SPLIT, 0, 0);
+      if (i < 0 || emit_node(re, nodes, nd->a) < 0) { return -1; }
+      if (emit(re, RI_JMP, i, 0) < 0) { return -1; }
+      re->inst[i].x = i + 1;
+      re->inst[i].y = re->n_inst;
+      return 0;
+    }
+    for (; l < nd->max; l++) {
+      /* split L1, L2; L1: a; L2: */
+      i = emit(re, RI_SPLIT, 0, 0);
+      if (i < 0 || emit_node(re, nodes, nd->a) < 0) { return -1; }
+      re->inst[i].x = i + 1;
+      re->inst[i].y = re->n_inst;
+    }
+    return 0;
+  }
+  return -1;
+}  /* emit_node */
+
+
+/*
+ * Split the 256 byte values into classes that every byte set (and the
+ * anchors, which care about CR and LF) treats alike.
+ */
+static void make_bclasses(re_prog *re) {
+  int remap[512];
+  int c, k, n = 3;
+
+  for (c = 0; c < 256; c++)
+    re->bclass[c] = 0;
+  re->bclass['\n'] = 1;
+  re->bclass['\r'] = 2;
+
+  for (k = 0; k < re->n_cls; k++) {
+    int m = 0;
+    for (c = 0; c < 512; c++)
+      remap[c] = -1;
+    for (c = 0; c < 256; c++) {
+      int key = re->bclass[c] * 2 + class_has(re->cls[k], c);
+      if (remap[key] < 0) remap[key] = m++;
+      re->bclass[c] = (uint8_t)remap[key];
+    }
+    n = m;
+  }
+  re->n_bclass = n;
+  for (c = 255; c >= 0; c--)
+    re->brep[re->bclass[c]] = (uint8_t)c;
+}  /* make_bclasses */
+
+
+/* ----------------------------------------------------------------
+ * DFA cache.
+ * ----------------------------------------------------------------
+ */
+
+/*
+ * Add everything reachable from pc without consuming a byte to the
+ * work set.  'bol': ^ holds here.  Uses the marks of the set being
+ * built.
+ */
+static void closure(re_prog *re, int pc, int bol, int *n) {
+  int sp = 0;
+
+  re->stack[sp++] = pc;
+  while (sp > 0) {
+    const re_inst *in;
+
+    pc = re->stack[--sp];
+    if (re->mark[pc] == re->mark_gen) continue;
+    re->mark[pc] = re->mark_gen;
+    in = &re->inst[pc];
+    switch (in->op) {
+    case RI_JMP:
+      re->stack[sp++] = in->x;
+      break;
+    case RI_SPLIT:
+      re->stack[sp++] = in->y;
+      re->stack[sp++] = in->x;
+      break;
+    case RI_BOL:
+      if (bol) re->stack[sp++] = pc + 1;
+      break;
+    default:  /* RI_CLASS, RI_EOL, RI_MATCH */
+      re->work[(*n)++] = pc;
+      break;
+    }
+  }
+}  /* closure */
+
+
+/*
+ * Would the set match if the line ended here: does some $ in it lead,
+ * without consuming a byte, to the match?
+ */
+static int eol_matches(re_prog *re, const int32_t *set, int n) {
+  int i, sp = 0;
+
+  re->mark_gen++;
+  for (i = 0; i < n; i++)
+    if (re->inst[set[i]].op == RI_EOL)
+      re->stack[sp++] = set[i] + 1;
+
+  while (sp > 0) {
+    int pc = re->stack[--sp];
+    const re_inst *in = &re->inst[pc];
+
+    if (re->mark[pc] == re->mark_gen) continue;
+    re->mark[pc] = re->mark_gen;
+    switch (in->op) {
+    case RI_MATCH: return 1;
+    case RI_JMP: re->stack[sp++] = in->x; break;
+    case RI_SPLIT:
+      re->stack[sp++] = in->y;
+      re->stack[sp++] = in->x;
+      break;
+    case RI_EOL: re->stack[sp++] = pc + 1; break;
+    default: break;  /* a byte or ^ can't follow the end of a line */
+    }
+  }
+  return 0;
+}  /* eol_matches */
+
+
+static unsigned hash_set(const int32_t *set, int n) {
+  unsigned h = 2166136261u;
+  int i;
+  for (i = 0; i < n; i++)
+    h = (h ^ (unsigned)set[i]) * 16777619u;
+  return h;
+}  /* hash_set */
+
+
+static int cmp_int32(const void *a, const void *b) {
+  int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+  return (x > y) - (x < y);
+}  /* cmp_int32 */
+
+
+/*
+ * Empty the cache.  Every state index held anywhere is now stale.
+ */
+static void cache_flush(re_prog *re) {
+  int i;
+
+  for (i = 0; i < re->hash_size; i++)
+    re->hash[i] = -1;
+  re->n_states = 0;
+  re->sets_used = 0;
+  re->cache_used = 0;
+  re->start[0] = re->start[1] = -1;
+  re->gen++;
+  re->flushes++;
+}  /* cache_flush */
+
+
+static int hash_grow(re_prog *re) {
+  int n = re->hash_size ? re->hash_size * 2 : 64;
+  int32_t *hash = (int32_t *)malloc(n * sizeof(int32_t));
+  int i, s;
+
+  if (hash == NULL) { return -1; }
+  for (i = 0; i < n; i++)
+    hash[i] = -1;
+  for (s = 0; s < re->n_states; s++) {
+    unsigned h = hash_set(re->sets + re->set_off[s], re->set_len[s]);
+    for (i = h & (n - 1); hash[i] >= 0; i = (i + 1) & (n - 1)) {}
+    hash[i] = s;
+  }
+  free(re->hash);
+  re->hash = hash;
+  re->hash_size = n;
+  return 0;
+}  /* hash_grow */
+
+
+/*
+ * Find or add the state for the (sorted) set.  May empty the cache
+ * first, in which case *flushed is set.  Returns the state, or -1 if
+ * memory ran out.
+ */
+static int32_t intern(re_prog *re, const int32_t *set, int n, int *flushed) {
+  unsigned h = hash_set(set, n);
+  size_t cost = re->n_bclass * sizeof(int32_t) + n * sizeof(int32_t) + 32;
+  int32_t s;
+  int i;
+
+  if (re->hash_size > 0) {
+    for (i = h & (re->hash_size - 1); re->hash[i] >= 0;
+         i = (i + 1) & (re->hash_size - 1)) {
+      s = re->hash[i];
+      if (re->set_len[s] == n &&
+          memcmp(re->sets + re->set_off[s], set, n * sizeof(int32_t)) == 0)
+        return s;
+    }
+  }
+
+  if (re->n_states > 0 && re->cache_used + cost > re->cache_max) {
+    cache_flush(re);
+    *flushed = 1;
+  }
+
+  if (re->n_states == re->alloc_states) {
+    int a = re->alloc_states ? re->alloc_states * 2 : 32;
+    int32_t *next = (int32_t *)realloc(re->next,
+                                       (size_t)a * re->n_bclass * sizeof(int32_t));
+    uint8_t *flags;
+    size_t *off;
+    int32_t *len;
+    if (next == NULL) { return -1; }
+    re->next = next;
+    flags = (uint8_t *)realloc(re->flags, a);
+    if (flags == NULL) { return -1; }
+    re->flags = flags;
+    off = (size_t *)realloc(re->set_off, a * sizeof(size_t));
+    if (off == NULL) { return -1; }
+    re->set_off = off;
+    len = (int32_t *)realloc(re->set_len, a * sizeof(int32_t));
+    if (len == NULL) { return -1; }
+    re->set_len = len;
+    re->alloc_states = a;
+  }
+  if (re->sets_used + n > re->sets_alloc) {
+    size_t a = re->sets_alloc ? re->sets_alloc * 2 : 256;
+    int32_t *sets;
+    while (a < re->sets_used + n)
+      a *= 2;
+    sets = (int32_t *)realloc(re->sets, a * sizeof(int32_t));
+    if (sets == NULL) { return -1; }
+    re->sets = sets;
+    re->sets_alloc = a;
+  }
+  if ((re->n_states + 1) * 2 > re->hash_size && hash_grow(re) < 0) {
+    return -1;
+  }
+
+  s = re->n_states++;
+  memcpy(re->sets + re->sets_used, set, n * sizeof(int32_t));
+  re->set_off[s] = re->sets_used;
+  re->set_len[s] = n;
+  re->sets_used += n;
+  re->cache_used += cost;
+  for (i = 0; i < re->n_bclass; i++)
+    re->next[(size_t)s * re->n_bclass + i] = -1;
+  re->flags[s] = eol_matches(re, set, n) ? F_EOL : 0;
+  for (i = 0; i < n; i++)
+    if (re->inst[set[i]].op == RI_MATCH)
+      re->flags[s] |= F_MATCH;
+
+  for (i = h & (re->hash_size - 1); re->hash[i] >= 0;
+       i = (i + 1) & (re->hash_size - 1)) {}
+  re->hash[i] = s;
+  return s;
+}  /* intern */
+
+
+/*
+ * The state at the start of the output or of a line (bol), or just
+ * the start of the search.
+ */
+static int32_t start_state(re_prog *re, int bol) {
+  int n = 0, flushed = 0;
+
+  if (re->start[bol] >= 0) { return re->start[bol]; }
+  re->mark_gen++;
+  closure(re, 0, bol, &n);
+  qsort(re->work, n, sizeof(int32_t), cmp_int32);
+  re->start[bol] = intern(re, re->work, n, &flushed);
+  return re->start[bol];
+}  /* start_state */
+
+
+/*
+ * Build state s's transition on byte class bc.  Returns the target,
+ * or -1 if memory ran out.
+ */
+static int32_t build_step(re_prog *re, int32_t s, int bc) {
+  int c = re->brep[bc];
+  int bol = (c == '\n');
+  int32_t *set = re->sets + re->set_off[s];
+  int len = re->set_len[s];
+  int n = 0, i, flushed = 0;
+  int32_t t;
+
+  re->mark_gen++;
+  for (i = 0; i < len; i++) {
+    const re_inst *in = &re->inst[set[i]];
+    if (in->op == RI_CLASS && class_has(re->cls[in->x], c))
+      closure(re, set[i] + 1, bol, &n);
+  }
+  closure(re, 0, bol, &n);  /* a match can start at any byte */
+  qsort(re->work, n, sizeof(int32_t), cmp_int32);
+
+  t = intern(re, re->work, n, &flushed);
+  if (t >= 0 && !flushed)
+    re->next[(size_t)s * re->n_bclass + bc] = t;
+  return t;
+}  /* build_step */
+
+
+/* ----------------------------------------------------------------
+ * API.
+ * ----------------------------------------------------------------
+ */
+
+/*
+ * Compile pat with a DFA cache of at most cache_max bytes (0 for
+ * RE_CACHE_DEFAULT).  Returns 0, or -1 with re->err saying why.  A
+ * pattern that matches the empty string is refused: it would match
+ * everywhere.
+ */
+int re_compile(re_prog *re, const char *pat, size_t len, size_t cache_max) {
+  re_parser ps;
+  int root;
+
+  memset(re, 0, sizeof(*re));
+  re->start[0] = re->start[1] = -1;
+  re->cache_max = cache_max ? cache_max : RE_CACHE_DEFAULT;
+
+  memset(&ps, 0, sizeof(ps));
+  ps.re = re;
+  ps.p = pat;
+  ps.end = pat + len;
+  root = parse_alt(&ps);
+  if (root >= 0 && ps.p != ps.end) {
+    re->err = "unmatched )";
+    root = -1;
+  }
+  if (root >= 0 && (emit_node(re, ps.nodes, root) < 0 ||
+                    emit(re, RI_MATCH, 0, 0) < 0))
+    root = -1;
+  free(ps.nodes);
+  if (root < 0) goto fail;
+
+  make_bclasses(re);
+  re->work = (int32_t *)malloc(re->n_inst * sizeof(int32_t));
+  re->stack = (int32_t *)malloc((3 * re->n_inst + 1) * sizeof(int32_t));
+  re->mark = (uint32_t *)calloc(re->n_inst, sizeof(uint32_t));
+  if (re->work == NULL || re->stack == NULL || re->mark == NULL) {
+    re->err = "out of memory";
+    goto fail;
+  }
+
+  if (start_state(re, 1) < 0 || start_state(re, 0) < 0) {
+    re->err = "out of memory";
+    goto fail;
+  }
+  if ((re->flags[re->start[0]] & (F_MATCH | F_EOL)) ||
+      (re->flags[re->start[1]] & F_MATCH)) {
+    re->err = "matches the empty string";
+    goto fail;
+  }
+  return 0;
+
+fail:
+  {
+    const char *err = re->err;
+    re_free(re);
+    re->err = err;
+  }
+  errno = EINVAL;
+  return -1;
+}  /* re_compile */
+
+
+void re_free(re_prog *re) {
+  free(re->inst);
+  free(re->cls);
+  free(re->next);
+  free(re->flags);
+  free(re->set_off);
+  free(re->set_len);
+  free(re->sets);
+  free(re->hash);
+  free(re->work);
+  free(re->stack);
+  free(re->mark);
+  memset(re, 0, sizeof(*re));
+}  /* re_free */
+
+
+void re_stream_init(re_stream *st) {
+  memset(st, 0, sizeof(*st));
+  st->state = -1;
+  st->last_end = ~0ULL;
+}  /* re_stream_init */
+
+
+void re_stream_free(re_stream *st) {
+  free(st->saved);
+  re_stream_init(st);
+}  /* re_stream_free */
+
+
+/*
+ * Report a match unless it's the one just reported (a $ match can be
+ * seen both at the end of one chunk and at the CR/LF starting the
+ * next).
+ */
+static int report(re_stream *st, unsigned long long end, re_match_fn cb,
+                  void *arg) {
+  if (end == st->last_end) { return 0; }
+  st->last_end = end;
+  return cb(arg, end);
+}  /* report */
+
+
+/*
+ * Run buf through the matcher, calling cb at the end of every match.
+ * Returns the number of bytes consumed: all of them, unless cb asked
+ * to stop (or memory ran out).
+ */
+size_t re_feed(re_prog *re, re_stream *st, const char *buf, size_t len,
+               re_match_fn cb, void *arg) {
+  const unsigned char *p = (const unsigned char *)buf;
+  int32_t s;
+  size_t i;
+  int stop = 0;
+
+  if (len == 0) { return 0; }
+
+  if (st->state < 0) {
+    s = start_state(re, 1);
+  } else if (st->gen != re->gen) {
+    int flushed = 0;
+    s = intern(re, st->saved, st->n_saved, &flushed);
+  } else {
+    s = st->state;
+  }
+  if (s < 0) { return 0; }
+
+  for (i = 0; i < len; i++) {
+    int32_t t;
+
+    if ((re->flags[s] & F_EOL) && (p[i] == '\n' || p[i] == '\r')) {
+      if (report(st, st->offset + i, cb, arg)) {
+        stop = 1;
+        break;
+      }
+    }
+    t = re->next[(size_t)s * re->n_bclass + re->bclass[p[i]]];
+    if (t < 0) {
+      t = build_step(re, s, re->bclass[p[i]]);
+      if (t < 0) break;
+    }
+    s = t;
+    if ((re->flags[s] & F_MATCH) && report(st, st->offset + i + 1, cb, arg)) {
+      i++;
+      stop = 1;
+      break;
+    }
+  }
+
+  /* Output that stops here ends the line as far as $ can tell. */
+  if (!stop && i == len && (re->flags[s] & F_EOL))
+    report(st, st->offset + len, cb, arg);
+
+  /* Keep a copy of where we are in case the cache is emptied before
+   * the next feed. */
+  if (st->alloc_saved < re->set_len[s]) {
+    int32_t *saved = (int32_t *)realloc(st->saved,
+                                        re->n_inst * sizeof(int32_t));
+    if (saved != NULL) {
+      st->saved = saved;
+      st->alloc_saved = re->n_inst;
+    }
+  }
+  if (st->alloc_saved >= re->set_len[s]) {
+    if (re->set_len[s] > 0)
+      memcpy(st->saved, re->sets + re->set_off[s],
+             re->set_len[s] * sizeof(int32_t));
+    st->n_saved = re->set_len[s];
+    st->state = s;
+    st->gen = re->gen;
+  } else {
+    st->state = -1;  /* out of memory: start over */
+  }
+  st->offset += i;
+  return i;
+}  /* re_feed */
@@ -0,0 +1,103 @@
+/* re.h - Streaming regular expression matcher (lazy DFA).
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Finds where a regular expression matches in a stream of output fed
+ * a chunk at a time, so a match can span reads and nothing has to be
+ * kept around to search again.  The pattern compiles to an NFA; DFA
+ * states are built from it only as the input needs them and kept in a
+ * cache of bounded size, which is simply emptied when full.  Every
+ * byte costs one table lookup once its transition has been built, with
+ * no backtracking, whatever the pattern.
+ *
+ * Syntax: literal bytes, . (not newline), [set] [^set] with ranges,
+ * ( ) grouping, | * + ? {m} {m,} {m,n}, ^ (start of output or line),
+ * $ (before CR or LF, or at the end of the output read so far), and
+ * the escapes \r \n \t \e \xHH \d \D \s \S \w \W; any other escaped
+ * byte stands for itself.
+ *
+ * A compiled pattern can be shared by any number of streams but
+ * isn't thread-safe: its cache changes as streams are fed.
+ */
+
+#ifndef RE_H
+#define RE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default DFA cache budget, bytes. */
+#define RE_CACHE_DEFAULT (256 * 1024)
+
+typedef struct {
+  uint8_t op;
+  int32_t x, y;
+} re_inst;
+
+typedef struct {
+  /* NFA. */
+  re_inst *inst;
+  int n_inst;
+  uint8_t (*cls)[32];     /* byte set bitmaps for RI_CLASS */
+  int n_cls;
+  uint8_t bclass[256];    /* byte -> equivalence class */
+  uint8_t brep[256];      /* equivalence class -> one of its bytes */
+  int n_bclass;
+
+  /* DFA cache.  A state is the sorted set of NFA instructions it's
+   * at; its transitions are -1 until first taken. */
+  int32_t *next;          /* state * n_bclass + class -> state */
+  uint8_t *flags;
+  size_t *set_off;        /* state -> its set in sets[] */
+  int32_t *set_len;
+  int32_t *sets;
+  size_t sets_used, sets_alloc;
+  int32_t *hash;          /* open addressing, state or -1 */
+  int hash_size;
+  int n_states, alloc_states;
+  int32_t start[2];       /* [at start of line], or -1 */
+  size_t cache_used, cache_max;
+  unsigned gen;           /* bumped when the cache is emptied */
+  unsigned long flushes;
+
+  /* Scratch for building states. */
+  int32_t *work, *stack;
+  uint32_t *mark;
+  uint32_t mark_gen;
+
+  const char *err;        /* why re_compile() failed */
+} re_prog;
+
+/* Per-stream position.  Holds a copy of its state's NFA set so it can
+ * pick up where it was after the cache has been emptied. */
+typedef struct {
+  int32_t state;          /* -1: at the start */
+  unsigned gen;
+  int32_t *saved;
+  int n_saved, alloc_saved;
+  unsigned long long offset;    /* bytes fed so far */
+  unsigned long long last_end;  /* last match reported */
+} re_stream;
+
+/* Called for each match with the stream offset just past it.  Return
+ * non-zero to stop the feed there. */
+typedef int (*re_match_fn)(void *arg, unsigned long long end);
+
+int re_compile(re_prog *re, const char *pat, size_t len, size_t cache_max);
+void re_free(re_prog *re);
+
+void re_stream_init(re_stream *st);
+void re_stream_free(re_stream *st);
+size_t re_feed(re_prog *re, re_stream *st, const char *buf, size_t len,
+               re_match_fn cb, void *arg);
+
+#endif  /* RE_H */
@@ -0,0 +1,691 @@
+/* rec.c - Session recording.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* In the ring, an event is a rec_ev followed by its data.  The
+ * producer only puts one when both fit, so nothing is ever half there
+ * for long; the header goes in with one spsc_put() and the writer waits
+ * for the rest of the data if it hasn't landed yet.
+ *
+ * asciicast data are JSON strings, so they have to be valid UTF-8.
+ * A character split across two reads is held back and finished in the
+ * next event of the same code; bytes that aren't UTF-8 become U+FFFD.
+ * Control characters are escaped.
+ *
+ * Binary frames are written as they come, data straight from the ring.
+ * The writer keeps the index entries for the current block and writes
+ * the block out as a frame when it's full (and at the end), before the
+ * frame that would have been its next entry; so an entry always points
+ * at a data frame.  Each index frame points back at the one before, and
+ * the trailer at the last, so a reader finds a time by reading a few
+ * index frames from the end of the file back.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "rec.h"
+
+#define REC_RING_SIZE (16 * 1024 * 1024)   /* power of 2 */
+#define REC_FILE_BUF  (64 * 1024)
+
+#define REC_MAGIC     "MPTYREC\1"
+#define REC_END_MAGIC "MPTYIDX\1"
+#define REC_HDR_SIZE  24
+#define REC_END_SIZE  16
+
+typedef struct {
+  long long t_us;
+  uint32_t len;
+  int32_t code;
+} rec_ev;
+
+/* Room left in rec_json()'s buffer before it's written out. */
+#define REC_OUT_SIZE  4096
+#define REC_OUT_SLACK 16
+
+
+/* ---- Output -------------------------------------------------------------- */
+
+typedef struct {
+  char buf[REC_OUT_SIZE];
+  size_t len;
+} rec_out;
+
+
+static void out_raw(rec_writer *w, const void *p, size_t n) {
+  if (n > 0 && !w->failed && fwrite(p, 1, n, w->fp) != n)
+    w->failed = 1;
+  w->offset += n;
+}  /* out_raw */
+
+
+static void out_flush(rec_writer *w, rec_out *o) {
+  out_raw(w, o->buf, o->len);
+  o->len = 0;
+}  /* out_flush */
+
+
+static void out_byte(rec_writer *w, rec_out *o, unsigned char c) {
+  static const char hex[] = "0123456789abcdef";
+  char *p;
+
+  if (o->len > REC_OUT_SIZE - REC_OUT_SLACK)
+    out_flush(w, o);
+  p = o->buf + o->len;
+  if (c == '"' || c == '\\') {
+    *p++ = '\\';
+    *p++ = (char)c;
+  } else if (c == '\n') {
+    *p++ = '\\'; *p++ = 'n';
+  } else if (c == '\r') {
+    *p++ = '\\'; *p++ = 'r';
+  } else if (c == '\t') {
+    *p++ = '\\'; *p++ = 't';
+  } else if (c < 0x20 || c == 0x7F) {
+    memcpy(p, "\\u00", 4);
+    p[4] = hex[c >> 4];
+    p[5] = hex[c & 0xF];
+    p += 6;
+  } else {
+    *p++ = (char)c;
+  }
+  o->len = (size_t)(p - o->buf);
+}  /* out_byte */
+
+
+static void out_text(rec_writer *w, rec_out *o, const char *p, size_t n) {
+  if (o->len + n > REC_OUT_SIZE)
+    out_flush(w, o);
+  if (n > REC_OUT_SIZE) {
+    out_raw(w, p, n);
+    return;
+  }
+  memcpy(o->buf + o->len, p, n);
+  o->len += n;
+}  /* out_text */
+
+
+static size_t put_le(unsigned char *p, unsigned long long v, int n) {
+  int i;
+  for (i = 0; i < n; i++)
+    p[i] = (unsigned char)(v >> (8 * i));
+  return (size_t)n;
+}  /* put_le */
+
+
+static size_t put_varint(unsigned char *p, unsigned long long v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (unsigned char)v;
+  return n;
+}  /* put_varint */
+
+
+/* ---- asciicast ------------------------------------------------------------ */
+
+/*
+ * Is b allowed as the second byte after lead?  (Rules out overlong
+ * forms, surrogates and code points past U+10FFFF.)
+ */
+static int utf8_second_ok(unsigned char lead, unsigned char b) {
+  if (lead == 0xE0) { return b >= 0xA0; }
+  if (lead == 0xED) { return b <= 0x9F; }
+  if (lead == 0xF0) { return b >= 0x90; }
+  if (lead == 0xF4) { return b <= 0x8F; }
+  return 1;
+}  /* utf8_second_ok */
+
+
+/*
+ * Append p as the inside of a JSON string.  u carries an incomplete
+ * character from one call to the next.
+ */
+static void rec_json(rec_writer *w, rec_out *o, rec_utf8 *u,
+                     const char *p, size_t n) {
+  size_t i = 0;
+
+  while (i < n) {
+    unsigned char b = (unsigned char)p[i];
+
+    if (u->need > 0) {
+      if ((b & 0xC0) == 0x80 && (u->have > 1 || utf8_second_ok(u->buf[0], b))) {
+        u->buf[u->have++] = b;
+        i++;
+        if (u->have == u->need + 1) {
+          out_text(w, o, (const char *)u->buf, (size_t)u->have);
+          u->need = 0;
+        }
+        continue;
+      }
+      out_text(w, o, "\\ufffd", 6);   /* b starts over */
+      u->need = 0;
+    }
+
+    if (b >= 0x20 && b < 0x7F && b != '"' && b != '\\') {
+      size_t j = i + 1;
+      while (j < n && (unsigned char)p[j] >= 0x20 &&
+             (unsigned char)p[j] < 0x7F && p[j] != '"' && p[j] != '\\')
+        j++;
+      out_text(w, o, p + i, j - i);   /* the usual case: plain text */
+      i = j;
+      continue;
+    } else if (b < 0x80) {
+      out_byte(w, o, b);
+    } else if (b >= 0xC2 && b <= 0xF4) {
+      u->buf[0] = b;
+      u->have = 1;
+      u->need = (b < 0xE0) ? 1 : (b < 0xF0) ? 2 : 3;
+    } else {
+      out_text(w, o, "\\ufffd", 6);
+    }
+    i++;
+  }
+}  /* rec_json */
+
+
+static void cast_header(rec_writer *w, const rec_header *h) {
+  rec_out o;
+  rec_utf8 u;
+
+  memset(&u, 0, sizeof(u));
+  o.len = (size_t)snprintf(o.buf, sizeof(o.buf),
+                           "{\"version\": 2, \"width\": %d, \"height\": %d, "
+                           "\"timestamp\": %lld", h->cols, h->rows,
+                           h->timestamp);
+  if (h->command != NULL) {
+    out_text(w, &o, ", \"command\": \"", 14);
+    rec_json(w, &o, &u, h->command, strlen(h->command));
+    out_text(w, &o, "\"", 1);
+  }
+  if (h->term != NULL) {
+    out_text(w, &o, ", \"env\": {\"TERM\": \"", 19);
+    memset(&u, 0, sizeof(u));
+    rec_json(w, &o, &u, h->term, strlen(h->term));
+    out_text(w, &o, "\"}", 2);
+  }
+  out_text(w, &o, "}\n", 2);
+  out_flush(w, &o);
+}  /* cast_header */
+
+
+/*
+ * Start an event line in o; returns the UTF-8 carry for its data.
+ */
+static rec_utf8 *cast_begin(rec_writer *w, rec_out *o, rec_utf8 *scratch,
+                            long long t_us, int code) {
+  int n = snprintf(o->buf, sizeof(o->buf), "[%.6f, \"%c\", \"",
+                   (double)t_us / 1e6, (char)code);
+
+  o->len = (n > 0) ? (size_t)n : 0;
+  if (code == REC_OUTPUT) { return &w->utf8[0]; }
+  if (code == REC_INPUT) { return &w->utf8[1]; }
+  memset(scratch, 0, sizeof(*scratch));
+  return scratch;
+}  /* cast_begin */
+
+
+static void cast_end(rec_writer *w, rec_out *o) {
+  out_text(w, o, "\"]\n", 3);
+  out_flush(w, o);
+}  /* cast_end */
+
+
+/* ---- Binary -------------------------------------------------------------- */
+
+static void bin_header(rec_writer *w, const rec_header *h) {
+  const char *cmd = (h->command != NULL) ? h->command : "";
+  const char *term = (h->term != NULL) ? h->term : "";
+  size_t meta = strlen(cmd) + 1 + strlen(term) + 1;
+  unsigned char hdr[REC_HDR_SIZE];
+
+  memcpy(hdr, REC_MAGIC, 8);
+  put_le(hdr + 8, (unsigned)h->cols, 2);
+  put_le(hdr + 10, (unsigned)h->rows, 2);
+  put_le(hdr + 12, meta, 4);
+  put_le(hdr + 16, (unsigned long long)h->timestamp, 8);
+  out_raw(w, hdr, sizeof(hdr));
+  out_raw(w, cmd, strlen(cmd) + 1);
+  out_raw(w, term, strlen(term) + 1);
+}  /* bin_header */
+
+
+static void bin_frame_start(rec_writer *w, int code, long long delta_us,
+                            size_t len) {
+  unsigned char hdr[1 + 10 + 10];
+  size_t n = 0;
+
+  hdr[n++] = (unsigned char)code;
+  n += put_varint(hdr + n, (unsigned long long)delta_us);
+  n += put_varint(hdr + n, len);
+  out_raw(w, hdr, n);
+}  /* bin_frame_start */
+
+
+/*
+ * Write the pending index entries as an index frame.
+ */
+static void bin_index(rec_writer *w) {
+  unsigned char buf[8 + REC_INDEX_BLOCK * 16];
+  size_t n = put_le(buf, w->index_prev, 8);
+  int i;
+
+  for (i = 0; i < w->n_index; i++) {
+    n += put_le(buf + n, (unsigned long long)w->index[i].t_us, 8);
+    n += put_le(buf + n, w->index[i].offset, 8);
+  }
+  w->index_prev = w->offset;
+  bin_frame_start(w, REC_INDEX, 0, n);
+  out_raw(w, buf, n);
+  w->n_index = 0;
+}  /* bin_index */
+
+
+/*
+ * Start a data frame at t_us (since the start), indexing it if it's
+ * the first in its second.
+ */
+static void bin_begin(rec_writer *w, long long t_us, int code, size_t len) {
+  if (t_us < w->last_us) t_us = w->last_us;
+  if (t_us >= w->index_due) {
+    if (w->n_index == REC_INDEX_BLOCK)
+      bin_index(w);
+    w->index[w->n_index].t_us = t_us;
+    w->index[w->n_index].offset = w->offset;
+    w->n_index++;
+    w->index_due = (t_us / REC_INDEX_US + 1) * REC_INDEX_US;
+  }
+  bin_frame_start(w, code, t_us - w->last_us, len);
+  w->last_us = t_us;
+}  /* bin_begin */
+
+
+static void bin_end(rec_writer *w) {
+  unsigned char end[REC_END_SIZE];
+
+  if (w->n_index > 0)
+    bin_index(w);
+  put_le(end, w->index_prev, 8);
+  memcpy(end + 8, REC_END_MAGIC, 8);
+  out_raw(w, end, sizeof(end));
+}  /* bin_end */
+
+
+/* ---- Writer thread --------------------------------------------------------- */
+
+/*
+ * Copy n bytes out of the ring, waiting for any not there yet.
+ */
+static void ring_take(spsc_ring *r, void *dst, size_t n) {
+  char *d = (char *)dst;
+
+  while (n > 0) {
+    size_t len;
+    const char *p = spsc_peek(r, &len);
+    if (len == 0) {
+      spsc_wait_data(r, -1, -1);
+      continue;
+    }
+    if (len > n) len = n;
+    memcpy(d, p, len);
+    spsc_consume(r, len);
+    d += len;
+    n -= len;
+  }
+}  /* ring_take */
+
+
+/*
+ * Take one event off the ring and write it out.
+ */
+static void write_event(rec_writer *w) {
+  rec_out o;
+  rec_utf8 scratch;
+  rec_utf8 *u = NULL;
+  rec_ev ev;
+  size_t left;
+
+  ring_take(&w->ring, &ev, sizeof(ev));
+  if (w->format == REC_BINARY)
+    bin_begin(w, ev.t_us - w->start_us, ev.code, ev.len);
+  else
+    u = cast_begin(w, &o, &scratch, ev.t_us - w->start_us, ev.code);
+
+  left = ev.len;
+  while (left > 0) {
+    size_t len;
+    const char *p = spsc_peek(&w->ring, &len);
+    if (len == 0) {
+      spsc_wait_data(&w->ring, -1, -1);
+      continue;
+    }
+    if (len > left) len = left;
+    if (w->format == REC_BINARY)
+      out_raw(w, p, len);
+    else
+      rec_json(w, &o, u, p, len);
+    spsc_consume(&w->ring, len);
+    left -= len;
+  }
+
+  if (w->format != REC_BINARY)
+    cast_end(w, &o);
+}  /* write_event */
+
+
+static void *rec_thread(void *arg) {
+  rec_writer *w = (rec_writer *)arg;
+
+  for (;;) {
+    if (spsc_used(&w->ring) > 0) {
+      write_event(w);
+      continue;
+    }
+    if (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+      if (spsc_used(&w->ring) == 0) break;
+      continue;
+    }
+    /* Caught up: let what's written so far reach the file. */
+    if (!w->failed && fflush(w->fp) != 0) w->failed = 1;
+    spsc_wait_data(&w->ring, -1, -1);
+  }
+  if (w->format == REC_BINARY)
+    bin_end(w);
+  return NULL;
+}  /* rec_thread */
+
+
+/* ---- Recording ------------------------------------------------------------- */
+
+/*
+ * Create path, write the header and start the writer.  Event times
+ * are taken relative to start_us.  Returns -1 with errno set on
+ * failure.
+ */
+int rec_open(rec_writer *w, const char *path, int format,
+             const rec_header *h, long long start_us) {
+  int err;
+
+  memset(w, 0, sizeof(*w));
+  w->format = format;
+  w->start_us = start_us;
+  w->fp = fopen(path, "w");
+  if (w->fp == NULL) { return -1; }  /* Handle error. */
+  setvbuf(w->fp, NULL, _IOFBF, REC_FILE_BUF);
+
+  if (format == REC_BINARY)
+    bin_header(w, h);
+  else
+    cast_header(w, h);
+
+  if (spsc_init(&w->ring, REC_RING_SIZE) < 0) {
+    err = errno;
+    fclose(w->fp);
+    errno = err;
+    return -1;
+  }  /* Handle error. */
+  err = pthread_create(&w->thread, NULL, rec_thread, w);
+  if (err != 0) {
+    spsc_free(&w->ring);
+    fclose(w->fp);
+    errno = err;
+    return -1;
+  }  /* Handle error. */
+  return 0;
+}  /* rec_open */
+
+
+static void rec_put(rec_writer *w, long long now_us, int code,
+                    const char *data, size_t len) {
+  rec_ev ev;
+
+  ev.t_us = now_us;
+  ev.len = (uint32_t)len;
+  ev.code = code;
+  spsc_put(&w->ring, (const char *)&ev, sizeof(ev));
+  spsc_put(&w->ring, data, len);
+  w->events++;
+}  /* rec_put */
+
+
+/*
+ * Record an event that happened at now_us.  Never blocks: with no room
+ * in the ring the event is dropped.
+ */
+void rec_event(rec_writer *w, long long now_us, int code,
+               const char *data, size_t len) {
+  size_t room = w->ring.size - spsc_used(&w->ring);
+  size_t need = sizeof(rec_ev) + len;
+
+  if (w->drop_pending > 0) {
+    char text[64];
+    int n = snprintf(text, sizeof(text), "minpty: %llu bytes dropped",
+                     w->drop_pending);
+    if (room >= need + sizeof(rec_ev) + (size_t)n) {
+      rec_put(w, now_us, REC_MARKER, text, (size_t)n);
+      room -= sizeof(rec_ev) + (size_t)n;
+      w->drop_pending = 0;
+    } else {
+      room = 0;
+    }
+  }
+  if (room < need) {
+    w->dropped += len;
+    w->drop_pending += len;
+    return;
+  }
+  rec_put(w, now_us, code, data, len);
+}  /* rec_event */
+
+
+/*
+ * Write out everything recorded, stop the writer and close the file.
+ * Returns -1 if anything failed to be written.
+ */
+int rec_close(rec_writer *w) {
+  int failed;
+
+  __atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+  spsc_kick(&w->ring);
+  pthread_join(w->thread, NULL);
+  spsc_free(&w->ring);
+
+  failed = w->failed;
+  if (fclose(w->fp) != 0) failed = 1;
+  w->fp = NULL;
+  return failed ? -1 : 0;
+}  /* rec_close */
+
+
+/* ---- Reading --------------------------------------------------------------- */
+
+static unsigned long long get_le(const unsigned char *p, int n) {
+  unsigned long long v = 0;
+  int i;
+  for (i = n - 1; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}  /* get_le */
+
+
+/*
+ * Decode the varint at *pos (before end).  Returns -1 if it runs off
+ * the end or is too long.
+ */
+static int get_varint(const unsigned char *base, size_t *pos, size_t end,
+                      unsigned long long *v) {
+  int shift = 0;
+
+  *v = 0;
+  while (*pos < end && shift < 64) {
+    unsigned char b = base[(*pos)++];
+    *v |= (unsigned long long)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) { return 0; }
+    shift += 7;
+  }
+  return -1;
+}  /* get_varint */
+
+
+/*
+ * Read a binary recording held in memory (base, size bytes; it must
+ * stay there while r is used).  Returns -1 if it isn't one.
+ */
+int rec_reader_init(rec_reader *r, const void *base, size_t size) {
+  const unsigned char *p = (const unsigned char *)base;
+  size_t meta, cmd_len, term_len;
+
+  memset(r, 0, sizeof(*r));
+  if (size < REC_HDR_SIZE || memcmp(p, REC_MAGIC, 8) != 0) { return -1; }
+  meta = (size_t)get_le(p + 12, 4);
+  if (meta > size - REC_HDR_SIZE) { return -1; }
+  cmd_len = strnlen((const char *)p + REC_HDR_SIZE, meta);
+  if (cmd_len == meta) { return -1; }
+  term_len = strnlen((const char *)p + REC_HDR_SIZE + cmd_len + 1,
+                     meta - cmd_len - 1);
+  if (cmd_len + 1 + term_len == meta) { return -1; }
+
+  r->base = p;
+  r->size = size;
+  r->h.cols = (int)get_le(p + 8, 2);
+  r->h.rows = (int)get_le(p + 10, 2);
+  r->h.timestamp = (long long)get_le(p + 16, 8);
+  r->h.command = (cmd_len > 0) ? (const char *)p + REC_HDR_SIZE : NULL;
+  r->h.term = (term_len > 0) ? (const char *)p + REC_HDR_SIZE + cmd_len + 1
+                             : NULL;
+  r->pos = REC_HDR_SIZE + meta;
+  r->end = size;
+  if (size >= r->pos + REC_END_SIZE &&
+      memcmp(p + size - 8, REC_END_MAGIC, 8) == 0) {
+    r->end = size - REC_END_SIZE;
+    r->last_index = (size_t)get_le(p + r->end, 8);
+    if (r->last_index < r->pos || r->last_index >= r->end)
+      r->last_index = 0;
+  }
+  return 0;
+}  /* rec_reader_init */
+
+
+/*
+ * Decode the frame at *pos and move *pos past it; f gets its code and
+ * data, *delta its time step.  Returns 0 at the end (including a frame
+ * cut off by the end of the file), else 1.
+ */
+static int read_frame(const rec_reader *r, size_t *pos,
+                      unsigned long long *delta, rec_frame *f) {
+  unsigned long long len;
+  size_t p = *pos;
+
+  if (p >= r->end) { return 0; }
+  f->code = r->base[p++];
+  if (get_varint(r->base, &p, r->end, delta) < 0 ||
+      get_varint(r->base, &p, r->end, &len) < 0 ||
+      len > r->end - p) { return 0; }
+  f->data = (const char *)r->base + p;
+  f->len = (size_t)len;
+  *pos = p + (size_t)len;
+  return 1;
+}  /* read_frame */
+
+
+/*
+ * The next data frame (index frames are skipped).  Returns 1, or 0 at
+ * the end.
+ */
+int rec_reader_next(rec_reader *r, rec_frame *f) {
+  unsigned long long delta;
+
+  do {
+    if (!read_frame(r, &r->pos, &delta, f)) { return 0; }
+    if (r->t_exact)
+      r->t_exact = 0;
+    else
+      r->t_us += (long long)delta;
+  } while (f->code == REC_INDEX);
+  f->t_us = r->t_us;
+  return 1;
+}  /* rec_reader_next */
+
+
+/*
+ * Position r so rec_reader_next() returns the first frame at or after
+ * t_us.  Uses the index when the recording has one; otherwise (it was
+ * cut off) scans from the start.
+ */
+void rec_reader_seek(rec_reader *r, long long t_us) {
+  size_t at = r->last_index;
+  rec_frame f;
+
+  r->pos = REC_HDR_SIZE + (size_t)get_le(r->base + 12, 4);
+  r->t_us = 0;
+  r->t_exact = 0;
+
+  /* Walk the index frames back to the one covering t_us and start from
+   * its last entry at or before it. */
+  while (at != 0) {
+    unsigned long long delta;
+    size_t pos = at;
+    int i;
+    if (!read_frame(r, &pos, &delta, &f) || f.code != REC_INDEX ||
+        f.len < 8) break;
+    for (i = (int)((f.len - 8) / 16) - 1; i >= 0; i--) {
+      const unsigned char *e = (const unsigned char *)f.data + 8 + i * 16;
+      long long t = (long long)get_le(e, 8);
+      size_t off = (size_t)get_le(e + 8, 8);
+      if (t <= t_us && off < r->end) {
+        r->pos = off;
+        r->t_us = t;
+        r->t_exact = 1;
+        break;
+      }
+    }
+    if (i >= 0) break;
+    at = (size_t)get_le((const unsigned char *)f.data, 8);
+  }
+
+  /* Then frame by frame. */
+  for (;;) {
+    rec_reader save = *r;
+    if (!rec_reader_next(r, &f) || f.t_us >= t_us) {
+      *r = save;
+      return;
+    }
+  }
+}  /* rec_reader_seek */
+
+
+/*
+ * Write r's recording, from its current position on, to fp as
+ * asciicast with times made relative to from_us.  Returns -1 if
+ * writing failed.
+ */
+int rec_to_asciicast(rec_reader *r, FILE *fp, long long from_us) {
+  rec_writer w;
+  rec_utf8 scratch;
+  rec_frame f;
+  rec_out o;
+
+  memset(&w, 0, sizeof(w));
+  w.fp = fp;
+  cast_header(&w, &r->h);
+  while (rec_reader_next(r, &f)) {
+    long long t = (f.t_us > from_us) ? f.t_us - from_us : 0;
+    rec_utf8 *u = cast_begin(&w, &o, &scratch, t, f.code);
+    rec_json(&w, &o, u, f.data, f.len);
+    cast_end(&w, &o);
+  }
+  if (fflush(fp) != 0) w.failed = 1;
+  return w.failed ? -1 : 0;
+}  /* rec_to_asciicast */
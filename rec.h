@@ -0,0 +1,141 @@
+/* rec.h - Session recording.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Writes what a session did, with timing, in one of two formats:
+ *
+ *   asciicast v2 (https://docs.asciinema.org/manual/asciicast/v2/): a
+ *   JSON header line, then one [time, code, data] line per event.
+ *   What other tools read, but escaping roughly doubles the size of
+ *   output that isn't plain text.
+ *
+ *   binary: length-prefixed frames with delta timestamps, plus index
+ *   frames mapping each second of the session to a file offset, so a
+ *   reader can start at any point of a long session without scanning
+ *   up to it.  Layout below.
+ *
+ * The relay loop must never wait on the disk.  rec_event() only copies
+ * the event into a lock-free ring (spsc.h) and returns; a writer thread
+ * formats it and writes the file.  If the writer falls so far behind
+ * that the ring is full, the event is dropped, counted, and a marker
+ * ("m") event in the file says how much is missing there.
+ *
+ * One producer thread (the one calling rec_event()) per recorder.
+ *
+ * rec_reader reads a binary recording from memory (a mapped file), and
+ * rec_to_asciicast() converts one.
+ *
+ * Binary layout (integers little-endian, varints LEB128):
+ *   header   "MPTYREC\1", u16 cols, u16 rows, u32 meta_len,
+ *            i64 timestamp, then meta_len bytes: command NUL TERM NUL
+ *   frame    u8 code ('o' 'i' 'r' 'm' or 'x'), varint microseconds
+ *            since the previous frame, varint len, len bytes of data
+ *   index    an 'x' frame: u64 offset of the previous index frame (0:
+ *            none), then (u64 time, u64 offset) per entry: the first
+ *            frame at or after each second, its time since the start
+ *   trailer  u64 offset of the last index frame, "MPTYIDX\1"; missing
+ *            if the recording was cut off, and then readers scan
+ */
+
+#ifndef REC_H
+#define REC_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "spsc.h"
+
+/* Formats. */
+#define REC_ASCIICAST 0
+#define REC_BINARY    1
+
+/* Event codes, as in asciicast. */
+#define REC_OUTPUT 'o'
+#define REC_INPUT  'i'
+#define REC_RESIZE 'r'
+#define REC_MARKER 'm'
+#define REC_INDEX  'x'     /* binary only */
+
+#define REC_INDEX_US    1000000LL   /* an index entry per second */
+#define REC_INDEX_BLOCK 64          /* entries per index frame */
+
+typedef struct {
+  int cols, rows;
+  long long timestamp;     /* start, Unix seconds */
+  const char *command;     /* or NULL */
+  const char *term;        /* $TERM, or NULL */
+} rec_header;
+
+/* A code point split across events, per event code. */
+typedef struct {
+  unsigned char buf[4];
+  int have, need;
+} rec_utf8;
+
+typedef struct {
+  long long t_us;
+  unsigned long long offset;
+} rec_index_entry;
+
+typedef struct {
+  FILE *fp;
+  int format;
+  long long start_us;      /* event times are relative to this */
+  spsc_ring ring;
+  pthread_t thread;
+  int stop;                /* writer: drain and quit */
+  unsigned long long dropped;       /* bytes lost to a full ring */
+  unsigned long long drop_pending;  /* ... not yet marked in the file */
+  unsigned long long events;
+  int failed;              /* a write failed; the rest is discarded */
+
+  /* Writer thread only. */
+  rec_utf8 utf8[2];        /* asciicast: output, input */
+  unsigned long long offset;        /* binary: bytes written */
+  long long last_us;                /* ... time of the last frame */
+  long long index_due;              /* ... next index entry at or after */
+  unsigned long long index_prev;    /* ... last index frame, or 0 */
+  rec_index_entry index[REC_INDEX_BLOCK];
+  int n_index;
+} rec_writer;
+
+typedef struct {
+  int code;
+  long long t_us;          /* since the start */
+  const char *data;
+  size_t len;
+} rec_frame;
+
+typedef struct {
+  const unsigned char *base;        /* the whole file */
+  size_t size;
+  size_t end;              /* where frames stop */
+  size_t pos;              /* next frame */
+  long long t_us;          /* time of the frame before it */
+  int t_exact;             /* next frame is at t_us (after a seek) */
+  size_t last_index;       /* offset of the last index frame, or 0 */
+  rec_header h;
+} rec_reader;
+
+int rec_open(rec_writer *w, const char *path, int format,
+             const rec_header *h, long long start_us);
+void rec_event(rec_writer *w, long long now_us, int code,
+               const char *data, size_t len);
+int rec_close(rec_writer *w);
+
+int rec_reader_init(rec_reader *r, const void *base, size_t size);
+int rec_reader_next(rec_reader *r, rec_frame *f);
+void rec_reader_seek(rec_reader *r, long long t_us);
+int rec_to_asciicast(rec_reader *r, FILE *fp, long long from_us);
+
+#endif  /* REC_H */
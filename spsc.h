@@ -0,0 +1,196 @@
+/* spsc.h - Lock-free single-producer/single-consumer byte ring.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* One thread puts bytes in, another takes them out, with no locks:
+ * the producer only ever stores 'tail' and the consumer only ever
+ * stores 'head', each with release semantics after touching the data.
+ * The two indexes live on separate cache lines so the threads don't
+ * fight over one.
+ *
+ * A consumer with nothing to do can sleep on the ring's eventfd.  It
+ * announces that in 'sleeping' and re-checks the ring before blocking;
+ * the producer only pays for an eventfd write when the flag is set.
+ * The full fences on both sides make sure one of them sees the other.
+ * The producer can wait for space the same way (the roles reverse).
+ */
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct {
+  char *buf;
+  size_t size;                 /* power of 2 */
+  int efd;                     /* wakes whichever side is sleeping */
+  char pad0[SPSC_CACHE_LINE];
+  size_t head;                 /* consumer position (consumer writes) */
+  int cons_sleeping;
+  char pad1[SPSC_CACHE_LINE];
+  size_t tail;                 /* producer position (producer writes) */
+  int prod_sleeping;
+  char pad2[SPSC_CACHE_LINE];
+} spsc_ring;
+
+
+static inline int spsc_init(spsc_ring *r, size_t size) {
+  memset(r, 0, sizeof(*r));
+  r->buf = (char *)malloc(size);
+  if (r->buf == NULL) { return -1; }  /* Handle error. */
+  r->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (r->efd < 0) { free(r->buf); return -1; }  /* Handle error. */
+  r->size = size;
+  return 0;
+}  /* spsc_init */
+
+
+static inline void spsc_free(spsc_ring *r) {
+  free(r->buf);
+  if (r->efd >= 0) close(r->efd);
+  r->buf = NULL;
+  r->efd = -1;
+}  /* spsc_free */
+
+
+static inline void spsc_kick(spsc_ring *r) {
+  uint64_t one = 1;
+  ssize_t n = write(r->efd, &one, sizeof(one));
+  (void)n;
+}  /* spsc_kick */
+
+
+/*
+ * Producer: copy in as much of buf as fits.  Returns bytes taken.
+ */
+static inline size_t spsc_put(spsc_ring *r, const char *buf, size_t len) {
+  size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  size_t tail = r->tail;
+  size_t avail = r->size - (tail - head);
+  size_t off = tail & (r->size - 1);
+  size_t first;
+
+  if (len > avail) len = avail;
+  if (len == 0) { return 0; }
+
+  first = r->size - off;
+  if (first > len) first = len;
+  memcpy(r->buf + off, buf, first);
+  memcpy(r->buf, buf + first, len - first);
+  __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->cons_sleeping, __ATOMIC_RELAXED))
+    spsc_kick(r);
+  return len;
+}  /* spsc_put */
+
+
+/*
+ * Consumer: contiguous readable bytes; *len gets their length.
+ */
+static inline const char *spsc_peek(spsc_ring *r, size_t *len) {
+  size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  size_t off = r->head & (r->size - 1);
+  size_t used = tail - r->head;
+
+  *len = (r->size - off < used) ? r->size - off : used;
+  return r->buf + off;
+}  /* spsc_peek */
+
+
+/*
+ * Consumer: done with len bytes from spsc_peek().
+ */
+static inline void spsc_consume(spsc_ring *r, size_t len) {
+  __atomic_store_n(&r->head, r->head + len, __ATOMIC_RELEASE);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->prod_sleeping, __ATOMIC_RELAXED))
+    spsc_kick(r);
+}  /* spsc_consume */
+
+
+static inline size_t spsc_used(spsc_ring *r) {
+  return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}  /* spsc_used */
+
+
+/*
+ * Sleep until the ring changes or extra_fd (if >= 0) is readable, or
+ * timeout_ms passes.  'sleeping' is the caller's side flag and 'ready'
+ * is re-checked after announcing the sleep.  Returns the poll() result.
+ */
+static inline int spsc_sleep(spsc_ring *r, int *sleeping,
+                             int (*ready)(spsc_ring *), int extra_fd,
+                             int timeout_ms) {
+  struct pollfd pfd[2];
+  uint64_t junk;
+  int ret = 1;
+
+  __atomic_store_n(sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!ready(r)) {
+    pfd[0].fd = r->efd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = extra_fd;
+    pfd[1].events = POLLIN;
+    ret = poll(pfd, extra_fd >= 0 ? 2 : 1, timeout_ms);
+  }
+  __atomic_store_n(sleeping, 0, __ATOMIC_RELAXED);
+  while (read(r->efd, &junk, sizeof(junk)) > 0) {}
+  return ret;
+}  /* spsc_sleep */
+
+
+static inline int spsc_has_data(spsc_ring *r) {
+  return spsc_used(r) > 0;
+}  /* spsc_has_data */
+
+
+static inline int spsc_has_space(spsc_ring *r) {
+  return spsc_used(r) < r->size;
+}  /* spsc_has_space */
+
+
+/*
+ * Consumer: wait for data (or extra_fd, or the timeout).
+ */
+static inline int spsc_wait_data(spsc_ring *r, int extra_fd, int timeout_ms) {
+  return spsc_sleep(r, &r->cons_sleeping, spsc_has_data, extra_fd,
+                    timeout_ms);
+}  /* spsc_wait_data */
+
+
+/*
+ * Producer: put all of buf, waiting for the consumer to make room.
+ */
+static inline void spsc_put_all(spsc_ring *r, const char *buf, size_t len) {
+  while (len > 0) {
+    size_t n = spsc_put(r, buf, len);
+    buf += n;
+    len -= n;
+    if (len > 0)
+      spsc_sleep(r, &r->prod_sleeping, spsc_has_space, -1, -1);
+  }
+}  /* spsc_put_all */
+
+#endif  /* SPSC_H */
@@ -3,7 +3,7 @@
 
 ./bld.sh; if [ $? -ne 0 ]; then exit 1; fi
 
-rm -f tst.x tst.tmp tst.log
+rm -f tst.x tst.scr tst.tmp tst.log tst.out tst.rec tst.cast tst.cap tst.txt
 
 cat >tst.x <<__EOF__
 ihello:wq
@@ -13,4 +13,60 @@ __EOF__
 T="`cat tst.tmp`"
 if [ "$T" != "hello" ]; then echo "ERROR"; exit 1; fi
 
+# Same edit, driven by an expect script instead of blind input.
+rm -f tst.tmp
+cat >tst.scr <<__EOF__
+timeout 5
+expect "tst.tmp"
+send "ihello\\e:wq\\r"
+__EOF__
+./minpty --script=tst.scr vi tst.tmp >tst.log
+if [ $? -ne 0 ]; then echo "ERROR: script"; exit 1; fi
+
+T="`cat tst.tmp`"
+if [ "$T" != "hello" ]; then echo "ERROR: script"; exit 1; fi
+
+# A prompt matched by a regex, arriving in two reads.
+cat >tst.scr <<__EOF__
+timeout 5
+expect-re "pass[a-z]+: \$"
+send "secret\\r"
+expect "got secret"
+__EOF__
+./minpty --script=tst.scr sh -c 'printf pass; sleep 0.3; printf "word: "; read x; echo "got $x"' >tst.log
+if [ $? -ne 0 ]; then echo "ERROR: expect-re"; exit 1; fi
+
+# Record, then replay at full speed: the same bytes come out.
+./minpty --record=tst.rec --record-format=binary sh -c 'echo one; sleep 0.1; echo two' >tst.log
+./minpty --replay=tst.rec --speed=max >tst.out
+cmp -s tst.log tst.out; if [ $? -ne 0 ]; then echo "ERROR: replay"; exit 1; fi
+./minpty --to-asciicast=tst.rec >tst.cast
+if [ $? -ne 0 ]; then echo "ERROR: to-asciicast"; exit 1; fi
+grep -q '"version": 2' tst.cast; if [ $? -ne 0 ]; then echo "ERROR: to-asciicast"; exit 1; fi
+grep -q '"o", "two\\r\\n"' tst.cast; if [ $? -ne 0 ]; then echo "ERROR: to-asciicast"; exit 1; fi
+
+# A compressed capture decompresses to exactly what was relayed.
+./minpty --capture=tst.cap seq 1 20000 >tst.log
+./minpty --decompress=tst.cap >tst.out
+if [ $? -ne 0 ]; then echo "ERROR: capture"; exit 1; fi
+cmp -s tst.log tst.out; if [ $? -ne 0 ]; then echo "ERROR: capture"; exit 1; fi
+
+# Transcript of backspace, colors, CR and erase-in-line.
+./minpty --transcript=tst.txt printf 'abc\bX\n\033[31mred\033[0m\rR\n12345\033[3D\033[K\n' >tst.log
+printf 'abX\nRed\n12\n' >tst.out
+cmp -s tst.txt tst.out; if [ $? -ne 0 ]; then echo "ERROR: transcript"; exit 1; fi
+
+# Snapshot of a screen drawn with cursor moves.
+./minpty --snapshot=text printf '\033[2J\033[Hone\033[3;5Hthree\033[1;4H!' >tst.log
+head -3 tst.log >tst.txt
+printf 'one!\n\n    three\n' >tst.out
+cmp -s tst.txt tst.out; if [ $? -ne 0 ]; then echo "ERROR: snapshot"; exit 1; fi
+
+# Two hooks on the same text both run.
+rm -f tst.out
+./minpty --on="hello=echo A >>tst.out" --on="hello=echo B >>tst.out" sh -c 'echo hello; sleep 0.5' >tst.log
+sleep 1
+T="`sort tst.out | tr -d '\n'`"
+if [ "$T" != "AB" ]; then echo "ERROR: hooks"; exit 1; fi
+
 echo "Test passed"
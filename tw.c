@@ -0,0 +1,238 @@
+/* tw.c - Hierarchical timer wheel.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Four levels of 64 slots.  Level 0 holds timers due within 64 ticks,
+ * one slot per tick; level L holds those due within 64^(L+1) ticks, one
+ * slot per 64^L.  Each slot is a doubly linked list, so arm and cancel
+ * are a few pointer writes.  Whenever the tick crosses a level-L
+ * boundary, that level's slot for the new period is emptied into the
+ * levels below ("cascade"); so each timer moves at most three times.
+ *
+ * A bitmap per level says which slots are non-empty.  That lets
+ * tw_advance() jump over idle ticks instead of visiting each one, and
+ * lets tw_next() find the next tick with work (an expiry or a cascade)
+ * in a few instructions per level instead of walking timers.
+ *
+ * Timers further out than the wheel reaches are parked in the top
+ * level at its furthest slot and put back when they surface.
+ */
+
+#include <stddef.h>
+
+#include "tw.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_SPAN (1LL << (TW_BITS * TW_LEVELS))   /* ticks the wheel covers */
+
+
+void tw_init(tw_wheel *w, long long now_us) {
+  int l, i;
+
+  for (l = 0; l < TW_LEVELS; l++) {
+    for (i = 0; i < TW_SLOTS; i++)
+      w->slot[l][i] = NULL;
+    w->occupied[l] = 0;
+  }
+  w->tick = 0;
+  w->base_us = now_us;
+  w->n_armed = 0;
+}  /* tw_init */
+
+
+void tw_timer_init(tw_timer *t, void (*fn)(void *), void *arg) {
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->slot = 0;
+  t->fn = fn;
+  t->arg = arg;
+}  /* tw_timer_init */
+
+
+/*
+ * Link t into the slot for its expiry, relative to w->tick.
+ */
+static void place(tw_wheel *w, tw_timer *t) {
+  long long exp = t->expires, delta;
+  tw_timer **head;
+  int l, i;
+
+  if (exp < w->tick) exp = w->tick;
+  delta = exp - w->tick;
+  if (delta >= TW_SPAN) {
+    exp = w->tick + TW_SPAN - 1;
+    delta = TW_SPAN - 1;
+  }
+  for (l = 0; l < TW_LEVELS - 1; l++)
+    if (delta < (1LL << (TW_BITS * (l + 1)))) break;
+  i = (int)((exp >> (TW_BITS * l)) & TW_MASK);
+
+  head = &w->slot[l][i];
+  t->next = *head;
+  if (t->next != NULL) t->next->pprev = &t->next;
+  *head = t;
+  t->pprev = head;
+  t->slot = l * TW_SLOTS + i;
+  w->occupied[l] |= 1ULL << i;
+  w->n_armed++;
+}  /* place */
+
+
+/*
+ * Unlink t from its slot (or from a list being run; then its slot may
+ * already be empty or reused, and the check below is still right).
+ */
+static void unlink_timer(tw_wheel *w, tw_timer *t) {
+  int l = t->slot / TW_SLOTS, i = t->slot % TW_SLOTS;
+
+  *t->pprev = t->next;
+  if (t->next != NULL) t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
+  w->n_armed--;
+  if (w->slot[l][i] == NULL)
+    w->occupied[l] &= ~(1ULL << i);
+}  /* unlink_timer */
+
+
+/*
+ * (Re)arm t to fire at when_us (absolute, same clock as tw_init()).
+ */
+void tw_arm(tw_wheel *w, tw_timer *t, long long when_us) {
+  long long rel = when_us - w->base_us;
+
+  if (tw_armed(t)) unlink_timer(w, t);
+  /* Round up: never fire early. */
+  t->expires = (rel <= 0) ? 0 : (rel + TW_TICK_US - 1) / TW_TICK_US;
+  place(w, t);
+}  /* tw_arm */
+
+
+void tw_cancel(tw_wheel *w, tw_timer *t) {
+  if (tw_armed(t)) unlink_timer(w, t);
+}  /* tw_cancel */
+
+
+/*
+ * Take a slot's whole list off the wheel.  It's re-headed on a local
+ * so that a callback can still cancel any timer on it.
+ */
+static tw_timer *take_slot(tw_wheel *w, int l, int i, tw_timer **list) {
+  *list = w->slot[l][i];
+  w->slot[l][i] = NULL;
+  w->occupied[l] &= ~(1ULL << i);
+  if (*list != NULL) (*list)->pprev = list;
+  return *list;
+}  /* take_slot */
+
+
+static tw_timer *pop(tw_wheel *w, tw_timer **list) {
+  tw_timer *t = *list;
+
+  *list = t->next;
+  if (*list != NULL) (*list)->pprev = list;
+  t->next = NULL;
+  t->pprev = NULL;
+  w->n_armed--;
+  return t;
+}  /* pop */
+
+
+/*
+ * Run tick w->tick: cascade at level boundaries, then fire what's due.
+ */
+static void run_tick(tw_wheel *w) {
+  long long cur = w->tick;
+  tw_timer *list;
+  int l;
+
+  for (l = 1; l < TW_LEVELS; l++) {
+    if ((cur & ((1LL << (TW_BITS * l)) - 1)) != 0) break;
+    take_slot(w, l, (int)((cur >> (TW_BITS * l)) & TW_MASK), &list);
+    while (list != NULL)
+      place(w, pop(w, &list));
+  }
+
+  /* Anything armed by a callback from here on counts from the next
+   * tick, so it can't land back on the list being fired. */
+  w->tick = cur + 1;
+  take_slot(w, 0, (int)(cur & TW_MASK), &list);
+  while (list != NULL) {
+    tw_timer *t = pop(w, &list);
+    if (t->expires > cur)
+      place(w, t);  /* parked beyond the wheel's reach */
+    else
+      t->fn(t->arg);
+  }
+}  /* run_tick */
+
+
+/*
+ * Fire every timer due by now_us.
+ */
+void tw_advance(tw_wheel *w, long long now_us) {
+  long long now = (now_us - w->base_us) / TW_TICK_US;
+
+  while (w->tick <= now) {
+    long long cur = w->tick;
+    int i = (int)(cur & TW_MASK);
+
+    if (w->n_armed == 0) {
+      w->tick = now + 1;
+      break;
+    }
+    /* Between level boundaries only level 0 matters: skip its empty
+     * slots. */
+    if (i != 0) {
+      uint64_t m = w->occupied[0] >> i;
+      long long next = (m == 0) ? (cur | TW_MASK) + 1
+                                : cur + __builtin_ctzll(m);
+      if (next > cur) {
+        w->tick = (next <= now) ? next : now + 1;
+        continue;
+      }
+    }
+    run_tick(w);
+  }
+}  /* tw_advance */
+
+
+/*
+ * When tw_advance() next has work (absolute us), or -1 if nothing is
+ * armed.  That may be a cascade rather than an expiry, so the caller
+ * can wake up for nothing, but at most once per non-empty slot.
+ */
+long long tw_next(const tw_wheel *w) {
+  long long best = -1;
+  int l;
+
+  if (w->n_armed == 0) { return -1; }
+
+  for (l = 0; l < TW_LEVELS; l++) {
+    int shift = TW_BITS * l;
+    uint64_t occ = w->occupied[l], rot;
+    long long b0;
+    int r;
+
+    if (occ == 0) continue;
+    /* First period at this level that hasn't been run yet. */
+    b0 = (w->tick >> shift) +
+         ((w->tick & ((1LL << shift) - 1)) != 0 ? 1 : 0);
+    r = (int)(b0 & TW_MASK);
+    rot = (r == 0) ? occ : ((occ >> r) | (occ << (TW_SLOTS - r)));
+    b0 = (b0 + __builtin_ctzll(rot)) << shift;
+    if (best < 0 || b0 < best)
+      best = b0;
+  }
+  return w->base_us + best * TW_TICK_US;
+}  /* tw_next */
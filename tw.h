@@ -0,0 +1,57 @@
+/* tw.h - Hierarchical timer wheel.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Timers for thousands of sessions, where arming, re-arming and
+ * cancelling are all O(1) and the loop finds out how long it may
+ * sleep without looking at every timer.  Resolution is TW_TICK_US;
+ * a timer never fires early, and fires within a tick of its time once
+ * the loop calls tw_advance().  Not thread-safe.
+ */
+
+#ifndef TW_H
+#define TW_H
+
+#include <stdint.h>
+
+#define TW_TICK_US 1000     /* 1 ms */
+#define TW_BITS    6
+#define TW_SLOTS   (1 << TW_BITS)
+#define TW_LEVELS  4        /* 64^4 ticks: about 4.6 hours */
+
+typedef struct tw_timer tw_timer;
+struct tw_timer {
+  tw_timer *next, **pprev;    /* pprev NULL: not armed */
+  long long expires;          /* tick */
+  int slot;                   /* level * TW_SLOTS + index, when armed */
+  void (*fn)(void *arg);
+  void *arg;
+};
+
+typedef struct {
+  tw_timer *slot[TW_LEVELS][TW_SLOTS];
+  uint64_t occupied[TW_LEVELS];   /* non-empty slots */
+  long long tick;                 /* next tick to run */
+  long long base_us;              /* time of tick 0 */
+  int n_armed;
+} tw_wheel;
+
+void tw_init(tw_wheel *w, long long now_us);
+void tw_timer_init(tw_timer *t, void (*fn)(void *), void *arg);
+void tw_arm(tw_wheel *w, tw_timer *t, long long when_us);
+void tw_cancel(tw_wheel *w, tw_timer *t);
+void tw_advance(tw_wheel *w, long long now_us);
+long long tw_next(const tw_wheel *w);
+
+#define tw_armed(t) ((t)->pprev != NULL)
+
+#endif  /* TW_H */
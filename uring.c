@@ -0,0 +1,283 @@
+/* uring.c - Minimal io_uring plumbing for minpty's uring engine.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* The kernel and we share the SQ and CQ rings through mmap().  The
+ * producer of each ring publishes its tail with a release store and
+ * the consumer reads it with an acquire load; that's the only
+ * synchronization needed.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}  /* sys_setup */
+
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                      flags, NULL, 0);
+}  /* sys_enter */
+
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nr) {
+  return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}  /* sys_register */
+
+
+/*
+ * Create a ring with room for at least 'entries' SQEs and map it.
+ * Returns 0 on success, -1 (errno set) if the kernel has no io_uring
+ * or won't let us use it.
+ */
+int uring_init(uring *r, unsigned entries) {
+  struct io_uring_params p;
+
+  memset(r, 0, sizeof(*r));
+  memset(&p, 0, sizeof(p));
+
+  r->fd = sys_setup(entries, &p);
+  if (r->fd < 0) { return -1; }  /* Handle error. */
+
+  /* Older kernels need the SQ and CQ rings mapped separately. */
+  r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_map_len > r->sq_map_len) r->sq_map_len = r->cq_map_len;
+    r->cq_map_len = r->sq_map_len;
+  }
+
+  r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED) { goto fail; }  /* Handle error. */
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_map = r->sq_map;
+  } else {
+    r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_map == MAP_FAILED) { goto fail; }  /* Handle error. */
+  }
+
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) { goto fail; }  /* Handle error. */
+
+  r->sq_entries = p.sq_entries;
+  r->sq_head  = (unsigned *)((char *)r->sq_map + p.sq_off.head);
+  r->sq_tail  = (unsigned *)((char *)r->sq_map + p.sq_off.tail);
+  r->sq_mask  = (unsigned *)((char *)r->sq_map + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)((char *)r->sq_map + p.sq_off.array);
+  r->cq_head  = (unsigned *)((char *)r->cq_map + p.cq_off.head);
+  r->cq_tail  = (unsigned *)((char *)r->cq_map + p.cq_off.tail);
+  r->cq_mask  = (unsigned *)((char *)r->cq_map + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->cq_map + p.cq_off.cqes);
+  r->sq_local_tail = *r->sq_tail;
+
+  return 0;
+
+ fail:
+  uring_exit(r);
+  return -1;
+}  /* uring_init */
+
+
+void uring_exit(uring *r) {
+  if (r->sqes != NULL && r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqes_len);
+  if (r->cq_map != NULL && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+    munmap(r->cq_map, r->cq_map_len);
+  if (r->sq_map != NULL && r->sq_map != MAP_FAILED)
+    munmap(r->sq_map, r->sq_map_len);
+  if (r->fd >= 0)
+    close(r->fd);
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+}  /* uring_exit */
+
+
+/*
+ * Ask the kernel whether it implements opcode 'op'.
+ */
+int uring_op_supported(uring *r, int op) {
+  size_t len = sizeof(struct io_uring_probe) +
+               256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, len);
+  int ok = 0;
+
+  if (probe == NULL) { return 0; }
+
+  if (sys_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+      op <= probe->last_op && op < probe->ops_len) {
+    ok = (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+  }
+
+  free(probe);
+  return ok;
+}  /* uring_op_supported */
+
+
+/*
+ * Hand out the next free SQE, zeroed.  If the SQ is full, what's
+ * queued is submitted first to make room.
+ */
+struct io_uring_sqe *uring_get_sqe(uring *r) {
+  struct io_uring_sqe *sqe;
+
+  if (r->sq_local_tail - LOAD_ACQUIRE(r->sq_head) >= r->sq_entries) {
+    uring_submit_and_wait(r, 0);
+    if (r->sq_local_tail - LOAD_ACQUIRE(r->sq_head) >= r->sq_entries) {
+      return NULL;
+    }
+  }
+
+  sqe = &r->sqes[r->sq_local_tail & *r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[r->sq_local_tail & *r->sq_mask] = r->sq_local_tail & *r->sq_mask;
+  r->sq_local_tail++;
+  return sqe;
+}  /* uring_get_sqe */
+
+
+/*
+ * How many SQEs uring_get_sqe() can hand out before it has to submit.
+ */
+unsigned uring_sq_space(uring *r) {
+  return r->sq_entries - (r->sq_local_tail - LOAD_ACQUIRE(r->sq_head));
+}  /* uring_sq_space */
+
+
+/*
+ * Publish all SQEs handed out since the last call and, in the same
+ * syscall, wait for at least wait_nr completions.
+ */
+int uring_submit_and_wait(uring *r, unsigned wait_nr) {
+  unsigned to_submit = r->sq_local_tail - *r->sq_tail;
+  int ret;
+
+  STORE_RELEASE(r->sq_tail, r->sq_local_tail);
+
+  if (to_submit == 0 && wait_nr == 0) { return 0; }
+
+  do {
+    ret = sys_enter(r->fd, to_submit, wait_nr,
+                    wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+  } while (ret < 0 && errno == EINTR && wait_nr == 0);
+
+  return ret;
+}  /* uring_submit_and_wait */
+
+
+/*
+ * Next completion, or NULL if there is none yet.  Call uring_cqe_seen()
+ * once done with it.
+ */
+struct io_uring_cqe *uring_peek_cqe(uring *r) {
+  unsigned head = *r->cq_head;
+
+  if (head == LOAD_ACQUIRE(r->cq_tail)) { return NULL; }
+  return &r->cqes[head & *r->cq_mask];
+}  /* uring_peek_cqe */
+
+
+void uring_cqe_seen(uring *r) {
+  STORE_RELEASE(r->cq_head, *r->cq_head + 1);
+}  /* uring_cqe_seen */
+
+
+/*
+ * Register [base, base+len) as fixed buffer 0, so READ_FIXED and
+ * WRITE_FIXED on it skip the per-I/O page pinning.
+ */
+int uring_register_buffer(uring *r, void *base, size_t len) {
+  struct iovec iov;
+
+  iov.iov_base = base;
+  iov.iov_len  = len;
+  return sys_register(r->fd, IORING_REGISTER_BUFFERS, &iov, 1);
+}  /* uring_register_buffer */
+
+
+/*
+ * Create and register a provided buffer ring with 'entries' slots
+ * (must be a power of 2) as buffer group 'bgid'.  It starts empty;
+ * fill it with uring_bufring_add().
+ */
+int uring_bufring_init(uring *r, uring_bufring *b, uint16_t bgid,
+                       unsigned entries) {
+  struct io_uring_buf_reg reg;
+  size_t len = entries * sizeof(struct io_uring_buf);
+  void *mem;
+
+  memset(b, 0, sizeof(*b));
+  mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) { return -1; }  /* Handle error. */
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr    = (uint64_t)(uintptr_t)mem;
+  reg.ring_entries = entries;
+  reg.bgid         = bgid;
+  if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    munmap(mem, len);
+    return -1;
+  }
+
+  b->br      = (struct io_uring_buf_ring *)mem;
+  b->entries = entries;
+  b->bgid    = bgid;
+  return 0;
+}  /* uring_bufring_init */
+
+
+void uring_bufring_free(uring *r, uring_bufring *b) {
+  struct io_uring_buf_reg reg;
+
+  if (b->br == NULL) { return; }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = b->bgid;
+  sys_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  munmap(b->br, b->entries * sizeof(struct io_uring_buf));
+  b->br = NULL;
+}  /* uring_bufring_free */
+
+
+/*
+ * Give buffer 'bid' back to the kernel for buffer-select reads.
+ */
+void uring_bufring_add(uring_bufring *b, void *addr, unsigned len,
+                       uint16_t bid) {
+  uint16_t tail = b->br->tail;
+  struct io_uring_buf *buf = &b->br->bufs[tail & (b->entries - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t)addr;
+  buf->len  = len;
+  buf->bid  = bid;
+  STORE_RELEASE(&b->br->tail, (uint16_t)(tail + 1));
+}  /* uring_bufring_add */
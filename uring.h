@@ -0,0 +1,67 @@
+/* uring.h - Minimal io_uring plumbing for minpty's uring engine.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Talks to the kernel with raw syscalls so there's no liburing
+ * dependency.  Only what minpty needs is here: ring setup, SQE/CQE
+ * access, opcode probing, one registered (fixed) buffer region, and
+ * provided buffer rings for buffer-select reads.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Added in Linux 6.7; older headers don't name it. */
+#ifndef IORING_OP_READ_MULTISHOT
+#define IORING_OP_READ_MULTISHOT 49
+#endif
+
+typedef struct {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_local_tail;   /* SQEs handed out, not yet published */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_map_len, cq_map_len, sqes_len;
+} uring;
+
+/* A provided buffer ring: the kernel picks a buffer from it for each
+ * IOSQE_BUFFER_SELECT read and reports the buffer id in the CQE. */
+typedef struct {
+  struct io_uring_buf_ring *br;
+  unsigned entries;
+  uint16_t bgid;
+} uring_bufring;
+
+int uring_init(uring *r, unsigned entries);
+void uring_exit(uring *r);
+int uring_op_supported(uring *r, int op);
+struct io_uring_sqe *uring_get_sqe(uring *r);
+unsigned uring_sq_space(uring *r);
+int uring_submit_and_wait(uring *r, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(uring *r);
+void uring_cqe_seen(uring *r);
+int uring_register_buffer(uring *r, void *base, size_t len);
+int uring_bufring_init(uring *r, uring_bufring *b, uint16_t bgid,
+                       unsigned entries);
+void uring_bufring_free(uring *r, uring_bufring *b);
+void uring_bufring_add(uring_bufring *b, void *addr, unsigned len,
+                       uint16_t bid);
+
+#endif  /* URING_H */
@@ -0,0 +1,420 @@
+/* vtparse.c - Streaming VT/ECMA-48 parser.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* The transition table is [state][byte] -> (action << 4 | next state),
+ * one byte per entry.  It is written as a rule per state (the T_*
+ * macros, which read like the vt100.net diagram) and expanded by the
+ * preprocessor into 256 constant entries per state, so the compiler
+ * builds it and there is no init step or generator to keep in sync.
+ * Next state S_STAY means no transition (no exit/entry actions).
+ *
+ * Two tables: UTF-8 (the default) treats bytes 0x80-0xFF as text, which
+ * is what every current terminal does; C1 mode follows the DEC model,
+ * where 0x80-0x9F are C1 controls (0x9B is CSI, and so on) and
+ * 0xA0-0xFF act like their 7-bit counterparts.
+ *
+ * Departures from the original diagram, all matching xterm: BEL ends an
+ * OSC string; DEL in ground is ignored rather than printed; ':' is
+ * accepted as a sub-parameter separator (SGR 38:2:r:g:b) instead of
+ * sending the sequence to csi_ignore.  SS2/SS3 (ESC N / ESC O) are plain
+ * ESC dispatches; the byte after them is text.
+ *
+ * Text, DCS data and OSC bytes come in runs: the feed loop looks ahead
+ * while the table keeps giving the same action, so a screenful of plain
+ * text is one PRINT event, not one per byte.
+ */
+
+#include <string.h>
+
+#include "vtparse.h"
+
+/* States. */
+#define S_GROUND     0
+#define S_ESC        1
+#define S_ESC_INTER  2
+#define S_CSI_ENTRY  3
+#define S_CSI_PARAM  4
+#define S_CSI_INTER  5
+#define S_CSI_IGNORE 6
+#define S_DCS_ENTRY  7
+#define S_DCS_PARAM  8
+#define S_DCS_INTER  9
+#define S_DCS_PASS   10
+#define S_DCS_IGNORE 11
+#define S_OSC        12
+#define S_SOS        13   /* SOS, PM, APC: swallowed */
+#define S_N          14
+#define S_STAY       15
+
+/* Actions. */
+#define A_NONE    0
+#define A_PRINT   1
+#define A_EXECUTE 2
+#define A_COLLECT 3
+#define A_PARAM   4
+#define A_ESC     5
+#define A_CSI     6
+#define A_PUT     7
+#define A_OSC_PUT 8
+
+#define PARAM_LIMIT 65535
+
+/* ---- Table rules ------------------------------------------------------- */
+
+#define TR(a, s) (((a) << 4) | (s))
+#define IN(c, lo, hi) ((c) >= (lo) && (c) <= (hi))
+#define IS_C0(c) (IN(c, 0x00, 0x17) || (c) == 0x19 || IN(c, 0x1C, 0x1F))
+#define IS_INTER(c) IN(c, 0x20, 0x2F)
+#define IS_PARAM(c) (IN(c, 0x30, 0x3B))          /* digits ':' ';' */
+#define IS_PRIV(c) IN(c, 0x3C, 0x3F)
+#define IS_FINAL(c) IN(c, 0x40, 0x7E)
+
+/* Transitions from any state; -1 if c isn't one. */
+#define T_ANY(c, c1) \
+  ((c) == 0x18 || (c) == 0x1A ? TR(A_EXECUTE, S_GROUND) : \
+   (c) == 0x1B ? TR(A_NONE, S_ESC) : \
+   !(c1) || !IN(c, 0x80, 0x9F) ? -1 : \
+   (c) == 0x90 ? TR(A_NONE, S_DCS_ENTRY) : \
+   (c) == 0x9B ? TR(A_NONE, S_CSI_ENTRY) : \
+   (c) == 0x9C ? TR(A_NONE, S_GROUND) : \
+   (c) == 0x9D ? TR(A_NONE, S_OSC) : \
+   (c) == 0x98 || (c) == 0x9E || (c) == 0x9F ? TR(A_NONE, S_SOS) : \
+   TR(A_EXECUTE, S_GROUND))
+
+/* Per-state rules for a 7-bit byte g. */
+#define T_GROUND(g) \
+  (IS_C0(g) ? TR(A_EXECUTE, S_STAY) : \
+   (g) == 0x7F ? TR(A_NONE, S_STAY) : TR(A_PRINT, S_STAY))
+
+#define T_ESC(g) \
+  (IS_C0(g) ? TR(A_EXECUTE, S_STAY) : \
+   (g) == 0x7F ? TR(A_NONE, S_STAY) : \
+   IS_INTER(g) ? TR(A_COLLECT, S_ESC_INTER) : \
+   (g) == 'P' ? TR(A_NONE, S_DCS_ENTRY) : \
+   (g) == '[' ? TR(A_NONE, S_CSI_ENTRY) : \
+   (g) == ']' ? TR(A_NONE, S_OSC) : \
+   (g) == 'X' || (g) == '^' || (g) == '_' ? TR(A_NONE, S_SOS) : \
+   TR(A_ESC, S_GROUND))
+
+#define T_ESC_INTER(g) \
+  (IS_C0(g) ? TR(A_EXECUTE, S_STAY) : \
+   (g) == 0x7F ? TR(A_NONE, S_STAY) : \
+   IS_INTER(g) ? TR(A_COLLECT, S_STAY) : TR(A_ESC, S_GROUND))
+
+#define T_CSI_ENTRY(g) \
+  (IS_C0(g) ? TR(A_EXECUTE, S_STAY) : \
+   (g) == 0x7F ? TR(A_NONE, S_STAY) : \
+   IS_INTER(g) ? TR(A_COLLECT, S_CSI_INTER) : \
+   IS_PARAM(g) ? TR(A_PARAM, S_CSI_PARAM) : \
+   IS_PRIV(g) ? TR(A_COLLECT, S_CSI_PARAM) : TR(A_CSI, S_GROUND))
+
+#define T_CSI_PARAM(g) \
+  (IS_C0(g) ? TR(A_EXECUTE, S_STAY) : \
+   (g) == 0x7F ? TR(A_NONE, S_STAY) : \
+   IS_INTER(g) ? TR(A_COLLECT, S_CSI_INTER) : \
+   IS_PARAM(g) ? TR(A_PARAM, S_STAY) : \
+   IS_PRIV(g) ? TR(A_NONE, S_CSI_IGNORE) : TR(A_CSI, S_GROUND))
+
+#define T_CSI_INTER(g) \
+  (IS_C0(g) ? TR(A_EXECUTE, S_STAY) : \
+   (g) == 0x7F ? TR(A_NONE, S_STAY) : \
+   IS_INTER(g) ? TR(A_COLLECT, S_STAY) : \
+   IN(g, 0x30, 0x3F) ? TR(A_NONE, S_CSI_IGNORE) : TR(A_CSI, S_GROUND))
+
+#define T_CSI_IGNORE(g) \
+  (IS_C0(g) ? TR(A_EXECUTE, S_STAY) : \
+   IS_FINAL(g) ? TR(A_NONE, S_GROUND) : TR(A_NONE, S_STAY))
+
+#define T_DCS_ENTRY(g) \
+  (IS_C0(g) || (g) == 0x7F ? TR(A_NONE, S_STAY) : \
+   IS_INTER(g) ? TR(A_COLLECT, S_DCS_INTER) : \
+   IS_PARAM(g) ? TR(A_PARAM, S_DCS_PARAM) : \
+   IS_PRIV(g) ? TR(A_COLLECT, S_DCS_PARAM) : TR(A_NONE, S_DCS_PASS))
+
+#define T_DCS_PARAM(g) \
+  (IS_C0(g) || (g) == 0x7F ? TR(A_NONE, S_STAY) : \
+   IS_INTER(g) ? TR(A_COLLECT, S_DCS_INTER) : \
+   IS_PARAM(g) ? TR(A_PARAM, S_STAY) : \
+   IS_PRIV(g) ? TR(A_NONE, S_DCS_IGNORE) : TR(A_NONE, S_DCS_PASS))
+
+#define T_DCS_INTER(g) \
+  (IS_C0(g) || (g) == 0x7F ? TR(A_NONE, S_STAY) : \
+   IS_INTER(g) ? TR(A_COLLECT, S_STAY) : \
+   IN(g, 0x30, 0x3F) ? TR(A_NONE, S_DCS_IGNORE) : TR(A_NONE, S_DCS_PASS))
+
+#define T_DCS_PASS(g) \
+  ((g) == 0x7F ? TR(A_NONE, S_STAY) : TR(A_PUT, S_STAY))
+
+#define T_DCS_IGNORE(g) TR(A_NONE, S_STAY)
+
+#define T_OSC(g) \
+  ((g) == 0x07 ? TR(A_NONE, S_GROUND) : \
+   IS_C0(g) ? TR(A_NONE, S_STAY) : TR(A_OSC_PUT, S_STAY))
+
+#define T_SOS(g) TR(A_NONE, S_STAY)
+
+/* What a UTF-8 byte (0x80-0xFF) does in each state: data where there
+ * is data to collect, ignored elsewhere. */
+#define T_HI_GROUND     TR(A_PRINT, S_STAY)
+#define T_HI_DCS_PASS   TR(A_PUT, S_STAY)
+#define T_HI_OSC        TR(A_OSC_PUT, S_STAY)
+#define T_HI_ESC        TR(A_NONE, S_STAY)
+#define T_HI_ESC_INTER  T_HI_ESC
+#define T_HI_CSI_ENTRY  T_HI_ESC
+#define T_HI_CSI_PARAM  T_HI_ESC
+#define T_HI_CSI_INTER  T_HI_ESC
+#define T_HI_CSI_IGNORE T_HI_ESC
+#define T_HI_DCS_ENTRY  T_HI_ESC
+#define T_HI_DCS_PARAM  T_HI_ESC
+#define T_HI_DCS_INTER  T_HI_ESC
+#define T_HI_DCS_IGNORE T_HI_ESC
+#define T_HI_SOS        T_HI_ESC
+
+/* Full entry for state ST, byte c. */
+#define ENTRY(ST, c, c1) (unsigned char)( \
+  T_ANY(c, c1) >= 0 ? T_ANY(c, c1) : \
+  (c) < 0x80 ? T_##ST(c) : \
+  (c1) ? T_##ST((c) - 0x80) : T_HI_##ST)
+
+#define E4(ST, c1, b) \
+  ENTRY(ST, (b), c1), ENTRY(ST, (b) + 1, c1), \
+  ENTRY(ST, (b) + 2, c1), ENTRY(ST, (b) + 3, c1)
+#define E16(ST, c1, b) \
+  E4(ST, c1, b), E4(ST, c1, (b) + 4), \
+  E4(ST, c1, (b) + 8), E4(ST, c1, (b) + 12)
+#define E64(ST, c1, b) \
+  E16(ST, c1, b), E16(ST, c1, (b) + 16), \
+  E16(ST, c1, (b) + 32), E16(ST, c1, (b) + 48)
+#define ROW(ST, c1) { \
+  E64(ST, c1, 0), E64(ST, c1, 64), E64(ST, c1, 128), E64(ST, c1, 192) }
+
+#define TABLE(c1) { \
+  ROW(GROUND, c1), ROW(ESC, c1), ROW(ESC_INTER, c1), \
+  ROW(CSI_ENTRY, c1), ROW(CSI_PARAM, c1), ROW(CSI_INTER, c1), \
+  ROW(CSI_IGNORE, c1), ROW(DCS_ENTRY, c1), ROW(DCS_PARAM, c1), \
+  ROW(DCS_INTER, c1), ROW(DCS_PASS, c1), ROW(DCS_IGNORE, c1), \
+  ROW(OSC, c1), ROW(SOS, c1) }
+
+static const unsigned char g_table[2][S_N][256] = { TABLE(0), TABLE(1) };
+
+
+/* ---- Parser ------------------------------------------------------------ */
+
+void vtp_init(vtp_parser *p, int c1) {
+  memset(p, 0, sizeof(*p));
+  p->state = S_GROUND;
+  p->c1 = (c1 != 0);
+}  /* vtp_init */
+
+
+int vtp_in_ground(const vtp_parser *p) {
+  return p->state == S_GROUND;
+}  /* vtp_in_ground */
+
+
+/*
+ * Parameter i of a CSI/DCS event, or def if it is missing or 0 (the
+ * usual "0 means default" rule).
+ */
+int vtp_param(const vtp_event *ev, int i, int def) {
+  if (i >= ev->n_params || ev->params[i] == 0) { return def; }
+  return ev->params[i];
+}  /* vtp_param */
+
+
+static void clear(vtp_parser *p) {
+  p->prefix = 0;
+  p->n_inter = 0;
+  p->overflow = 0;
+  p->n_params = 0;
+  p->drop = 0;
+  p->sub = 0;
+}  /* clear */
+
+
+static void collect(vtp_parser *p, unsigned char c) {
+  /* A private marker can only come first (the table sends a later one
+   * to the ignore state). */
+  if (IS_PRIV(c) && p->n_inter == 0 && p->prefix == 0) {
+    p->prefix = c;
+  } else if (p->n_inter < VTP_INTER_MAX) {
+    p->inter[p->n_inter++] = c;
+  } else {
+    p->overflow = 1;
+  }
+}  /* collect */
+
+
+static void param(vtp_parser *p, unsigned char c) {
+  if (p->n_params == 0) {
+    p->params[0] = 0;
+    p->n_params = 1;
+  }
+  if (c == ';' || c == ':') {
+    if (p->n_params < VTP_PARAM_MAX) {
+      if (c == ':') p->sub |= 1u << p->n_params;
+      p->params[p->n_params++] = 0;
+    } else {
+      p->drop = 1;
+    }
+  } else if (!p->drop) {
+    int *v = &p->params[p->n_params - 1];
+    *v = *v * 10 + (c - '0');
+    if (*v > PARAM_LIMIT) *v = PARAM_LIMIT;
+  }
+}  /* param */
+
+
+static void event_init(vtp_event *ev, const vtp_parser *p, int type) {
+  ev->type = type;
+  ev->data = NULL;
+  ev->len = 0;
+  ev->final = 0;
+  ev->prefix = p->prefix;
+  ev->inter = p->inter;
+  ev->n_inter = p->n_inter;
+  ev->params = p->params;
+  ev->n_params = p->n_params;
+  ev->sub = p->sub;
+}  /* event_init */
+
+
+static void emit(const vtp_parser *p, int type, unsigned char final,
+                 const char *data, size_t len, vtp_event_fn cb, void *arg) {
+  vtp_event ev;
+
+  event_init(&ev, p, type);
+  ev.final = final;
+  ev.data = data;
+  ev.len = len;
+  cb(arg, &ev);
+}  /* emit */
+
+
+static void leave_state(vtp_parser *p, vtp_event_fn cb, void *arg) {
+  if (p->state == S_OSC)
+    emit(p, VTP_OSC, 0, p->osc, p->osc_len, cb, arg);
+  else if (p->state == S_DCS_PASS)
+    emit(p, VTP_DCS_UNHOOK, 0, NULL, 0, cb, arg);
+}  /* leave_state */
+
+
+static void enter_state(vtp_parser *p, unsigned char c,
+                        vtp_event_fn cb, void *arg) {
+  switch (p->state) {
+  case S_ESC: case S_CSI_ENTRY: case S_DCS_ENTRY:
+    clear(p);
+    break;
+  case S_OSC:
+    p->osc_len = 0;
+    break;
+  case S_DCS_PASS:
+    /* Too many intermediates: the data still has to be skipped, but
+     * nobody is told about it. */
+    if (p->overflow)
+      p->state = S_DCS_IGNORE;
+    else
+      emit(p, VTP_DCS_HOOK, c, NULL, 0, cb, arg);
+    break;
+  }
+}  /* enter_state */
+
+
+/*
+ * The feed loop.  With stop_at_ground, return as soon as a sequence
+ * ends (the parser is back in ground) instead of going on with the
+ * text after it.  Returns bytes consumed.
+ */
+static size_t feed(vtp_parser *p, const char *buf, size_t len,
+                   vtp_event_fn cb, void *arg, int stop_at_ground) {
+  const unsigned char (*tab)[256] = g_table[p->c1];
+  const unsigned char *u = (const unsigned char *)buf;
+  size_t i = 0;
+
+  while (i < len) {
+    unsigned char c = u[i];
+    unsigned char t = tab[p->state][c];
+    int action = t >> 4, next = t & 0x0F;
+    size_t j;
+
+    switch (action) {
+    case A_PRINT:
+    case A_PUT:
+    case A_OSC_PUT:
+      /* These never change state; take the whole run. */
+      for (j = i + 1; j < len && tab[p->state][u[j]] == t; j++) {}
+      if (action == A_OSC_PUT) {
+        size_t room = sizeof(p->osc) - p->osc_len;
+        size_t n = (j - i < room) ? j - i : room;
+        memcpy(p->osc + p->osc_len, buf + i, n);
+        p->osc_len += n;
+      } else {
+        emit(p, action == A_PRINT ? VTP_PRINT : VTP_DCS_PUT, 0,
+             buf + i, j - i, cb, arg);
+      }
+      i = j;
+      continue;
+    }
+
+    if (next != S_STAY) leave_state(p, cb, arg);
+
+    switch (action) {
+    case A_EXECUTE:
+      emit(p, VTP_EXECUTE, c, NULL, 0, cb, arg);
+      break;
+    case A_COLLECT:
+      collect(p, c);
+      break;
+    case A_PARAM:
+      param(p, c);
+      break;
+    case A_ESC:
+      if (!p->overflow)
+        emit(p, VTP_ESC, c, NULL, 0, cb, arg);
+      break;
+    case A_CSI:
+      if (!p->overflow)
+        emit(p, VTP_CSI, c, NULL, 0, cb, arg);
+      break;
+    }
+
+    i++;
+    if (next != S_STAY) {
+      p->state = (unsigned char)next;
+      enter_state(p, c, cb, arg);
+      if (stop_at_ground && next == S_GROUND) break;
+    }
+  }
+  return i;
+}  /* feed */
+
+
+/*
+ * Parse a chunk of output, calling cb for each event in it.  Sequences
+ * may be split across calls anywhere.
+ */
+void vtp_feed(vtp_parser *p, const char *buf, size_t len,
+              vtp_event_fn cb, void *arg) {
+  feed(p, buf, len, cb, arg, 0);
+}  /* vtp_feed */
+
+
+/*
+ * Like vtp_feed(), but stop after the first sequence that finishes, so
+ * a caller that only cares about sequences can skip the text between
+ * them by its own means.  Returns bytes consumed.
+ */
+size_t vtp_feed_sequence(vtp_parser *p, const char *buf, size_t len,
+                         vtp_event_fn cb, void *arg) {
+  return feed(p, buf, len, cb, arg, 1);
+}  /* vtp_feed_sequence */
@@ -0,0 +1,83 @@
+/* vtparse.h - Streaming VT/ECMA-48 parser.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Splits a terminal output stream into what a terminal would act on:
+ * runs of printable text, control characters, and ESC, CSI, OSC and
+ * DCS sequences with their parameters already parsed.  It follows
+ * Paul Williams' DEC-compatible state machine (vt100.net/emu/dec_ansi_parser),
+ * so sequences split across reads, malformed ones and strings cut off
+ * by CAN/SUB/ESC all come out the way a real terminal sees them.
+ *
+ * Nothing is allocated: the parser is one fixed-size struct, and text
+ * and DCS data are handed to the callback as pointers into the caller's
+ * buffer.  Plain C with no OS calls.
+ */
+
+#ifndef VTPARSE_H
+#define VTPARSE_H
+
+#include <stddef.h>
+
+#define VTP_PARAM_MAX 16    /* more parameters are dropped */
+#define VTP_INTER_MAX 4     /* more intermediates: the sequence is ignored */
+#define VTP_OSC_MAX   512   /* longer OSC strings are truncated */
+
+/* Event types. */
+#define VTP_PRINT      0  /* data/len: run of printable bytes (UTF-8 as is) */
+#define VTP_EXECUTE    1  /* final: a C0 (or C1) control */
+#define VTP_ESC        2  /* ESC dispatch: final, inter */
+#define VTP_CSI        3  /* CSI dispatch: final, prefix, inter, params */
+#define VTP_OSC        4  /* data/len: the OSC string, without terminator */
+#define VTP_DCS_HOOK   5  /* DCS start: as for CSI; data follows */
+#define VTP_DCS_PUT    6  /* data/len: DCS data */
+#define VTP_DCS_UNHOOK 7  /* DCS end */
+
+typedef struct {
+  int type;
+  const char *data;
+  size_t len;
+  unsigned char final;
+  unsigned char prefix;           /* private marker (< = > ?), or 0 */
+  const unsigned char *inter;
+  int n_inter;
+  const int *params;              /* missing ones are 0 */
+  int n_params;
+  unsigned sub;                   /* bit i: params[i] followed a ':' */
+} vtp_event;
+
+typedef void (*vtp_event_fn)(void *arg, const vtp_event *ev);
+
+typedef struct {
+  unsigned char state;
+  unsigned char c1;               /* 8-bit C1 controls (not UTF-8) */
+  unsigned char prefix;
+  unsigned char inter[VTP_INTER_MAX];
+  int n_inter;
+  int overflow;                   /* too many intermediates */
+  int params[VTP_PARAM_MAX];
+  int n_params;
+  int drop;                       /* past VTP_PARAM_MAX params */
+  unsigned sub;
+  char osc[VTP_OSC_MAX];
+  size_t osc_len;
+} vtp_parser;
+
+void vtp_init(vtp_parser *p, int c1);
+void vtp_feed(vtp_parser *p, const char *buf, size_t len,
+              vtp_event_fn cb, void *arg);
+size_t vtp_feed_sequence(vtp_parser *p, const char *buf, size_t len,
+                         vtp_event_fn cb, void *arg);
+int vtp_in_ground(const vtp_parser *p);
+int vtp_param(const vtp_event *ev, int i, int def);
+
+#endif  /* VTPARSE_H */
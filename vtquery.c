@@ -0,0 +1,149 @@
+/* vtquery.c - Answer terminal queries for a headless child.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Handled queries:
+ *   ESC[6n   DSR cursor position  ->  ESC[row;colR
+ *   ESC[?6n  DEC cursor position  ->  ESC[?row;colR
+ *   ESC[5n   DSR device status    ->  ESC[0n
+ *   ESC[c    Primary DA           ->  ESC[?1;2c
+ *   ESC[0c   Primary DA           ->  ESC[?1;2c
+ *   ESC[>c   Secondary DA         ->  ESC[>0;0;0c
+ *   ESC[>0c  Secondary DA         ->  ESC[>0;0;0c
+ *   ESC[18t  Text area size       ->  ESC[8;rows;colst
+ *
+ * vtq_answer() looks a parsed CSI sequence up in vtq_table by its
+ * private marker, first parameter and final byte; adding a query is
+ * adding a row.  Answers that report the cursor or window size fill
+ * them in from a vtq_info.  vtscreen.c calls it with the real cursor,
+ * at the point in the stream where the query is.
+ *
+ * vtq_feed() is for callers without a screen model: the cursor is
+ * reported as home (1;1), which is what a freshly cleared terminal
+ * would say.  It uses vtparse.c, so a query split across reads is still
+ * seen and one inside an OSC or DCS string is not.  Almost all output
+ * is outside any escape sequence, so while the parser is in ground we
+ * jump straight to the next ESC with scan_find() and only hand it the
+ * sequences.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "vtquery.h"
+
+/* What a reply's format takes. */
+#define VTQ_ARGS_NONE   0
+#define VTQ_ARGS_CURSOR 1   /* row, col */
+#define VTQ_ARGS_SIZE   2   /* rows, cols */
+
+typedef struct {
+  unsigned char prefix;   /* private marker, or 0 */
+  int param;              /* first parameter (0 if none) */
+  unsigned char final;
+  const char *reply;      /* printf format */
+  int args;
+} vtq_entry;
+
+static const vtq_entry vtq_table[] = {
+  { 0,   6,  'n', "\x1b[%d;%dR",    VTQ_ARGS_CURSOR },
+  { '?', 6,  'n', "\x1b[?%d;%dR",   VTQ_ARGS_CURSOR },
+  { 0,   5,  'n', "\x1b[0n",        VTQ_ARGS_NONE },   /* device OK */
+  { 0,   0,  'c', "\x1b[?1;2c",     VTQ_ARGS_NONE },   /* VT100 with AVO */
+  { '>', 0,  'c', "\x1b[>0;0;0c",   VTQ_ARGS_NONE },   /* secondary DA */
+  { 0,   18, 't', "\x1b[8;%d;%dt",  VTQ_ARGS_SIZE },
+};
+
+typedef struct {
+  const vtq_state *st;
+  vtq_reply_fn cb;
+  void *arg;
+} vtq_ctx;
+
+
+void vtq_init(vtq_state *st) {
+  vtp_init(&st->vtp, 0);
+  scan_set_init(&st->esc);
+  scan_set_add(&st->esc, 0x1B);
+  st->info.row = 1;
+  st->info.col = 1;
+  st->info.rows = 24;
+  st->info.cols = 80;
+}  /* vtq_init */
+
+
+/*
+ * The window size to report (vtq_feed()).
+ */
+void vtq_set_size(vtq_state *st, int rows, int cols) {
+  st->info.rows = rows;
+  st->info.cols = cols;
+}  /* vtq_set_size */
+
+
+/*
+ * If ev is a query we answer, put the answer in reply (NUL-terminated)
+ * and return its length; else return 0.
+ */
+size_t vtq_answer(const vtp_event *ev, const vtq_info *info,
+                  char *reply, size_t size) {
+  int param = (ev->n_params > 0) ? ev->params[0] : 0;
+  size_t i;
+  int n;
+
+  if (ev->type != VTP_CSI || ev->n_inter != 0 || ev->n_params > 1) { return 0; }
+  for (i = 0; i < sizeof(vtq_table) / sizeof(vtq_table[0]); i++) {
+    const vtq_entry *e = &vtq_table[i];
+    if (e->final != ev->final || e->prefix != ev->prefix || e->param != param)
+      continue;
+    if (e->args == VTQ_ARGS_CURSOR)
+      n = snprintf(reply, size, e->reply, info->row, info->col);
+    else if (e->args == VTQ_ARGS_SIZE)
+      n = snprintf(reply, size, e->reply, info->rows, info->cols);
+    else
+      n = snprintf(reply, size, "%s", e->reply);
+    return (n > 0 && (size_t)n < size) ? (size_t)n : 0;
+  }
+  return 0;
+}  /* vtq_answer */
+
+
+static void vtq_event(void *arg, const vtp_event *ev) {
+  vtq_ctx *ctx = (vtq_ctx *)arg;
+  char reply[VTQ_REPLY_MAX];
+  size_t n = vtq_answer(ev, &ctx->st->info, reply, sizeof(reply));
+
+  if (n > 0)
+    ctx->cb(ctx->arg, reply, n);
+}  /* vtq_event */
+
+
+/*
+ * Scan a chunk of the child's output, calling cb with the answer to
+ * each query that ends in it.
+ */
+void vtq_feed(vtq_state *st, const char *buf, size_t len,
+              vtq_reply_fn cb, void *arg) {
+  vtq_ctx ctx;
+  size_t i = 0;
+
+  ctx.st = st;
+  ctx.cb = cb;
+  ctx.arg = arg;
+  while (i < len) {
+    if (vtp_in_ground(&st->vtp)) {
+      i += scan_find(&st->esc, buf + i, len - i);
+      if (i == len) break;
+    }
+    i += vtp_feed_sequence(&st->vtp, buf + i, len - i, vtq_event, &ctx);
+  }
+}  /* vtq_feed */
@@ -0,0 +1,60 @@
+/* vtquery.h - Answer terminal queries for a headless child.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Programs ask the terminal things (where's the cursor, what are you)
+ * by writing a query sequence and reading the answer from their input.
+ * With no terminal on the other end, nothing answers and they sit out
+ * a timeout.  vtq_feed() watches a child's output for the common
+ * queries and hands back the answer a terminal would give, which the
+ * caller writes to the child's input.  A screen model (vtscreen.c) can
+ * use vtq_answer() instead, to report where the cursor really is.
+ * Shared by minpty (Linux) and minconpty (Windows); plain C with no OS
+ * calls.
+ *
+ * All state is in a vtq_state, so each child (session) has its own and
+ * a query split across reads is still recognized.
+ */
+
+#ifndef VTQUERY_H
+#define VTQUERY_H
+
+#include <stddef.h>
+
+#include "vtparse.h"
+#include "vtscan.h"
+
+#define VTQ_REPLY_MAX 32   /* longest answer, NUL included */
+
+/* What the answers report. */
+typedef struct {
+  int row, col;      /* cursor, 1-based */
+  int rows, cols;    /* window size */
+} vtq_info;
+
+typedef struct {
+  vtp_parser vtp;
+  scan_set esc;      /* vtq_feed() skips to the next ESC */
+  vtq_info info;
+} vtq_state;
+
+/* Called with each answer to write to the child. */
+typedef void (*vtq_reply_fn)(void *arg, const char *reply, size_t len);
+
+void vtq_init(vtq_state *st);
+void vtq_set_size(vtq_state *st, int rows, int cols);
+void vtq_feed(vtq_state *st, const char *buf, size_t len,
+              vtq_reply_fn cb, void *arg);
+size_t vtq_answer(const vtp_event *ev, const vtq_info *info,
+                  char *reply, size_t size);
+
+#endif  /* VTQUERY_H */
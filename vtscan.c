@@ -0,0 +1,291 @@
+/* vtscan.c - Vectorized search for the next "interesting" byte.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Each vector kernel broadcasts every byte of the set into a register,
+ * compares a block of input against each one, ORs the results and
+ * turns them into a bit mask; the lowest set bit is the answer.  The
+ * control characters are one more compare: x is 0x00-0x1F exactly when
+ * max(x, 0x1F) == 0x1F (unsigned), and DEL is one cmpeq.  The
+ * AVX2 kernel is compiled with a function-level target attribute
+ * (gcc/clang) so the rest of the build needs no -mavx2, and is only
+ * called once cpuid says the CPU and OS support it.  MSVC needs no
+ * attribute to emit AVX2 intrinsics.
+ */
+
+#include <string.h>
+
+#include "vtscan.h"
+
+#if defined(__x86_64__) || defined(__i386__) || \
+    defined(_M_X64) || defined(_M_IX86)
+#define SCAN_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(SCAN_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SCAN_TARGET(t) __attribute__((target(t)))
+#else
+#define SCAN_TARGET(t)
+#endif
+
+/* The chosen kernel is shared by every thread that scans, and the
+ * first scan on any of them may be the one that chooses it. */
+#if defined(__GNUC__) || defined(__clang__)
+#define SCAN_SHARED
+#define SCAN_LOAD(v)     __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define SCAN_STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+#else
+/* MSVC: volatile accesses are acquire/release (/volatile:ms, the
+ * default on x86 and x64). */
+#define SCAN_SHARED volatile
+#define SCAN_LOAD(v)     (v)
+#define SCAN_STORE(v, x) ((v) = (x))
+#endif
+
+typedef size_t (*scan_fn)(const scan_set *, const char *, size_t);
+
+static size_t find_dispatch(const scan_set *ss, const char *buf, size_t len);
+static scan_fn SCAN_SHARED g_find = find_dispatch;
+static const char *SCAN_SHARED g_impl = NULL;
+
+
+void scan_set_init(scan_set *ss) {
+  memset(ss, 0, sizeof(*ss));
+}  /* scan_set_init */
+
+
+void scan_set_add(scan_set *ss, unsigned char c) {
+  if (ss->member[c]) { return; }
+  ss->member[c] = 1;
+  if (ss->n < SCAN_MAX_BYTES)
+    ss->bytes[ss->n] = c;
+  ss->n++;
+}  /* scan_set_add */
+
+
+/*
+ * Add 0x00-0x1F and 0x7F.
+ */
+void scan_set_add_controls(scan_set *ss) {
+  int c;
+
+  for (c = 0; c < 0x20; c++)
+    ss->member[c] = 1;
+  ss->member[0x7F] = 1;
+  ss->controls = 1;
+}  /* scan_set_add_controls */
+
+
+static size_t find_scalar(const scan_set *ss, const char *buf, size_t len) {
+  const unsigned char *p = (const unsigned char *)buf;
+  size_t i;
+
+  if (ss->n == 1 && !ss->controls) {
+    const void *hit = memchr(buf, ss->bytes[0], len);
+    return (hit != NULL) ? (size_t)((const char *)hit - buf) : len;
+  }
+  for (i = 0; i < len; i++) {
+    if (ss->member[p[i]]) break;
+  }
+  return i;
+}  /* find_scalar */
+
+
+#ifdef SCAN_X86
+
+static unsigned lowest_bit(unsigned mask) {
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward(&idx, mask);
+  return (unsigned)idx;
+#else
+  return (unsigned)__builtin_ctz(mask);
+#endif
+}  /* lowest_bit */
+
+
+SCAN_TARGET("sse2")
+static size_t find_sse2(const scan_set *ss, const char *buf, size_t len) {
+  __m128i want[SCAN_MAX_BYTES];
+  const __m128i ctl = _mm_set1_epi8(0x1F);
+  const __m128i del = _mm_set1_epi8(0x7F);
+  size_t i = 0;
+  int k;
+
+  for (k = 0; k < ss->n; k++)
+    want[k] = _mm_set1_epi8((char)ss->bytes[k]);
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i d = _mm_loadu_si128((const __m128i *)(buf + i));
+    __m128i hit = _mm_setzero_si128();
+    unsigned mask;
+    for (k = 0; k < ss->n; k++)
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi8(d, want[k]));
+    if (ss->controls)
+      hit = _mm_or_si128(hit, _mm_or_si128(
+          _mm_cmpeq_epi8(_mm_max_epu8(d, ctl), ctl), _mm_cmpeq_epi8(d, del)));
+    mask = (unsigned)_mm_movemask_epi8(hit);
+    if (mask != 0) { return i + lowest_bit(mask); }
+  }
+  return i + find_scalar(ss, buf + i, len - i);
+}  /* find_sse2 */
+
+
+SCAN_TARGET("avx2")
+static size_t find_avx2(const scan_set *ss, const char *buf, size_t len) {
+  __m256i want[SCAN_MAX_BYTES];
+  const __m256i ctl = _mm256_set1_epi8(0x1F);
+  const __m256i del = _mm256_set1_epi8(0x7F);
+  size_t i = 0;
+  int k;
+
+  for (k = 0; k < ss->n; k++)
+    want[k] = _mm256_set1_epi8((char)ss->bytes[k]);
+
+  /* Two blocks per step, so the (rare) hit test is taken half as often. */
+  for (; i + 64 <= len; i += 64) {
+    __m256i d0 = _mm256_loadu_si256((const __m256i *)(buf + i));
+    __m256i d1 = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+    __m256i h0 = _mm256_setzero_si256();
+    __m256i h1 = _mm256_setzero_si256();
+    for (k = 0; k < ss->n; k++) {
+      h0 = _mm256_or_si256(h0, _mm256_cmpeq_epi8(d0, want[k]));
+      h1 = _mm256_or_si256(h1, _mm256_cmpeq_epi8(d1, want[k]));
+    }
+    if (ss->controls) {
+      h0 = _mm256_or_si256(h0, _mm256_or_si256(
+          _mm256_cmpeq_epi8(_mm256_max_epu8(d0, ctl), ctl),
+          _mm256_cmpeq_epi8(d0, del)));
+      h1 = _mm256_or_si256(h1, _mm256_or_si256(
+          _mm256_cmpeq_epi8(_mm256_max_epu8(d1, ctl), ctl),
+          _mm256_cmpeq_epi8(d1, del)));
+    }
+    if (!_mm256_testz_si256(_mm256_or_si256(h0, h1),
+                            _mm256_or_si256(h0, h1))) {
+      unsigned m0 = (unsigned)_mm256_movemask_epi8(h0);
+      if (m0 != 0) { return i + lowest_bit(m0); }
+      return i + 32 + lowest_bit((unsigned)_mm256_movemask_epi8(h1));
+    }
+  }
+  for (; i + 32 <= len; i += 32) {
+    __m256i d = _mm256_loadu_si256((const __m256i *)(buf + i));
+    __m256i hit = _mm256_setzero_si256();
+    unsigned mask;
+    for (k = 0; k < ss->n; k++)
+      hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(d, want[k]));
+    if (ss->controls)
+      hit = _mm256_or_si256(hit, _mm256_or_si256(
+          _mm256_cmpeq_epi8(_mm256_max_epu8(d, ctl), ctl),
+          _mm256_cmpeq_epi8(d, del)));
+    mask = (unsigned)_mm256_movemask_epi8(hit);
+    if (mask != 0) { return i + lowest_bit(mask); }
+  }
+  return i + find_scalar(ss, buf + i, len - i);
+}  /* find_avx2 */
+
+
+/*
+ * Can this CPU (and OS: it has to save the YMM registers) run AVX2?
+ */
+static int have_avx2(void) {
+#ifdef _MSC_VER
+  int regs[4];
+  __cpuid(regs, 0);
+  if (regs[0] < 7) { return 0; }
+  __cpuid(regs, 1);
+  if (!(regs[2] & (1 << 27))) { return 0; }           /* OSXSAVE */
+  if ((_xgetbv(0) & 6) != 6) { return 0; }            /* XMM|YMM state */
+  __cpuidex(regs, 7, 0);
+  return (regs[1] & (1 << 5)) != 0;                   /* AVX2 */
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}  /* have_avx2 */
+
+
+static int have_sse2(void) {
+#if defined(_M_X64) || defined(__x86_64__)
+  return 1;  /* part of the x86-64 baseline */
+#elif defined(_MSC_VER)
+  int regs[4];
+  __cpuid(regs, 1);
+  return (regs[3] & (1 << 26)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+#endif
+}  /* have_sse2 */
+
+#endif  /* SCAN_X86 */
+
+
+/*
+ * Set g_find to the named kernel.
+ */
+int scan_select(const char *name) {
+  if (strcmp(name, "scalar") == 0) {
+    SCAN_STORE(g_impl, "scalar");
+    SCAN_STORE(g_find, find_scalar);
+    return 0;
+  }
+#ifdef SCAN_X86
+  if (strcmp(name, "sse2") == 0 && have_sse2()) {
+    SCAN_STORE(g_impl, "sse2");
+    SCAN_STORE(g_find, find_sse2);
+    return 0;
+  }
+  if (strcmp(name, "avx2") == 0 && have_avx2()) {
+    SCAN_STORE(g_impl, "avx2");
+    SCAN_STORE(g_find, find_avx2);
+    return 0;
+  }
+#endif
+  return -1;
+}  /* scan_select */
+
+
+/*
+ * First call: pick the best kernel.  Threads racing through here all
+ * store the same answer, atomically.
+ */
+static void choose_impl(void) {
+  if (scan_select("avx2") < 0 && scan_select("sse2") < 0)
+    scan_select("scalar");
+}  /* choose_impl */
+
+
+static size_t find_dispatch(const scan_set *ss, const char *buf, size_t len) {
+  choose_impl();
+  return SCAN_LOAD(g_find)(ss, buf, len);
+}  /* find_dispatch */
+
+
+const char *scan_impl(void) {
+  if (SCAN_LOAD(g_impl) == NULL) choose_impl();
+  return SCAN_LOAD(g_impl);
+}  /* scan_impl */
+
+
+/*
+ * Index of the first byte of buf[0..len) that's in the set, or len if
+ * there's none.
+ */
+size_t scan_find(const scan_set *ss, const char *buf, size_t len) {
+  if (ss->n > SCAN_MAX_BYTES) { return find_scalar(ss, buf, len); }
+  if (ss->n == 0 && !ss->controls) { return len; }
+  return SCAN_LOAD(g_find)(ss, buf, len);
+}  /* scan_find */
@@ -0,0 +1,52 @@
+/* vtscan.h - Vectorized search for the next "interesting" byte.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Most terminal output is plain text.  Anything that only cares about
+ * a few byte values (ESC for a VT parser, the first bytes of patterns
+ * for a matcher) can use scan_find() to jump straight to the next one
+ * instead of looking at every byte.  It compares 32 (AVX2) or 16
+ * (SSE2) bytes per step against up to SCAN_MAX_BYTES values, picking
+ * the best kernel the CPU has the first time it's called; larger sets
+ * and other CPUs use a table-driven scalar loop.  A set can also take
+ * all the control characters at once (a range compare, not 33 bytes),
+ * to find the end of a run of printable text.  Builds with gcc, clang
+ * and MSVC.
+ */
+
+#ifndef VTSCAN_H
+#define VTSCAN_H
+
+#include <stddef.h>
+
+/* Most bytes a set can hold and still use the vector kernels. */
+#define SCAN_MAX_BYTES 8
+
+typedef struct {
+  unsigned char bytes[SCAN_MAX_BYTES];
+  int n;                        /* distinct bytes added */
+  unsigned char member[256];    /* byte -> in the set */
+  int controls;                 /* also every C0 control and DEL */
+} scan_set;
+
+void scan_set_init(scan_set *ss);
+void scan_set_add(scan_set *ss, unsigned char c);
+void scan_set_add_controls(scan_set *ss);
+size_t scan_find(const scan_set *ss, const char *buf, size_t len);
+
+/* Which kernel scan_find() uses: "avx2", "sse2" or "scalar".
+ * scan_select() forces one (for benchmarks); returns -1 if this CPU or
+ * build can't run it. */
+const char *scan_impl(void);
+int scan_select(const char *name);
+
+#endif  /* VTSCAN_H */
@@ -0,0 +1,135 @@
+/* vtscan_bch.c - Throughput of each scan_find() kernel.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Usage: vtscan_bch [MB]
+ * Builds MB megabytes (default 64) of compiler-style output with a
+ * colored "warning:" every 20 lines, then for each kernel this CPU can
+ * run, finds every ESC, every hit of a 4-byte set and every control
+ * character, and reports GB/s.
+ * Every kernel's hit count is checked against the scalar one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vtscan.h"
+
+#define PASSES 10
+
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}  /* now_sec */
+
+
+static size_t fill(char *buf, size_t size) {
+  size_t len = 0;
+  int i = 0;
+
+  while (len + 200 < size) {
+    if (i % 20 == 19) {
+      len += sprintf(buf + len,
+          "src/module/file_%06d.c:42:7: \x1b[01;35mwarning:\x1b[m unused "
+          "variable 'x'\n", i);
+    } else {
+      len += sprintf(buf + len,
+          "gcc -Wall -O2 -c src/module/file_%06d.c -o obj/module/"
+          "file_%06d.o\n", i, i);
+    }
+    i++;
+  }
+  return len;
+}  /* fill */
+
+
+/*
+ * Count the set's bytes in buf, PASSES times.  Returns the count.
+ */
+static size_t count_hits(const scan_set *ss, const char *buf, size_t len,
+                         double *secs) {
+  double start = now_sec();
+  size_t hits = 0;
+  int pass;
+
+  for (pass = 0; pass < PASSES; pass++) {
+    size_t i = 0;
+    hits = 0;
+    for (;;) {
+      i += scan_find(ss, buf + i, len - i);
+      if (i == len) break;
+      hits++;
+      i++;
+    }
+  }
+  *secs = now_sec() - start;
+  return hits;
+}  /* count_hits */
+
+
+int main(int argc, char **argv) {
+  static const char *impls[] = { "scalar", "sse2", "avx2" };
+  size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 64) * 1024 * 1024;
+  char *buf = (char *)malloc(size);
+  scan_set esc, four, ctl;
+  size_t len, want_esc = 0, want_four = 0, want_ctl = 0;
+  int k;
+
+  if (buf == NULL) { perror("malloc"); exit(1); }
+  len = fill(buf, size);
+
+  scan_set_init(&esc);
+  scan_set_add(&esc, 0x1B);
+  scan_set_init(&four);
+  scan_set_add(&four, 0x1B);
+  scan_set_add(&four, '\n');
+  scan_set_add(&four, ':');
+  scan_set_add(&four, '>');
+  scan_set_init(&ctl);
+  scan_set_add_controls(&ctl);
+
+  printf("%.1f MB, default kernel %s\n", len / 1048576.0, scan_impl());
+  for (k = 0; k < 3; k++) {
+    size_t n_esc, n_four, n_ctl;
+    double t_esc, t_four, t_ctl;
+
+    if (scan_select(impls[k]) < 0) {
+      printf("%-6s  not supported here\n", impls[k]);
+      continue;
+    }
+    n_esc = count_hits(&esc, buf, len, &t_esc);
+    n_four = count_hits(&four, buf, len, &t_four);
+    n_ctl = count_hits(&ctl, buf, len, &t_ctl);
+    if (k == 0) {
+      want_esc = n_esc;
+      want_four = n_four;
+      want_ctl = n_ctl;
+    } else if (n_esc != want_esc || n_four != want_four ||
+               n_ctl != want_ctl) {
+      fprintf(stderr, "%s: hit counts %zu/%zu/%zu, scalar %zu/%zu/%zu\n",
+              impls[k], n_esc, n_four, n_ctl, want_esc, want_four, want_ctl);
+      exit(1);
+    }
+    printf("%-6s  ESC: %6.2f GB/s   4 bytes: %6.2f GB/s   "
+           "controls: %6.2f GB/s\n", impls[k],
+           (double)len * PASSES / t_esc / 1e9,
+           (double)len * PASSES / t_four / 1e9,
+           (double)len * PASSES / t_ctl / 1e9);
+  }
+
+  free(buf);
+  return 0;
+}  /* main */
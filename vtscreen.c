@@ -0,0 +1,894 @@
+/* vtscreen.c - Headless terminal screen model.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Rows are reached through an array of row pointers, so scrolling a
+ * region (the common case: a log scrolling, a pager paging) moves
+ * pointers instead of cells; only the rows scrolled in get cleared.
+ * The main and alternate screens share one allocation, and switching
+ * between them swaps the two pointer arrays.
+ *
+ * Character widths: combining marks and zero-width characters are
+ * dropped, East Asian wide ranges and the common emoji blocks take two
+ * cells, everything else one.  Good enough to keep columns lined up for
+ * the text programs print; there's no locale or wcwidth() to consult
+ * portably.
+ *
+ * Not modelled: tab stops other than every 8 columns, double-width
+ * lines, scrollback, and mouse/keyboard modes (they don't change what's
+ * on the screen).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vtscreen.h"
+
+/* DEC Special Graphics for 0x60-0x7E (ESC ( 0). */
+static const uint16_t g_line_drawing[31] = {
+  0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0x00B0, 0x00B1,
+  0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x23BA,
+  0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534, 0x252C,
+  0x2502, 0x2264, 0x2265, 0x03C0, 0x2260, 0x00A3, 0x00B7
+};
+
+/* Code point ranges two cells wide. */
+static const uint32_t g_wide[][2] = {
+  { 0x1100, 0x115F }, { 0x2E80, 0x303E }, { 0x3041, 0x33FF },
+  { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF },
+  { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE30, 0xFE4F },
+  { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x1F300, 0x1F64F },
+  { 0x1F900, 0x1F9FF }, { 0x20000, 0x3FFFD }
+};
+
+static void on_event(void *arg, const vtp_event *ev);
+
+
+static int char_width(uint32_t c) {
+  size_t i;
+
+  if (c < 0x300) { return 1; }
+  if ((c >= 0x300 && c <= 0x36F) || (c >= 0x200B && c <= 0x200F) ||
+      (c >= 0xFE00 && c <= 0xFE0F) || (c >= 0x20D0 && c <= 0x20FF))
+    return 0;
+  for (i = 0; i < sizeof(g_wide) / sizeof(g_wide[0]); i++) {
+    if (c >= g_wide[i][0] && c <= g_wide[i][1])
+      return 2;
+  }
+  return 1;
+}  /* char_width */
+
+
+/* ---- Rows and cells ---------------------------------------------------- */
+
+static void mark_dirty(vts_screen *s, int row) {
+  s->n_row_updates++;
+  if (!s->dirty[row]) {
+    s->dirty[row] = 1;
+    s->dirty_list[s->n_dirty++] = row;
+  }
+}  /* mark_dirty */
+
+
+static void mark_rows(vts_screen *s, int from, int to) {
+  int r;
+  for (r = from; r <= to; r++)
+    mark_dirty(s, r);
+}  /* mark_rows */
+
+
+/*
+ * What erased cells become: blank, in the current background color
+ * (as xterm does).
+ */
+static vts_cell blank(const vts_screen *s) {
+  vts_cell c;
+
+  c.ch = ' ';
+  c.fg = VTS_COLOR_DEFAULT;
+  c.bg = s->pen.bg;
+  c.attr = 0;
+  return c;
+}  /* blank */
+
+
+/*
+ * Blank columns [from, to) of row.
+ */
+static void erase(vts_screen *s, int row, int from, int to) {
+  vts_cell b = blank(s);
+  vts_cell *line = s->line[row];
+  int c;
+
+  if (from < 0) from = 0;
+  if (to > s->cols) to = s->cols;
+  for (c = from; c < to; c++)
+    line[c] = b;
+  mark_dirty(s, row);
+}  /* erase */
+
+
+static void reverse_rows(vts_cell **a, int n) {
+  int i;
+  for (i = 0; i < n / 2; i++) {
+    vts_cell *t = a[i];
+    a[i] = a[n - 1 - i];
+    a[n - 1 - i] = t;
+  }
+}  /* reverse_rows */
+
+
+/*
+ * Scroll rows [top, bottom] up by n (n < 0: down), blanking the rows
+ * that come in.
+ */
+static void scroll(vts_screen *s, int top, int bottom, int n) {
+  int height = bottom - top + 1, k, r;
+  vts_cell **a = &s->line[top];
+
+  if (n == 0 || height <= 0) { return; }
+  if (n >= height || -n >= height) {
+    for (r = top; r <= bottom; r++)
+      erase(s, r, 0, s->cols);
+    return;
+  }
+
+  /* Rotate the row pointers (three reversals, no temporary); the rows
+   * that went around the end get blanked. */
+  k = (n > 0) ? n : height + n;
+  reverse_rows(a, k);
+  reverse_rows(a + k, height - k);
+  reverse_rows(a, height);
+  if (n > 0) {
+    for (r = bottom - n + 1; r <= bottom; r++)
+      erase(s, r, 0, s->cols);
+  } else {
+    for (r = top; r < top - n; r++)
+      erase(s, r, 0, s->cols);
+  }
+  mark_rows(s, top, bottom);
+  s->n_scrolls++;
+}  /* scroll */
+
+
+static void clear_all(vts_screen *s) {
+  int r;
+  for (r = 0; r < s->rows; r++)
+    erase(s, r, 0, s->cols);
+}  /* clear_all */
+
+
+/* ---- Cursor ------------------------------------------------------------ */
+
+static int clamp(int v, int lo, int hi) {
+  return (v < lo) ? lo : (v > hi) ? hi : v;
+}  /* clamp */
+
+
+/*
+ * Move to (row, col), with row relative to the scroll region in origin
+ * mode.
+ */
+static void move_to(vts_screen *s, int row, int col) {
+  if (s->origin)
+    s->row = clamp(row + s->top, s->top, s->bottom);
+  else
+    s->row = clamp(row, 0, s->rows - 1);
+  s->col = clamp(col, 0, s->cols - 1);
+  s->wrap_pending = 0;
+}  /* move_to */
+
+
+/*
+ * Cursor up (n < 0) or down.  It stops at the scroll region's edge if
+ * it starts inside the region.
+ */
+static void move_rows(vts_screen *s, int n) {
+  int lo = (s->row >= s->top) ? s->top : 0;
+  int hi = (s->row <= s->bottom) ? s->bottom : s->rows - 1;
+
+  s->row = clamp(s->row + n, lo, hi);
+  s->wrap_pending = 0;
+}  /* move_rows */
+
+
+static void line_feed(vts_screen *s) {
+  if (s->row == s->bottom)
+    scroll(s, s->top, s->bottom, 1);
+  else if (s->row < s->rows - 1)
+    s->row++;
+  s->wrap_pending = 0;
+}  /* line_feed */
+
+
+static void reverse_index(vts_screen *s) {
+  if (s->row == s->top)
+    scroll(s, s->top, s->bottom, -1);
+  else if (s->row > 0)
+    s->row--;
+  s->wrap_pending = 0;
+}  /* reverse_index */
+
+
+static void save_cursor(vts_screen *s) {
+  s->saved.row = s->row;
+  s->saved.col = s->col;
+  s->saved.pen = s->pen;
+  s->saved.origin = s->origin;
+  s->saved.charset[0] = s->charset[0];
+  s->saved.charset[1] = s->charset[1];
+  s->saved.gl = s->gl;
+}  /* save_cursor */
+
+
+static void restore_cursor(vts_screen *s) {
+  s->row = clamp(s->saved.row, 0, s->rows - 1);
+  s->col = clamp(s->saved.col, 0, s->cols - 1);
+  s->pen = s->saved.pen;
+  s->origin = s->saved.origin;
+  s->charset[0] = s->saved.charset[0];
+  s->charset[1] = s->saved.charset[1];
+  s->gl = s->saved.gl;
+  s->wrap_pending = 0;
+}  /* restore_cursor */
+
+
+/* ---- Text -------------------------------------------------------------- */
+
+static void put_char(vts_screen *s, uint32_t ch) {
+  int width = char_width(ch);
+  vts_cell *line;
+
+  if (width == 0) { return; }
+  if (s->wrap_pending) {
+    s->col = 0;
+    line_feed(s);
+  }
+  /* A wide character doesn't fit in the last column. */
+  if (width == 2 && s->col == s->cols - 1) {
+    if (s->cols < 2) { return; }
+    if (!s->autowrap) {
+      s->col--;
+    } else {
+      erase(s, s->row, s->col, s->cols);
+      s->col = 0;
+      line_feed(s);
+    }
+  }
+
+  line = s->line[s->row];
+  if (s->insert)
+    memmove(&line[s->col + width], &line[s->col],
+            (s->cols - s->col - width) * sizeof(vts_cell));
+  line[s->col] = s->pen;
+  line[s->col].ch = ch;
+  if (width == 2) {
+    line[s->col + 1] = s->pen;
+    line[s->col + 1].ch = 0;
+  }
+  mark_dirty(s, s->row);
+  s->last_ch = ch;
+
+  if (s->col + width < s->cols)
+    s->col += width;
+  else if (s->autowrap)
+    s->wrap_pending = 1;   /* cursor stays on the last column */
+}  /* put_char */
+
+
+/*
+ * A run of printable bytes: decode UTF-8 (a character may continue from
+ * the last run) and apply the G0/G1 line-drawing set to ASCII.
+ */
+static void print_run(vts_screen *s, const char *data, size_t len) {
+  const unsigned char *u = (const unsigned char *)data;
+  size_t i = 0;
+
+  while (i < len) {
+    unsigned char b = u[i];
+
+    if (s->utf8_need > 0) {
+      if ((b & 0xC0) == 0x80) {
+        s->utf8_cp = (s->utf8_cp << 6) | (b & 0x3F);
+        if (--s->utf8_need == 0)
+          put_char(s, s->utf8_cp);
+        i++;
+        continue;
+      }
+      s->utf8_need = 0;
+      put_char(s, 0xFFFD);   /* and b starts afresh */
+    }
+
+    if (b < 0x80) {
+      if (s->charset[s->gl] == '0' && b >= 0x60 && b <= 0x7E)
+        put_char(s, g_line_drawing[b - 0x60]);
+      else
+        put_char(s, b);
+    } else if ((b & 0xE0) == 0xC0) {
+      s->utf8_cp = b & 0x1F;
+      s->utf8_need = 1;
+    } else if ((b & 0xF0) == 0xE0) {
+      s->utf8_cp = b & 0x0F;
+      s->utf8_need = 2;
+    } else if ((b & 0xF8) == 0xF0) {
+      s->utf8_cp = b & 0x07;
+      s->utf8_need = 3;
+    } else {
+      put_char(s, 0xFFFD);
+    }
+    i++;
+  }
+}  /* print_run */
+
+
+static void execute(vts_screen *s, unsigned char c) {
+  switch (c) {
+  case 0x08:   /* BS */
+    if (s->col > 0) s->col--;
+    s->wrap_pending = 0;
+    break;
+  case 0x09:   /* HT */
+    s->col = clamp((s->col / 8 + 1) * 8, 0, s->cols - 1);
+    s->wrap_pending = 0;
+    break;
+  case 0x0A: case 0x0B: case 0x0C:   /* LF, VT, FF */
+    line_feed(s);
+    break;
+  case 0x0D:   /* CR */
+    s->col = 0;
+    s->wrap_pending = 0;
+    break;
+  case 0x0E:   /* SO */
+    s->gl = 1;
+    break;
+  case 0x0F:   /* SI */
+    s->gl = 0;
+    break;
+  }
+}  /* execute */
+
+
+/* ---- Sequences --------------------------------------------------------- */
+
+static void reset(vts_screen *s) {
+  if (s->alt) {
+    vts_cell **t = s->line;
+    s->line = s->other;
+    s->other = t;
+    s->alt = 0;
+  }
+  memset(&s->pen, 0, sizeof(s->pen));
+  s->pen.ch = ' ';
+  s->row = s->col = 0;
+  s->wrap_pending = 0;
+  s->top = 0;
+  s->bottom = s->rows - 1;
+  s->autowrap = 1;
+  s->origin = 0;
+  s->insert = 0;
+  s->cursor_visible = 1;
+  s->charset[0] = s->charset[1] = 'B';
+  s->gl = 0;
+  s->last_ch = ' ';
+  s->utf8_need = 0;
+  s->title[0] = '\0';
+  save_cursor(s);
+  clear_all(s);
+}  /* reset */
+
+
+static void esc_dispatch(vts_screen *s, const vtp_event *ev) {
+  if (ev->n_inter == 1 && (ev->inter[0] == '(' || ev->inter[0] == ')')) {
+    s->charset[ev->inter[0] == ')'] = ev->final;   /* designate G0/G1 */
+    return;
+  }
+  if (ev->n_inter != 0) { return; }
+
+  switch (ev->final) {
+  case '7': save_cursor(s); break;
+  case '8': restore_cursor(s); break;
+  case 'D': line_feed(s); break;
+  case 'E': s->col = 0; line_feed(s); break;
+  case 'M': reverse_index(s); break;
+  case 'c': reset(s); break;
+  }
+}  /* esc_dispatch */
+
+
+/*
+ * SGR 38/48: the color that starts at params[i] (the 38 or 48).
+ * Returns the index of its last parameter.
+ */
+static int sgr_color(const vtp_event *ev, int i, uint32_t *color) {
+  const int *p = ev->params;
+  int n = ev->n_params, j;
+
+  if (i + 1 < n && (ev->sub >> (i + 1)) & 1) {
+    /* 38:5:N or 38:2:[colorspace:]R:G:B */
+    for (j = i + 1; j + 1 < n && (ev->sub >> (j + 1)) & 1; j++) {}
+    if (p[i + 1] == 5 && j >= i + 2)
+      *color = VTS_COLOR_INDEX(p[i + 2] & 0xFF);
+    else if (p[i + 1] == 2 && j >= i + 4)
+      *color = VTS_COLOR_RGB(p[j - 2] & 0xFF, p[j - 1] & 0xFF, p[j] & 0xFF);
+    return j;
+  }
+  /* 38;5;N or 38;2;R;G;B */
+  if (i + 2 < n && p[i + 1] == 5) {
+    *color = VTS_COLOR_INDEX(p[i + 2] & 0xFF);
+    return i + 2;
+  }
+  if (i + 4 < n && p[i + 1] == 2) {
+    *color = VTS_COLOR_RGB(p[i + 2] & 0xFF, p[i + 3] & 0xFF, p[i + 4] & 0xFF);
+    return i + 4;
+  }
+  return n - 1;   /* malformed: ignore the rest */
+}  /* sgr_color */
+
+
+static void sgr(vts_screen *s, const vtp_event *ev) {
+  vts_cell *pen = &s->pen;
+  int i;
+
+  if (ev->n_params == 0) {
+    pen->fg = pen->bg = VTS_COLOR_DEFAULT;
+    pen->attr = 0;
+    return;
+  }
+  for (i = 0; i < ev->n_params; i++) {
+    int p = ev->params[i];
+
+    /* 4:0 turns underline off; other sub-parameters (curly and so on)
+     * just mean on. */
+    if (p == 4 && i + 1 < ev->n_params && (ev->sub >> (i + 1)) & 1 &&
+        ev->params[i + 1] == 0)
+      p = 24;
+
+    switch (p) {
+    case 0: pen->fg = pen->bg = VTS_COLOR_DEFAULT; pen->attr = 0; break;
+    case 1: pen->attr |= VTS_BOLD; break;
+    case 2: pen->attr |= VTS_DIM; break;
+    case 3: pen->attr |= VTS_ITALIC; break;
+    case 4: case 21: pen->attr |= VTS_UNDERLINE; break;
+    case 5: case 6: pen->attr |= VTS_BLINK; break;
+    case 7: pen->attr |= VTS_INVERSE; break;
+    case 8: pen->attr |= VTS_HIDDEN; break;
+    case 9: pen->attr |= VTS_STRIKE; break;
+    case 22: pen->attr &= ~(VTS_BOLD | VTS_DIM); break;
+    case 23: pen->attr &= ~VTS_ITALIC; break;
+    case 24: pen->attr &= ~VTS_UNDERLINE; break;
+    case 25: pen->attr &= ~VTS_BLINK; break;
+    case 27: pen->attr &= ~VTS_INVERSE; break;
+    case 28: pen->attr &= ~VTS_HIDDEN; break;
+    case 29: pen->attr &= ~VTS_STRIKE; break;
+    case 38: i = sgr_color(ev, i, &pen->fg); continue;
+    case 39: pen->fg = VTS_COLOR_DEFAULT; break;
+    case 48: i = sgr_color(ev, i, &pen->bg); continue;
+    case 49: pen->bg = VTS_COLOR_DEFAULT; break;
+    default:
+      if (p >= 30 && p <= 37) pen->fg = VTS_COLOR_INDEX(p - 30);
+      else if (p >= 40 && p <= 47) pen->bg = VTS_COLOR_INDEX(p - 40);
+      else if (p >= 90 && p <= 97) pen->fg = VTS_COLOR_INDEX(p - 90 + 8);
+      else if (p >= 100 && p <= 107) pen->bg = VTS_COLOR_INDEX(p - 100 + 8);
+      break;
+    }
+    /* Skip sub-parameters we didn't use. */
+    while (i + 1 < ev->n_params && (ev->sub >> (i + 1)) & 1)
+      i++;
+  }
+}  /* sgr */
+
+
+static void set_alt(vts_screen *s, int on) {
+  vts_cell **t;
+
+  if (on == s->alt) { return; }
+  t = s->line;
+  s->line = s->other;
+  s->other = t;
+  s->alt = on;
+  mark_rows(s, 0, s->rows - 1);
+}  /* set_alt */
+
+
+/*
+ * SM/RM (h/l), ANSI or DEC private (?) modes.
+ */
+static void set_mode(vts_screen *s, const vtp_event *ev, int on) {
+  int i;
+
+  for (i = 0; i < ev->n_params; i++) {
+    int m = ev->params[i];
+
+    if (ev->prefix == 0) {
+      if (m == 4) s->insert = on;
+      continue;
+    }
+    if (ev->prefix != '?') { return; }
+    switch (m) {
+    case 6:
+      s->origin = on;
+      move_to(s, 0, 0);
+      break;
+    case 7: s->autowrap = on; s->wrap_pending = 0; break;
+    case 25: s->cursor_visible = on; break;
+    case 47: case 1047:
+      if (on) {
+        set_alt(s, 1);
+        if (m == 1047) clear_all(s);
+      } else {
+        if (m == 1047 && s->alt) clear_all(s);
+        set_alt(s, 0);
+      }
+      break;
+    case 1049:
+      if (on) {
+        save_cursor(s);
+        set_alt(s, 1);
+        clear_all(s);
+      } else {
+        set_alt(s, 0);
+        restore_cursor(s);
+      }
+      break;
+    }
+  }
+}  /* set_mode */
+
+
+static void csi_dispatch(vts_screen *s, const vtp_event *ev) {
+  int n = vtp_param(ev, 0, 1);
+  vts_cell *line = s->line[s->row];
+  int i, k;
+
+  if (ev->n_inter != 0) { return; }
+  if (ev->final == 'h' || ev->final == 'l') {
+    set_mode(s, ev, ev->final == 'h');
+    return;
+  }
+  if (ev->prefix != 0) { return; }
+
+  switch (ev->final) {
+  case 'A': move_rows(s, -n); break;
+  case 'B': case 'e': move_rows(s, n); break;
+  case 'C': case 'a':
+    s->col = clamp(s->col + n, 0, s->cols - 1);
+    s->wrap_pending = 0;
+    break;
+  case 'D':
+    s->col = clamp(s->col - n, 0, s->cols - 1);
+    s->wrap_pending = 0;
+    break;
+  case 'E': move_rows(s, n); s->col = 0; break;
+  case 'F': move_rows(s, -n); s->col = 0; break;
+  case 'G': case '`':
+    s->col = clamp(n - 1, 0, s->cols - 1);
+    s->wrap_pending = 0;
+    break;
+  case 'd':
+    move_to(s, n - 1, s->col);
+    break;
+  case 'H': case 'f':
+    move_to(s, n - 1, vtp_param(ev, 1, 1) - 1);
+    break;
+
+  case 'J':
+    switch (vtp_param(ev, 0, 0)) {
+    case 0:
+      erase(s, s->row, s->col, s->cols);
+      for (i = s->row + 1; i < s->rows; i++)
+        erase(s, i, 0, s->cols);
+      break;
+    case 1:
+      for (i = 0; i < s->row; i++)
+        erase(s, i, 0, s->cols);
+      erase(s, s->row, 0, s->col + 1);
+      break;
+    case 2: case 3:
+      clear_all(s);
+      break;
+    }
+    break;
+  case 'K':
+    switch (vtp_param(ev, 0, 0)) {
+    case 0: erase(s, s->row, s->col, s->cols); break;
+    case 1: erase(s, s->row, 0, s->col + 1); break;
+    case 2: erase(s, s->row, 0, s->cols); break;
+    }
+    break;
+
+  case 'L': case 'M':
+    if (s->row < s->top || s->row > s->bottom) { break; }
+    scroll(s, s->row, s->bottom, ev->final == 'L' ? -n : n);
+    s->col = 0;
+    s->wrap_pending = 0;
+    break;
+  case '@': case 'P':
+    k = clamp(n, 0, s->cols - s->col);
+    if (ev->final == '@') {
+      memmove(&line[s->col + k], &line[s->col],
+              (s->cols - s->col - k) * sizeof(vts_cell));
+      erase(s, s->row, s->col, s->col + k);
+    } else {
+      memmove(&line[s->col], &line[s->col + k],
+              (s->cols - s->col - k) * sizeof(vts_cell));
+      erase(s, s->row, s->cols - k, s->cols);
+    }
+    s->wrap_pending = 0;
+    break;
+  case 'X':
+    erase(s, s->row, s->col, s->col + n);
+    s->wrap_pending = 0;
+    break;
+  case 'S': scroll(s, s->top, s->bottom, n); break;
+  case 'T':
+    if (ev->n_params <= 1)   /* more is mouse highlight tracking */
+      scroll(s, s->top, s->bottom, -n);
+    break;
+  case 'b':
+    for (i = 0; i < n && i < s->cols * s->rows; i++)
+      put_char(s, s->last_ch);
+    break;
+
+  case 'm': sgr(s, ev); break;
+  case 'r': {
+    int top = vtp_param(ev, 0, 1) - 1;
+    int bottom = vtp_param(ev, 1, s->rows) - 1;
+    if (bottom >= s->rows) bottom = s->rows - 1;
+    if (top < bottom) {
+      s->top = top;
+      s->bottom = bottom;
+      move_to(s, 0, 0);
+    }
+    break;
+  }
+  case 's':
+    if (ev->n_params == 0) save_cursor(s);
+    break;
+  case 'u': restore_cursor(s); break;
+  }
+}  /* csi_dispatch */
+
+
+/*
+ * OSC 0 and 2 set the window title.
+ */
+static void osc(vts_screen *s, const vtp_event *ev) {
+  size_t n = ev->len;
+
+  if (n < 2 || ev->data[1] != ';' || (ev->data[0] != '0' && ev->data[0] != '2'))
+    return;
+  n -= 2;
+  if (n > sizeof(s->title) - 1) n = sizeof(s->title) - 1;
+  memcpy(s->title, ev->data + 2, n);
+  s->title[n] = '\0';
+}  /* osc */
+
+
+/*
+ * Answer a query the way a terminal showing this screen would.  Called
+ * as the query is parsed, so the cursor is where the output before it
+ * left it.
+ */
+static void answer(vts_screen *s, const vtp_event *ev) {
+  char reply[VTQ_REPLY_MAX];
+  vtq_info info;
+  size_t n;
+
+  info.row = s->row + 1 - (s->origin ? s->top : 0);
+  info.col = s->col + 1;
+  info.rows = s->rows;
+  info.cols = s->cols;
+  n = vtq_answer(ev, &info, reply, sizeof(reply));
+  if (n > 0)
+    s->reply(s->reply_arg, reply, n);
+}  /* answer */
+
+
+static void on_event(void *arg, const vtp_event *ev) {
+  vts_screen *s = (vts_screen *)arg;
+
+  if (ev->type != VTP_PRINT && s->utf8_need > 0) {
+    s->utf8_need = 0;
+    put_char(s, 0xFFFD);
+  }
+  switch (ev->type) {
+  case VTP_PRINT: print_run(s, ev->data, ev->len); break;
+  case VTP_EXECUTE: execute(s, ev->final); break;
+  case VTP_ESC: esc_dispatch(s, ev); break;
+  case VTP_CSI:
+    csi_dispatch(s, ev);
+    if (s->reply != NULL) answer(s, ev);
+    break;
+  case VTP_OSC: osc(s, ev); break;
+  }
+}  /* on_event */
+
+
+/* ---- API --------------------------------------------------------------- */
+
+/*
+ * Allocate the cells and bookkeeping for a rows x cols screen, with
+ * the content of old (if not NULL) copied in.  The screen shown keeps
+ * the cursor's row on screen by dropping rows off the top.
+ */
+static int alloc_screen(vts_screen *s, int rows, int cols,
+                        const vts_screen *old) {
+  size_t per = (size_t)rows * cols;
+  vts_cell *store = (vts_cell *)malloc(2 * per * sizeof(vts_cell));
+  vts_cell **line = (vts_cell **)malloc(rows * sizeof(vts_cell *));
+  vts_cell **other = (vts_cell **)malloc(rows * sizeof(vts_cell *));
+  unsigned char *dirty = (unsigned char *)calloc(rows, 1);
+  int *dirty_list = (int *)malloc(rows * sizeof(int));
+  vts_cell b;
+  size_t i;
+  int r;
+
+  if (store == NULL || line == NULL || other == NULL || dirty == NULL ||
+      dirty_list == NULL) {
+    free(store); free(line); free(other); free(dirty); free(dirty_list);
+    return -1;
+  }  /* Handle error. */
+
+  b.ch = ' ';
+  b.fg = b.bg = VTS_COLOR_DEFAULT;
+  b.attr = 0;
+  for (i = 0; i < 2 * per; i++)
+    store[i] = b;
+  for (r = 0; r < rows; r++) {
+    line[r] = store + (size_t)r * cols;
+    other[r] = store + per + (size_t)r * cols;
+  }
+
+  if (old != NULL) {
+    int shift = (old->row >= rows) ? old->row - rows + 1 : 0;
+    int w = (old->cols < cols) ? old->cols : cols;
+    for (r = 0; r < rows; r++) {
+      if (r + shift < old->rows)
+        memcpy(line[r], old->line[r + shift], w * sizeof(vts_cell));
+      if (r < old->rows)
+        memcpy(other[r], old->other[r], w * sizeof(vts_cell));
+    }
+    s->row = old->row - shift;
+    s->saved.row -= shift;
+  }
+
+  free(s->store); free(s->line); free(s->other);
+  free(s->dirty); free(s->dirty_list);
+  s->store = store;
+  s->line = line;
+  s->other = other;
+  s->dirty = dirty;
+  s->dirty_list = dirty_list;
+  s->n_dirty = 0;
+  s->rows = rows;
+  s->cols = cols;
+  return 0;
+}  /* alloc_screen */
+
+
+int vts_init(vts_screen *s, int rows, int cols) {
+  memset(s, 0, sizeof(*s));
+  if (rows < 1) rows = 1;
+  if (cols < 1) cols = 1;
+  if (alloc_screen(s, rows, cols, NULL) < 0) { return -1; }  /* Handle error. */
+  vtp_init(&s->vtp, 0);
+  reset(s);
+  return 0;
+}  /* vts_init */
+
+
+void vts_free(vts_screen *s) {
+  free(s->store); free(s->line); free(s->other);
+  free(s->dirty); free(s->dirty_list);
+  memset(s, 0, sizeof(*s));
+}  /* vts_free */
+
+
+/*
+ * The window changed size.  Everything is dirty afterward; the scroll
+ * region goes back to the whole screen.
+ */
+int vts_resize(vts_screen *s, int rows, int cols) {
+  if (rows < 1) rows = 1;
+  if (cols < 1) cols = 1;
+  if (rows == s->rows && cols == s->cols) { return 0; }
+  if (alloc_screen(s, rows, cols, s) < 0) { return -1; }  /* Handle error. */
+
+  s->row = clamp(s->row, 0, rows - 1);
+  s->col = clamp(s->col, 0, cols - 1);
+  s->saved.row = clamp(s->saved.row, 0, rows - 1);
+  s->saved.col = clamp(s->saved.col, 0, cols - 1);
+  s->wrap_pending = 0;
+  s->top = 0;
+  s->bottom = rows - 1;
+  mark_rows(s, 0, rows - 1);
+  return 0;
+}  /* vts_resize */
+
+
+/*
+ * Apply a chunk of the child's output.
+ */
+void vts_feed(vts_screen *s, const char *buf, size_t len) {
+  vtp_feed(&s->vtp, buf, len, on_event, s);
+}  /* vts_feed */
+
+
+/*
+ * Have queries in the output answered through cb (NULL: don't answer).
+ */
+void vts_set_reply(vts_screen *s, vtq_reply_fn cb, void *arg) {
+  s->reply = cb;
+  s->reply_arg = arg;
+}  /* vts_set_reply */
+
+
+/*
+ * Copy the dirty rows' numbers to rows (room for s->rows), unmark them
+ * and return how many.
+ */
+int vts_take_dirty(vts_screen *s, int *rows) {
+  int i, n = s->n_dirty;
+
+  for (i = 0; i < n; i++) {
+    rows[i] = s->dirty_list[i];
+    s->dirty[rows[i]] = 0;
+  }
+  s->n_dirty = 0;
+  return n;
+}  /* vts_take_dirty */
+
+
+/*
+ * Row's text as UTF-8 with trailing blanks dropped, NUL-terminated.
+ * Returns its length.  size should be VTS_ROW_TEXT_MAX(s); a smaller
+ * buffer cuts the text at a character boundary.
+ */
+size_t vts_row_text(const vts_screen *s, int row, char *buf, size_t size) {
+  const vts_cell *line = s->line[row];
+  size_t n = 0, keep = 0;
+  int c;
+
+  if (size == 0) { return 0; }
+  for (c = 0; c < s->cols; c++) {
+    uint32_t ch = line[c].ch;
+    char u[4];
+    size_t k;
+
+    if (ch == 0) continue;   /* right half of a wide character */
+    if (ch < 0x80) {
+      u[0] = (char)ch;
+      k = 1;
+    } else if (ch < 0x800) {
+      u[0] = (char)(0xC0 | (ch >> 6));
+      u[1] = (char)(0x80 | (ch & 0x3F));
+      k = 2;
+    } else if (ch < 0x10000) {
+      u[0] = (char)(0xE0 | (ch >> 12));
+      u[1] = (char)(0x80 | ((ch >> 6) & 0x3F));
+      u[2] = (char)(0x80 | (ch & 0x3F));
+      k = 3;
+    } else {
+      u[0] = (char)(0xF0 | (ch >> 18));
+      u[1] = (char)(0x80 | ((ch >> 12) & 0x3F));
+      u[2] = (char)(0x80 | ((ch >> 6) & 0x3F));
+      u[3] = (char)(0x80 | (ch & 0x3F));
+      k = 4;
+    }
+    if (n + k >= size) break;
+    memcpy(buf + n, u, k);
+    n += k;
+    if (ch != ' ') keep = n;
+  }
+  buf[keep] = '\0';
+  return keep;
+}  /* vts_row_text */
@@ -0,0 +1,117 @@
+/* vtscreen.h - Headless terminal screen model.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* What a terminal would be showing after a child's output: a grid of
+ * cells (character, colors, attributes), the cursor, and the window
+ * title.  vts_feed() runs the output through vtparse and applies it the
+ * way xterm does for what full-screen programs actually send: cursor
+ * addressing, erase/insert/delete, scroll regions, SGR, autowrap, the
+ * alternate screen, DEC line drawing.
+ *
+ * Every row that changes is marked dirty, so a reader that keeps its
+ * own copy only needs to look at vts_take_dirty()'s rows to catch up.
+ * With vts_set_reply(), queries (vtquery.h) are answered from the
+ * model: the cursor position is the real one.
+ * Memory is allocated by vts_init() and vts_resize() only.  Plain C with
+ * no OS calls.
+ */
+
+#ifndef VTSCREEN_H
+#define VTSCREEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vtparse.h"
+#include "vtquery.h"
+
+/* Cell colors: default, palette index, or 24-bit RGB. */
+#define VTS_COLOR_DEFAULT   0
+#define VTS_COLOR_INDEX(n)  ((1u << 24) | (uint32_t)(n))
+#define VTS_COLOR_RGB(r, g, b) \
+  ((2u << 24) | ((uint32_t)(r) << 16) | ((uint32_t)(g) << 8) | (uint32_t)(b))
+#define VTS_COLOR_KIND(c)   ((c) >> 24)   /* 0, 1 or 2 as above */
+
+/* Cell attributes. */
+#define VTS_BOLD      0x01
+#define VTS_DIM       0x02
+#define VTS_ITALIC    0x04
+#define VTS_UNDERLINE 0x08
+#define VTS_BLINK     0x10
+#define VTS_INVERSE   0x20
+#define VTS_HIDDEN    0x40
+#define VTS_STRIKE    0x80
+
+#define VTS_TITLE_MAX 256
+
+typedef struct {
+  uint32_t ch;        /* code point; 0 for the right half of a wide one */
+  uint32_t fg, bg;
+  uint16_t attr;
+} vts_cell;
+
+typedef struct {
+  int row, col;
+  vts_cell pen;
+  int origin;
+  unsigned char charset[2];
+  int gl;
+} vts_saved;
+
+typedef struct {
+  int rows, cols;
+  vts_cell **line;          /* line[r]: row r of the screen shown */
+  vts_cell **other;         /* the screen not shown (main or alternate) */
+  vts_cell *store;          /* cells for both */
+  int alt;                  /* alternate screen shown */
+
+  int row, col;             /* cursor, 0-based */
+  int wrap_pending;         /* next character goes to the next line */
+  vts_cell pen;             /* colors/attributes for new characters */
+  int top, bottom;          /* scroll region, inclusive */
+  int autowrap, origin, insert, cursor_visible;
+  unsigned char charset[2]; /* G0, G1: 'B' ASCII or '0' line drawing */
+  int gl;                   /* which of them is in use */
+  vts_saved saved;          /* DECSC */
+  uint32_t last_ch;         /* for REP */
+
+  uint32_t utf8_cp;         /* a character split across feeds */
+  int utf8_need;
+
+  unsigned char *dirty;     /* dirty[r]: r is on dirty_list */
+  int *dirty_list;
+  int n_dirty;
+
+  char title[VTS_TITLE_MAX];
+
+  unsigned long long n_row_updates;    /* counters */
+  unsigned long long n_scrolls;
+
+  vtq_reply_fn reply;       /* answers to queries, or NULL */
+  void *reply_arg;
+
+  vtp_parser vtp;
+} vts_screen;
+
+int vts_init(vts_screen *s, int rows, int cols);
+void vts_free(vts_screen *s);
+int vts_resize(vts_screen *s, int rows, int cols);
+void vts_feed(vts_screen *s, const char *buf, size_t len);
+void vts_set_reply(vts_screen *s, vtq_reply_fn cb, void *arg);
+int vts_take_dirty(vts_screen *s, int *rows);
+size_t vts_row_text(const vts_screen *s, int row, char *buf, size_t size);
+
+/* Most bytes vts_row_text() writes, NUL included. */
+#define VTS_ROW_TEXT_MAX(s) ((size_t)(s)->cols * 4 + 1)
+
+#endif  /* VTSCREEN_H */
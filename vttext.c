@@ -0,0 +1,276 @@
+/* vttext.c - Plain-text transcript of terminal output.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Most output is printable text with a control character every line
+ * or so, so the work is in not looking at that text twice.  While the
+ * parser is in ground, scan_find() (vtscan.c) jumps to the next C0
+ * control or DEL with a vector compare, and the run before it is
+ * copied into the line in one piece when the cursor is at the end of
+ * the line, which it almost always is.  LF, CR, BS and TAB are handled
+ * right there; only an ESC goes through vtparse.c, and only until its
+ * sequence ends.
+ *
+ * The cursor is a byte offset into the line.  Text written before the
+ * end replaces whole characters (a UTF-8 continuation byte is inserted
+ * after the lead byte just written), so it stays right across a
+ * character split between reads.  Columns are characters; wide
+ * characters count as one, which only matters to cursor moves.
+ *
+ * Handled:
+ *   LF VT FF      write the line and start a new one
+ *   CR            column 1
+ *   BS            back one character
+ *   TAB           kept as a character
+ *   ESC[K         erase to the end (0), the start (1) or all (2) of the line
+ *   ESC[G ESC[`   column n
+ *   ESC[C ESC[D   forward / back n columns
+ * Every other control, escape and string sequence is dropped.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vttext.h"
+
+#define IS_CONT(c) (((unsigned char)(c) & 0xC0) == 0x80)
+
+
+/*
+ * The line buffer has room for VTT_LINE_MAX bytes and the LF that ends
+ * them.
+ */
+int vtt_init(vtt_state *t, vtt_write_fn out, void *arg) {
+  memset(t, 0, sizeof(*t));
+  t->line = (char *)malloc(VTT_LINE_MAX + 1);
+  if (t->line == NULL) { return -1; }  /* Handle error. */
+  t->out = out;
+  t->arg = arg;
+  scan_set_init(&t->ctl);
+  scan_set_add_controls(&t->ctl);
+  vtp_init(&t->vtp, 0);
+  return 0;
+}  /* vtt_init */
+
+
+void vtt_free(vtt_state *t) {
+  free(t->line);
+  t->line = NULL;
+}  /* vtt_free */
+
+
+/*
+ * Write the line out, with an LF if nl, and start an empty one.
+ */
+static void end_line(vtt_state *t, int nl) {
+  if (nl) {
+    t->line[t->len++] = '\n';
+    t->lines++;
+  }
+  if (t->len > 0)
+    t->out(t->arg, t->line, t->len);
+  t->len = 0;
+  t->pos = 0;
+}  /* end_line */
+
+
+/*
+ * Make room for n more bytes, cutting the line if it's full.
+ */
+static void make_room(vtt_state *t, size_t n) {
+  if (t->len + n > VTT_LINE_MAX)
+    end_line(t, 0);
+}  /* make_room */
+
+
+/*
+ * Byte offset just past the character at p.
+ */
+static size_t char_end(const vtt_state *t, size_t p) {
+  for (p++; p < t->len && IS_CONT(t->line[p]); p++) {}
+  return p;
+}  /* char_end */
+
+
+/*
+ * Characters before the cursor.
+ */
+static int column(const vtt_state *t) {
+  size_t p;
+  int col = 0;
+
+  for (p = 0; p < t->pos; p++)
+    col += !IS_CONT(t->line[p]);
+  return col;
+}  /* column */
+
+
+/*
+ * Put the cursor at column col, padding the line with spaces if it's
+ * shorter.
+ */
+static void move_to(vtt_state *t, int col) {
+  size_t p = 0;
+
+  if (col < 0) col = 0;
+  while (col > 0 && p < t->len) {
+    p = char_end(t, p);
+    col--;
+  }
+  t->pos = p;
+  while (col-- > 0) {
+    make_room(t, 1);
+    t->line[t->len++] = ' ';
+    t->pos = t->len;
+  }
+}  /* move_to */
+
+
+/*
+ * Replace the characters from the start of the line to through (if
+ * through) the cursor's with spaces.
+ */
+static void blank_start(vtt_state *t, int through) {
+  size_t end = (through && t->pos < t->len) ? char_end(t, t->pos) : t->pos;
+  int n = 0;
+  size_t p;
+
+  for (p = 0; p < end; p++)
+    n += !IS_CONT(t->line[p]);
+  memmove(t->line + n, t->line + end, t->len - end);
+  memset(t->line, ' ', (size_t)n);
+  t->len -= end - (size_t)n;
+  t->pos -= end - (size_t)n;
+}  /* blank_start */
+
+
+/*
+ * Write n bytes of text at the cursor.
+ */
+static void put(vtt_state *t, const char *buf, size_t n) {
+  size_t i = 0;
+
+  /* Over existing text: a character at a time. */
+  while (i < n && t->pos < t->len) {
+    unsigned char c = (unsigned char)buf[i++];
+    size_t end = IS_CONT(c) ? t->pos : char_end(t, t->pos);
+    if (end == t->pos + 1) {
+      t->line[t->pos++] = (char)c;
+      continue;
+    }
+    if (end == t->pos && t->len == VTT_LINE_MAX) {
+      end_line(t, 0);
+      t->line[t->len++] = (char)c;
+      t->pos = t->len;
+      continue;
+    }
+    memmove(t->line + t->pos + 1, t->line + end, t->len - end);
+    t->len = t->len + 1 - (end - t->pos);
+    t->line[t->pos++] = (char)c;
+  }
+
+  /* At the end: straight copies. */
+  while (i < n) {
+    size_t room = VTT_LINE_MAX - t->len;
+    size_t k = (n - i < room) ? n - i : room;
+    memcpy(t->line + t->len, buf + i, k);
+    t->len += k;
+    t->pos = t->len;
+    i += k;
+    if (i < n) end_line(t, 0);
+  }
+}  /* put */
+
+
+static void control(vtt_state *t, unsigned char c) {
+  switch (c) {
+  case '\n': case '\v': case '\f':
+    end_line(t, 1);
+    break;
+  case '\r':
+    t->pos = 0;
+    break;
+  case '\b':
+    while (t->pos > 0 && IS_CONT(t->line[--t->pos])) {}
+    break;
+  case '\t':
+    put(t, "\t", 1);
+    break;
+  }
+}  /* control */
+
+
+static void csi(vtt_state *t, const vtp_event *ev) {
+  if (ev->prefix != 0 || ev->n_inter != 0) { return; }
+  switch (ev->final) {
+  case 'K':
+    switch (vtp_param(ev, 0, 0)) {
+    case 0: t->len = t->pos; break;
+    case 1: blank_start(t, 1); break;
+    case 2: blank_start(t, 0); t->len = t->pos; break;
+    }
+    break;
+  case 'G': case '`':
+    move_to(t, vtp_param(ev, 0, 1) - 1);
+    break;
+  case 'C':
+    move_to(t, column(t) + vtp_param(ev, 0, 1));
+    break;
+  case 'D':
+    move_to(t, column(t) - vtp_param(ev, 0, 1));
+    break;
+  }
+}  /* csi */
+
+
+static void vtt_event(void *arg, const vtp_event *ev) {
+  vtt_state *t = (vtt_state *)arg;
+
+  switch (ev->type) {
+  case VTP_PRINT: put(t, ev->data, ev->len); break;
+  case VTP_EXECUTE: control(t, ev->final); break;
+  case VTP_CSI: csi(t, ev); break;
+  }
+}  /* vtt_event */
+
+
+/*
+ * Add a chunk of output.  Lines it completes are written out.
+ */
+void vtt_feed(vtt_state *t, const char *buf, size_t len) {
+  size_t i = 0;
+
+  while (i < len) {
+    if (vtp_in_ground(&t->vtp)) {
+      size_t n = scan_find(&t->ctl, buf + i, len - i);
+      if (n > 0) {
+        put(t, buf + i, n);
+        i += n;
+        if (i == len) break;
+      }
+      if (buf[i] != 0x1B) {
+        control(t, (unsigned char)buf[i++]);
+        continue;
+      }
+    }
+    i += vtp_feed_sequence(&t->vtp, buf + i, len - i, vtt_event, t);
+  }
+}  /* vtt_feed */
+
+
+/*
+ * The output is over: write the last line if it has anything in it
+ * (a prompt, say), without adding an LF.
+ */
+void vtt_finish(vtt_state *t) {
+  end_line(t, 0);
+}  /* vtt_finish */
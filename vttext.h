@@ -0,0 +1,56 @@
+/* vttext.h - Plain-text transcript of terminal output.
+ * See https://github.com/fordsfords/minpty for documentation. */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/minpty
+ */
+
+/* Turns a child's output into the text a person would have read, one
+ * line at a time, without keeping a whole screen: escape sequences
+ * (CSI, OSC, DCS, ...) are dropped, and CR, backspace, cursor moves
+ * within the line and erase-in-line rewrite the current line the way a
+ * terminal would, so a progress bar ends up as its last state instead
+ * of every frame glued together.  Each line is handed to the caller's
+ * write function when its LF arrives.
+ *
+ * Memory is allocated by vtt_init() only.  Plain C with no OS calls.
+ */
+
+#ifndef VTTEXT_H
+#define VTTEXT_H
+
+#include <stddef.h>
+
+#include "vtparse.h"
+#include "vtscan.h"
+
+/* A line longer than this is written out as it stands and a new one
+ * begun; a later CR only reaches back to the cut. */
+#define VTT_LINE_MAX (64 * 1024)
+
+/* Called with transcript text to write. */
+typedef void (*vtt_write_fn)(void *arg, const char *buf, size_t len);
+
+typedef struct {
+  char *line;               /* the current line, UTF-8 */
+  size_t len;
+  size_t pos;               /* cursor, a byte offset; len: at the end */
+  vtt_write_fn out;
+  void *arg;
+  unsigned long long lines; /* written so far */
+  scan_set ctl;             /* the control characters */
+  vtp_parser vtp;
+} vtt_state;
+
+int vtt_init(vtt_state *t, vtt_write_fn out, void *arg);
+void vtt_free(vtt_state *t);
+void vtt_feed(vtt_state *t, const char *buf, size_t len);
+void vtt_finish(vtt_state *t);
+
+#endif  /* VTTEXT_H */